@@ -0,0 +1,687 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "prvs.hpp"
+#include "key.hpp"
+#include "common.hpp"
+#include "address.hpp"
+#include "daemon-client.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <vector>
+#include <string>
+#include <string.h>
+
+using namespace batv;
+
+namespace {
+	void print_usage (const char* argv0)
+	{
+		std::clog << "Usage: " << argv0 << " [OPTIONS...]" << std::endl;
+		std::clog << "Options:" << std::endl;
+		std::clog << " -k KEY_FILE        -- path to key file (default: ~/.batv-key)" << std::endl;
+		std::clog << " -K KEY_MAP_FILE    -- path to key map file (default: ~/.batv-keys)" << std::endl;
+		std::clog << " -s SOCKET          -- path to socket (default: $BATV_SOCKET or ~/.batv-socket," << std::endl;
+		std::clog << "                       unless -S, -T, or -P is specified)" << std::endl;
+		std::clog << " -S SOCKET          -- serve Postfix socketmap lookups on this socket" << std::endl;
+		std::clog << " -T MAP:SOCKET      -- serve Postfix tcp_table lookups of MAP on this socket" << std::endl;
+		std::clog << " -P SOCKET          -- serve keys to batv-milter (key-provider) on this socket" << std::endl;
+		std::clog << " -t TTL             -- seconds for which key-provider clients may cache keys (default: 300)" << std::endl;
+		std::clog << " -l LIFETIME        -- lifetime, in days, of BATV addresses, for lookups (default: 7)" << std::endl;
+		std::clog << " -d SUB_ADDR_DELIM  -- sub address delimiter, for lookups (default: none, i.e." << std::endl;
+		std::clog << "                       use the standard BATV syntax)" << std::endl;
+		std::clog << " -M SOCKET_MODE     -- permissions of -S and -T sockets, in octal (default: 600;" << std::endl;
+		std::clog << "                       other sockets are always 600)" << std::endl;
+		std::clog << " -p PID_FILE        -- write PID to this file" << std::endl;
+		std::clog << " -f                 -- run in the foreground" << std::endl;
+	}
+
+	struct Daemon_config {
+		std::string		key_file;
+		std::string		key_map_file;
+		Key_map			keys;			// map from sender address/domain to their HMAC key
+		Key_entry		default_key;		// key to use if address/domain not in key map
+		unsigned int		lookup_lifetime;	// in days, how long BATV address is valid (for lookups)
+		char			lookup_delimiter;	// sub-address delimiter (for lookups), or 0 for standard syntax
+		unsigned int		key_ttl;		// in seconds, how long key-provider clients may cache keys
+
+		Daemon_config ()
+		{
+			lookup_lifetime = 7;
+			lookup_delimiter = 0;
+			key_ttl = 300;
+		}
+
+		Key_ref			get_key (const std::string& sender_address) const
+		{
+			return batv::get_key(keys, sender_address, !default_key.empty() ? &default_key : NULL);
+		}
+		bool			may_have_key (const std::string& domain) const
+		{
+			return !default_key.empty() || keys.may_have_key(domain);
+		}
+
+		void			load ()
+		{
+			Key_map		new_keys;
+			Key_entry	new_default_key;
+			if (!key_file.empty()) {
+				std::ifstream	key_in(key_file.c_str());
+				if (!key_in) {
+					throw Config_error("Unable to open key file " + key_file);
+				}
+				load_key(new_default_key, key_in);
+			}
+			if (!key_map_file.empty()) {
+				std::ifstream	key_map_in(key_map_file.c_str());
+				if (!key_map_in) {
+					throw Config_error("Unable to open key map " + key_map_file);
+				}
+				Key_map_stats	stats;
+				load_key_map(new_keys, key_map_in, &stats);
+				std::clog << "Loaded key map " << key_map_file << ": " << stats << std::endl;
+			}
+			keys.swap(new_keys);
+			default_key.swap(new_default_key);
+		}
+	};
+
+	enum Protocol {
+		PROTOCOL_NATIVE,	// see doc/daemon.txt
+		PROTOCOL_SOCKETMAP,	// Postfix socketmap (netstrings)
+		PROTOCOL_TCP_TABLE,	// Postfix tcp_table
+		PROTOCOL_KEY_PROVIDER	// key provider for batv-milter (see Socket_key_provider)
+	};
+
+	struct Listener {
+		int			fd;
+		Protocol		protocol;
+		std::string		socket_path;
+		std::string		map_name;	// for PROTOCOL_TCP_TABLE
+	};
+
+	struct Client {
+		int			fd;
+		const Listener*		listener;
+		std::string		in;
+		std::string		out;
+	};
+
+	// Socketmap requests can be up to this long, per the Postfix documentation
+	const size_t		max_request_len = 100000;
+
+	volatile sig_atomic_t	got_term_signal = 0;
+	volatile sig_atomic_t	got_sighup = 0;
+
+	void handle_term_signal (int)
+	{
+		got_term_signal = 1;
+	}
+
+	void handle_sighup (int)
+	{
+		got_sighup = 1;
+	}
+
+	int sign (const Daemon_config& config, unsigned int lifetime, char sub_address_delimiter, const char* address, std::string& result)
+	{
+		Key_ref			key = config.get_key(address);
+		if (!key || !key->can_sign()) {
+			return DAEMON_NO_KEY;
+		}
+		Email_address		from_address;
+		from_address.parse(address);
+		if (from_address.domain.empty()) {
+			return DAEMON_NO_DOMAIN;
+		}
+		result = prvs_generate(from_address, lifetime, *key).make_string(sub_address_delimiter);
+		return DAEMON_OK;
+	}
+
+	int validate (const Daemon_config& config, unsigned int lifetime, char sub_address_delimiter, const char* address, std::string& result)
+	{
+		Email_address		rcpt_to;
+		Batv_address		batv_rcpt;
+		rcpt_to.parse(address);
+		if (!batv_rcpt.parse(rcpt_to, sub_address_delimiter) || batv_rcpt.tag_type != "prvs") {
+			return DAEMON_NOT_BATV;
+		}
+		result = batv_rcpt.orig_mailfrom.make_string();
+		if (!config.may_have_key(batv_rcpt.orig_mailfrom.domain)) {
+			return DAEMON_NO_KEY;
+		}
+		Key_ref			key = config.get_key(result);
+		if (!key) {
+			return DAEMON_NO_KEY;
+		}
+		return prvs_validate(batv_rcpt, lifetime, *key) ? DAEMON_OK : DAEMON_INVALID;
+	}
+
+	// Handle one request line (sans newline), appending the response to out
+	void handle_request (const Daemon_config& config, const std::string& line, std::string& out)
+	{
+		// COMMAND SP LIFETIME SP SUB-ADDRESS-DELIMITER SP ADDRESS
+		std::string		result;
+		int			code = DAEMON_BAD_REQUEST;
+		const char*		p = line.c_str();
+		if (!has_control_chars(line) && (p[0] == 'S' || p[0] == 'V') && p[1] == ' ') {
+			char*		lifetime_end;
+			unsigned long	lifetime = std::strtoul(p + 2, &lifetime_end, 10);
+			if (lifetime_end != p + 2 && lifetime >= 1 && lifetime <= 999 &&
+					lifetime_end[0] == ' ' && lifetime_end[1] && lifetime_end[2] == ' ') {
+				char		sub_address_delimiter = lifetime_end[1];
+				const char*	address = lifetime_end + 3;
+				if (p[0] == 'S') {
+					code = sign(config, lifetime, sub_address_delimiter, address, result);
+				} else {
+					code = validate(config, lifetime, sub_address_delimiter, address, result);
+				}
+			}
+		}
+
+		std::ostringstream	response;
+		response << code << ' ' << result << '\n';
+		out.append(response.str());
+	}
+
+	enum Lookup_result {
+		LOOKUP_FOUND,
+		LOOKUP_NOT_FOUND,
+		LOOKUP_BAD_MAP
+	};
+
+	// Look up a recipient address in one of the lookup maps:
+	//  unsign: the original address, if the address is a validly-signed BATV address
+	//  status: "valid" or "invalid", if the address is a BATV address of a sender with a key
+	//  access: a REJECT action, if the address is a BATV address with an invalid signature
+	Lookup_result lookup (const Daemon_config& config, const std::string& map_name, const std::string& key, std::string& value)
+	{
+		if (map_name != "unsign" && map_name != "status" && map_name != "access") {
+			return LOOKUP_BAD_MAP;
+		}
+
+		std::string		orig_address;
+		int			code = validate(config, config.lookup_lifetime, config.lookup_delimiter, key.c_str(), orig_address);
+		if (code != DAEMON_OK && code != DAEMON_INVALID) {
+			return LOOKUP_NOT_FOUND;
+		}
+
+		if (map_name == "unsign") {
+			if (code != DAEMON_OK) {
+				return LOOKUP_NOT_FOUND;
+			}
+			value = orig_address;
+		} else if (map_name == "status") {
+			value = code == DAEMON_OK ? "valid" : "invalid";
+		} else {
+			if (code == DAEMON_OK) {
+				return LOOKUP_NOT_FOUND;
+			}
+			value = "REJECT Invalid BATV signature";
+		}
+		return LOOKUP_FOUND;
+	}
+
+	void append_netstring (std::string& out, const std::string& data)
+	{
+		std::ostringstream	len;
+		len << data.size();
+		out.append(len.str()).append(":").append(data).append(",");
+	}
+
+	// Handle the socketmap requests (netstrings of the form "NAME SP KEY") in the client's
+	// input buffer.  Returns false if the input is malformed.
+	bool handle_socketmap_requests (const Daemon_config& config, Client& client)
+	{
+		std::string::size_type	start = 0;
+		bool			ok = true;
+		while (start < client.in.size()) {
+			std::string::size_type	colon_pos = client.in.find(':', start);
+			if (colon_pos == std::string::npos) {
+				ok = client.in.size() - start < 10;	// length prefix can't be this long
+				break;
+			}
+			char*			len_end;
+			unsigned long		len = std::strtoul(client.in.c_str() + start, &len_end, 10);
+			if (len_end != client.in.c_str() + colon_pos || colon_pos == start || len > max_request_len) {
+				ok = false;
+				break;
+			}
+			if (client.in.size() - (colon_pos + 1) < len + 1) {
+				break;	// wait for the rest of the netstring
+			}
+			if (client.in[colon_pos + 1 + len] != ',') {
+				ok = false;
+				break;
+			}
+
+			std::string		request(client.in, colon_pos + 1, len);
+			std::string::size_type	space_pos = request.find(' ');
+			std::string		value;
+			Lookup_result		result = LOOKUP_BAD_MAP;
+			if (space_pos != std::string::npos) {
+				result = lookup(config, request.substr(0, space_pos), request.substr(space_pos + 1), value);
+			}
+			if (result == LOOKUP_FOUND) {
+				append_netstring(client.out, "OK " + value);
+			} else if (result == LOOKUP_NOT_FOUND) {
+				append_netstring(client.out, "NOTFOUND ");
+			} else {
+				append_netstring(client.out, "PERM Unknown map or malformed request");
+			}
+			start = colon_pos + 1 + len + 1;
+		}
+		client.in.erase(0, start);
+		return ok;
+	}
+
+	// Decode the %XX escapes used by tcp_table
+	std::string url_decode (const std::string& str)
+	{
+		std::string		decoded;
+		for (std::string::size_type i = 0; i < str.size(); ++i) {
+			if (str[i] == '%' && i + 2 < str.size() && std::isxdigit(static_cast<unsigned char>(str[i + 1])) && std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+				decoded.push_back(std::strtol(str.substr(i + 1, 2).c_str(), NULL, 16));
+				i += 2;
+			} else {
+				decoded.push_back(str[i]);
+			}
+		}
+		return decoded;
+	}
+
+	// Encode characters that would be unsafe in a tcp_table reply
+	std::string url_encode (const std::string& str)
+	{
+		std::string		encoded;
+		for (std::string::size_type i = 0; i < str.size(); ++i) {
+			unsigned char	ch = str[i];
+			if (ch <= ' ' || ch == '%' || ch >= 0x7F) {
+				char	escape[4];
+				std::sprintf(escape, "%%%02X", ch);
+				encoded.append(escape);
+			} else {
+				encoded.push_back(ch);
+			}
+		}
+		return encoded;
+	}
+
+	// Handle one tcp_table request line (sans newline), appending the response to out
+	void handle_tcp_table_request (const Daemon_config& config, const std::string& map_name, const std::string& line, std::string& out)
+	{
+		std::string		value;
+		if (line.compare(0, 4, "get ") == 0 && lookup(config, map_name, url_decode(line.substr(4)), value) == LOOKUP_FOUND) {
+			out.append("200 ").append(url_encode(value)).append("\n");
+		} else if (line.compare(0, 4, "get ") == 0) {
+			out.append("500 not found\n");
+		} else {
+			out.append("400 unsupported request\n");
+		}
+	}
+
+	// Handle one key provider request line (a sender address), appending the response to out
+	void handle_key_request (const Daemon_config& config, const std::string& line, std::string& out)
+	{
+		std::ostringstream	response;
+		Key_ref			key = config.get_key(line);
+		if (!key) {
+			response << "NONE " << config.key_ttl << '\n';
+		} else {
+			// List the current generation last, as the protocol requires
+			response << "OK " << config.key_ttl;
+			for (unsigned int i = 1; i <= Key_entry::MAX_GENERATIONS; ++i) {
+				unsigned int	generation = (key->current + i) % Key_entry::MAX_GENERATIONS;
+				if (const Key* k = key->get_generation(generation)) {
+					response << ' ' << generation << ":hex:";
+					for (size_t j = 0; j < k->size(); ++j) {
+						char	hex[3];
+						std::sprintf(hex, "%02x", (*k)[j]);
+						response << hex;
+					}
+				}
+			}
+			response << '\n';
+		}
+		out.append(response.str());
+	}
+
+	// Write as much pending output as possible.  Returns false if the client should be disconnected.
+	bool write_responses (Client& client)
+	{
+		while (!client.out.empty()) {
+			ssize_t		bytes_written = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+			if (bytes_written == -1) {
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+			client.out.erase(0, bytes_written);
+		}
+		return true;
+	}
+
+	// Read and handle whatever requests are available.  Returns false if the client should be disconnected.
+	bool read_requests (const Daemon_config& config, Client& client)
+	{
+		char			buffer[4096];
+		ssize_t			bytes_read;
+		while ((bytes_read = read(client.fd, buffer, sizeof(buffer))) > 0) {
+			client.in.append(buffer, bytes_read);
+		}
+		// If the client has gone away, still answer the requests it already sent
+		// (it may have just shut down its write side).
+		bool			at_eof = bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+
+		bool			ok;
+		if (client.listener->protocol == PROTOCOL_SOCKETMAP) {
+			ok = handle_socketmap_requests(config, client);
+		} else {
+			std::string::size_type	line_start = 0;
+			std::string::size_type	newline_pos;
+			while ((newline_pos = client.in.find('\n', line_start)) != std::string::npos) {
+				std::string	line(client.in, line_start, newline_pos - line_start);
+				if (client.listener->protocol == PROTOCOL_TCP_TABLE) {
+					handle_tcp_table_request(config, client.listener->map_name, line, client.out);
+				} else if (client.listener->protocol == PROTOCOL_KEY_PROVIDER) {
+					handle_key_request(config, line, client.out);
+				} else {
+					handle_request(config, line, client.out);
+				}
+				line_start = newline_pos + 1;
+			}
+			client.in.erase(0, line_start);
+			ok = client.in.size() < max_request_len;	// a request can't possibly be this long
+		}
+
+		if (at_eof) {
+			write_responses(client);
+			return false;
+		}
+		return ok;
+	}
+
+	int make_listener (const std::string& socket_path, int socket_mode)
+	{
+		struct sockaddr_un	addr;
+		if (socket_path.size() >= sizeof(addr.sun_path)) {
+			throw Config_error(socket_path + ": socket path too long");
+		}
+
+		// Refuse to start if another daemon is already listening, but remove a stale socket file
+		Daemon_client		existing;
+		if (existing.connect(socket_path)) {
+			throw Config_error(socket_path + ": another daemon is already listening on this socket");
+		}
+		unlink(socket_path.c_str());
+
+		std::memset(&addr, '\0', sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strcpy(addr.sun_path, socket_path.c_str());
+
+		int			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1) {
+			throw Config_error(std::string("socket: ") + strerror(errno));
+		}
+		mode_t			old_umask = umask(~socket_mode & 0777);
+		if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+			int		saved_errno = errno;
+			umask(old_umask);
+			close(fd);
+			throw Config_error(socket_path + ": " + strerror(saved_errno));
+		}
+		umask(old_umask);
+		if (listen(fd, 128) == -1) {
+			int		saved_errno = errno;
+			close(fd);
+			throw Config_error(std::string("listen: ") + strerror(saved_errno));
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		return fd;
+	}
+
+	void serve (Daemon_config& config, const std::vector<Listener>& listeners)
+	{
+		std::vector<Client>		clients;
+		std::vector<struct pollfd>	pollfds;
+
+		while (!got_term_signal) {
+			if (got_sighup) {
+				got_sighup = 0;
+				try {
+					config.load();
+				} catch (const Config_error& e) {
+					std::clog << "Failed to reload keys: " << e.message << std::endl;
+				}
+			}
+
+			const size_t	num_listeners = listeners.size();
+			pollfds.resize(num_listeners + clients.size());
+			for (size_t i = 0; i < num_listeners; ++i) {
+				pollfds[i].fd = listeners[i].fd;
+				pollfds[i].events = POLLIN;
+			}
+			for (size_t i = 0; i < clients.size(); ++i) {
+				pollfds[num_listeners + i].fd = clients[i].fd;
+				pollfds[num_listeners + i].events = clients[i].out.empty() ? POLLIN : POLLOUT;
+			}
+
+			if (poll(&pollfds[0], pollfds.size(), -1) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw Config_error(std::string("poll: ") + strerror(errno));
+			}
+
+			// Service existing clients (iterating backwards so we can remove as we go)
+			for (size_t i = clients.size(); i-- > 0; ) {
+				short		revents = pollfds[num_listeners + i].revents;
+				bool		ok = true;
+				if (revents & POLLOUT) {
+					ok = write_responses(clients[i]);
+				} else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+					ok = read_requests(config, clients[i]) && write_responses(clients[i]);
+				}
+				if (!ok) {
+					close(clients[i].fd);
+					clients[i] = clients.back();
+					clients.pop_back();
+				}
+			}
+
+			// Accept new clients
+			for (size_t i = 0; i < num_listeners; ++i) {
+				if (pollfds[i].revents & POLLIN) {
+					int		fd;
+					while ((fd = accept(listeners[i].fd, NULL, NULL)) != -1) {
+						fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+						clients.push_back(Client());
+						clients.back().fd = fd;
+						clients.back().listener = &listeners[i];
+					}
+				}
+			}
+		}
+
+		for (size_t i = 0; i < clients.size(); ++i) {
+			close(clients[i].fd);
+		}
+	}
+}
+
+int main (int argc, char** argv)
+try {
+	Daemon_config	config;
+	std::string	socket_path;
+	std::vector<Listener> listeners;
+	int		socket_mode = 0600;
+	std::string	pid_file;
+	bool		foreground = false;
+
+	int		flag;
+	while ((flag = getopt(argc, argv, "k:K:s:S:T:P:t:l:d:M:p:f")) != -1) {
+		switch (flag) {
+		case 'k':
+			config.key_file = optarg;
+			break;
+		case 'K':
+			config.key_map_file = optarg;
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'S':
+			listeners.push_back(Listener());
+			listeners.back().protocol = PROTOCOL_SOCKETMAP;
+			listeners.back().socket_path = optarg;
+			break;
+		case 'T':
+			if (!std::strchr(optarg, ':')) {
+				std::clog << argv[0] << ": tcp_table listener (as specified by -T) must be of the form MAP:SOCKET" << std::endl;
+				return 1;
+			}
+			listeners.push_back(Listener());
+			listeners.back().protocol = PROTOCOL_TCP_TABLE;
+			listeners.back().map_name.assign(optarg, std::strchr(optarg, ':'));
+			listeners.back().socket_path = std::strchr(optarg, ':') + 1;
+			break;
+		case 'P':
+			listeners.push_back(Listener());
+			listeners.back().protocol = PROTOCOL_KEY_PROVIDER;
+			listeners.back().socket_path = optarg;
+			break;
+		case 't':
+			config.key_ttl = std::atoi(optarg);
+			if (config.key_ttl < 1 || config.key_ttl > 86400) {
+				std::clog << argv[0] << ": key TTL (as specified by -t) must be between 1 and 86400 seconds, inclusive" << std::endl;
+				return 1;
+			}
+			break;
+		case 'l':
+			config.lookup_lifetime = std::atoi(optarg);
+			if (config.lookup_lifetime < 1 || config.lookup_lifetime > 999) {
+				std::clog << argv[0] << ": address lifetime (as specified by -l) must be between 1 and 999, inclusive" << std::endl;
+				return 1;
+			}
+			break;
+		case 'd':
+			if (std::strlen(optarg) != 1) {
+				std::clog << argv[0] << ": sub address delimiter (as specified by -d) must be exactly one character" << std::endl;
+				return 1;
+			}
+			config.lookup_delimiter = optarg[0];
+			break;
+		case 'M':
+			if (std::strlen(optarg) != 3 ||
+					optarg[0] < '0' || optarg[0] > '7' ||
+					optarg[1] < '0' || optarg[1] > '7' ||
+					optarg[2] < '0' || optarg[2] > '7') {
+				std::clog << argv[0] << ": socket mode (as specified by -M) must be a 3 digit octal number" << std::endl;
+				return 1;
+			}
+			socket_mode = ((optarg[0] - '0') << 6) | ((optarg[1] - '0') << 3) | (optarg[2] - '0');
+			break;
+		case 'p':
+			pid_file = optarg;
+			break;
+		case 'f':
+			foreground = true;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (argc - optind != 0) {
+		print_usage(argv[0]);
+		return 2;
+	}
+
+	// Load the default key and key map
+	check_personal_key_path(config.key_file, ".batv-key");
+	check_personal_key_path(config.key_map_file, ".batv-keys");
+
+	if (config.key_file.empty() && config.key_map_file.empty()) {
+		std::clog << argv[0] << ": Neither ~/.batv-key nor ~/.batv-keys exist." << std::endl;
+		std::clog << "Please create one and/or the other or specify alternative paths using -k or -K" << std::endl;
+		return 1;
+	}
+	config.load();
+
+	// The native protocol listener is created by default only if there are no lookup listeners
+	if (!socket_path.empty() || listeners.empty()) {
+		listeners.push_back(Listener());
+		listeners.back().protocol = PROTOCOL_NATIVE;
+		listeners.back().socket_path = !socket_path.empty() ? socket_path : daemon_socket_path();
+	}
+	for (size_t i = 0; i < listeners.size(); ++i) {
+		// -M is only for letting the MTA do lookups.  The native socket signs addresses
+		// and the key provider socket hands out keys, so only our own user may connect to them.
+		bool		is_lookup = listeners[i].protocol == PROTOCOL_SOCKETMAP || listeners[i].protocol == PROTOCOL_TCP_TABLE;
+		listeners[i].fd = make_listener(listeners[i].socket_path, is_lookup ? socket_mode : 0600);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, handle_term_signal);
+	signal(SIGINT, handle_term_signal);
+	signal(SIGHUP, handle_sighup);
+
+	if (!foreground) {
+		daemonize(pid_file, "");
+	}
+
+	serve(config, listeners);
+
+	for (size_t i = 0; i < listeners.size(); ++i) {
+		close(listeners[i].fd);
+		unlink(listeners[i].socket_path.c_str());
+	}
+	if (!pid_file.empty()) {
+		unlink(pid_file.c_str());
+	}
+	return 0;
+
+} catch (const Config_error& e) {
+	std::clog << argv[0] << ": " << e.message << std::endl;
+	return 1;
+}
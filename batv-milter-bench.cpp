@@ -0,0 +1,716 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "milter-client.hpp"
+#include "prvs.hpp"
+#include "address.hpp"
+#include "key.hpp"
+#include "common.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+using namespace batv;
+
+namespace {
+	void print_usage (const char* argv0)
+	{
+		std::clog << "Usage: " << argv0 << " -s SOCKET -k KEY_FILE [OPTIONS...]" << std::endl;
+		std::clog << "Drives a running batv-milter over the milter protocol and reports latency." << std::endl;
+		std::clog << "The milter must use KEY_FILE for SIGNED_SENDER, and have no key for UNSIGNED_SENDER." << std::endl;
+		std::clog << "Options:" << std::endl;
+		std::clog << " -s SOCKET          -- milter socket (/PATH, unix:PATH, inet:PORT@HOST, inet6:PORT@HOST)" << std::endl;
+		std::clog << " -k KEY_FILE        -- key used by the milter for SIGNED_SENDER" << std::endl;
+		std::clog << " -f SIGNED_SENDER   -- sender which has a key (default: alice@batv.example)" << std::endl;
+		std::clog << " -u UNSIGNED_SENDER -- sender which has no key (default: bob@nokey.example)" << std::endl;
+		std::clog << " -c CONCURRENCY     -- number of concurrent sessions (default: 100)" << std::endl;
+		std::clog << " -n SESSIONS        -- total number of sessions (default: 10000)" << std::endl;
+		std::clog << " -m MESSAGES        -- messages per session (default: 1)" << std::endl;
+		std::clog << " -I PERCENT         -- percentage of sessions from internal clients (default: 50)" << std::endl;
+		std::clog << " -S PERCENT         -- percentage of messages from SIGNED_SENDER (default: 50)" << std::endl;
+		std::clog << " -V PERCENT         -- percentage of messages to valid BATV recipients (default: 20)" << std::endl;
+		std::clog << " -X PERCENT         -- percentage of messages to invalid BATV recipients (default: 10)" << std::endl;
+		std::clog << " -E PERCENT         -- percentage of messages to expired BATV recipients (default: 5)" << std::endl;
+		std::clog << " -F PERCENT         -- percentage of messages with a forged X-Batv-Status header (default: 5)" << std::endl;
+		std::clog << " -H MIN:MAX         -- number of headers per message (default: 5:20)" << std::endl;
+		std::clog << " -i ADDRESS         -- IP address of internal clients (default: 127.0.0.1)" << std::endl;
+		std::clog << " -e ADDRESS         -- IP address of external clients (default: 192.0.2.1)" << std::endl;
+		std::clog << " -l LIFETIME        -- the milter's address lifetime, in days (default: 7)" << std::endl;
+		std::clog << " -d SUB_ADDR_DELIM  -- the milter's sub address delimiter (default: none)" << std::endl;
+		std::clog << " -M MODE            -- the milter's mode: sign, verify, or both (default: both)" << std::endl;
+		std::clog << " -D DAEMON_NAME     -- value of the {daemon_name} macro (default: none)" << std::endl;
+		std::clog << " -R SEED            -- random seed (default: 1)" << std::endl;
+	}
+
+	enum Phase {
+		PHASE_NEGOTIATE,
+		PHASE_CONNECT,
+		PHASE_HELO,
+		PHASE_MAIL,
+		PHASE_RCPT,
+		PHASE_DATA,
+		PHASE_HEADER,
+		PHASE_EOH,
+		PHASE_BODY,
+		PHASE_EOM,
+		NUM_PHASES,
+		PHASE_NONE = NUM_PHASES	// step not timed
+	};
+
+	const char*		phase_names[NUM_PHASES] = {
+		"negotiate", "connect", "helo", "mail", "rcpt", "data", "header", "eoh", "body", "eom"
+	};
+
+	enum Rcpt_kind {
+		RCPT_PLAIN,
+		RCPT_VALID,
+		RCPT_INVALID,
+		RCPT_EXPIRED
+	};
+
+	struct Bench_config {
+		std::string		socket_spec;
+		Key			key;
+		std::string		signed_sender;
+		std::string		unsigned_sender;
+		unsigned int		concurrency;
+		unsigned long		num_sessions;
+		unsigned int		messages_per_session;
+		unsigned int		internal_percent;
+		unsigned int		signed_percent;
+		unsigned int		valid_percent;
+		unsigned int		invalid_percent;
+		unsigned int		expired_percent;
+		unsigned int		forged_percent;
+		unsigned int		min_headers;
+		unsigned int		max_headers;
+		std::string		internal_address;
+		std::string		external_address;
+		unsigned int		address_lifetime;
+		char			sub_address_delimiter;
+		bool			do_sign;
+		bool			do_verify;
+		std::string		daemon_name;
+
+		Bench_config ()
+		{
+			signed_sender = "alice@batv.example";
+			unsigned_sender = "bob@nokey.example";
+			concurrency = 100;
+			num_sessions = 10000;
+			messages_per_session = 1;
+			internal_percent = 50;
+			signed_percent = 50;
+			valid_percent = 20;
+			invalid_percent = 10;
+			expired_percent = 5;
+			forged_percent = 5;
+			min_headers = 5;
+			max_headers = 20;
+			internal_address = "127.0.0.1";
+			external_address = "192.0.2.1";
+			address_lifetime = 7;
+			sub_address_delimiter = 0;
+			do_sign = true;
+			do_verify = true;
+		}
+	};
+
+	struct Message_plan {
+		bool			is_signed_sender;
+		Rcpt_kind		rcpt_kind;
+		std::string		env_from;
+		std::string		rcpt;
+		unsigned int		num_forged_headers;
+	};
+
+	struct Step {
+		char			command;
+		std::string		data;
+		Phase			phase;
+		size_t			message;	// index into Session::messages
+	};
+
+	struct Session {
+		int				fd;
+		bool				is_connecting;
+		bool				is_internal;
+		uint32_t			protocol;
+		std::vector<Message_plan>	messages;
+		std::vector<Step>		steps;
+		size_t				next_step;
+		bool				awaiting_reply;
+		double				sent_at;
+		std::string			in;
+		std::string			out;
+		std::vector<Milter_modification> mods;
+	};
+
+	struct Results {
+		std::vector<double>		latencies[NUM_PHASES];	// in microseconds
+		unsigned long			num_messages;
+		unsigned long			num_failures;
+		unsigned long			num_errors;
+
+		Results () : num_messages(0), num_failures(0), num_errors(0) { }
+	};
+
+	std::time_t		expired_clock_offset;
+
+	// A clock far enough in the past that addresses generated with it have expired
+	std::time_t expired_clock ()
+	{
+		return std::time(NULL) - expired_clock_offset;
+	}
+
+	std::time_t current_clock ()
+	{
+		return std::time(NULL);
+	}
+
+	std::string make_rcpt (const Bench_config& config, Rcpt_kind kind)
+	{
+		if (kind == RCPT_PLAIN) {
+			return "postmaster@recipient.example";
+		}
+
+		Email_address		orig;
+		orig.parse(config.signed_sender.c_str());
+		if (kind == RCPT_EXPIRED) {
+			expired_clock_offset = (config.address_lifetime + 2) * 86400;
+			set_prvs_clock(expired_clock);
+		}
+		Batv_address		batv_address(prvs_generate(orig, config.address_lifetime, config.key));
+		set_prvs_clock(current_clock);
+
+		if (kind == RCPT_INVALID) {
+			// Corrupt the last hex digit of the hash
+			char&		digit = batv_address.tag_val[9];
+			digit = digit == '0' ? '1' : '0';
+		}
+		return batv_address.make_string(config.sub_address_delimiter);
+	}
+
+	void add_step (Session& session, char command, const std::string& data, Phase phase)
+	{
+		Step			step;
+		step.command = command;
+		step.data = data;
+		step.phase = phase;
+		step.message = session.messages.size() - 1;
+		session.steps.push_back(step);
+	}
+
+	void plan_session (const Bench_config& config, Session& session)
+	{
+		session.is_internal = static_cast<unsigned int>(std::rand() % 100) < config.internal_percent;
+		session.messages.clear();
+		session.steps.clear();
+		session.messages.push_back(Message_plan());	// steps before the first message belong to it
+
+		add_step(session, MILTER_CMD_OPTNEG, milter_optneg_data(6, MILTER_ACTIONS_ALL, MILTER_PROTOCOL_ALL), PHASE_NEGOTIATE);
+		if (!config.daemon_name.empty()) {
+			add_step(session, MILTER_CMD_MACRO, std::string(1, MILTER_CMD_CONNECT) + milter_strings_data("{daemon_name}", config.daemon_name), PHASE_NONE);
+		}
+		const std::string&	client_address = session.is_internal ? config.internal_address : config.external_address;
+		add_step(session, MILTER_CMD_CONNECT, milter_connect_data("client.example", client_address, 25000 + std::rand() % 10000), PHASE_CONNECT);
+		add_step(session, MILTER_CMD_HELO, milter_strings_data("client.example"), PHASE_HELO);
+
+		for (unsigned int m = 0; m < config.messages_per_session; ++m) {
+			if (m > 0) {
+				session.messages.push_back(Message_plan());
+			}
+			Message_plan&	message = session.messages.back();
+			message.is_signed_sender = static_cast<unsigned int>(std::rand() % 100) < config.signed_percent;
+			message.env_from = message.is_signed_sender ? config.signed_sender : config.unsigned_sender;
+			unsigned int	rcpt_roll = std::rand() % 100;
+			if (rcpt_roll < config.valid_percent) {
+				message.rcpt_kind = RCPT_VALID;
+			} else if (rcpt_roll < config.valid_percent + config.invalid_percent) {
+				message.rcpt_kind = RCPT_INVALID;
+			} else if (rcpt_roll < config.valid_percent + config.invalid_percent + config.expired_percent) {
+				message.rcpt_kind = RCPT_EXPIRED;
+			} else {
+				message.rcpt_kind = RCPT_PLAIN;
+			}
+			message.rcpt = make_rcpt(config, message.rcpt_kind);
+			message.num_forged_headers = static_cast<unsigned int>(std::rand() % 100) < config.forged_percent ? 1 : 0;
+
+			add_step(session, MILTER_CMD_MAIL, milter_strings_data("<" + message.env_from + ">"), PHASE_MAIL);
+			add_step(session, MILTER_CMD_RCPT, milter_strings_data("<" + message.rcpt + ">"), PHASE_RCPT);
+			add_step(session, MILTER_CMD_DATA, "", PHASE_DATA);
+
+			unsigned int	num_headers = config.min_headers + std::rand() % (config.max_headers - config.min_headers + 1);
+			unsigned int	forged_pos = message.num_forged_headers ? std::rand() % (num_headers + 1) : num_headers + 1;
+			for (unsigned int h = 0; h <= num_headers; ++h) {
+				if (h == forged_pos) {
+					add_step(session, MILTER_CMD_HEADER, milter_strings_data("X-Batv-Status", " valid"), PHASE_HEADER);
+				}
+				if (h < num_headers) {
+					std::ostringstream	name;
+					name << "X-Bench-Header-" << h;
+					add_step(session, MILTER_CMD_HEADER, milter_strings_data(name.str(), " Lorem ipsum dolor sit amet, consectetur adipiscing elit"), PHASE_HEADER);
+				}
+			}
+			add_step(session, MILTER_CMD_EOH, "", PHASE_EOH);
+			add_step(session, MILTER_CMD_BODY, std::string(1024, 'x'), PHASE_BODY);
+			add_step(session, MILTER_CMD_BODYEOB, "", PHASE_EOM);
+		}
+		add_step(session, MILTER_CMD_QUIT, "", PHASE_NONE);
+		session.next_step = 0;
+		session.awaiting_reply = false;
+		session.in.clear();
+		session.out.clear();
+		session.mods.clear();
+		session.protocol = 0;
+	}
+
+	// Check that the milter made exactly the modifications it should have.
+	// Returns a description of the first discrepancy, or the empty string.
+	std::string verify_message (const Bench_config& config, const Session& session, const Message_plan& message, char response)
+	{
+		if (response != MILTER_REPLY_ACCEPT) {
+			return std::string("expected accept, got ") + response;
+		}
+
+		std::vector<std::string>	expected;	// "TYPE ARG1 ARG2..." for each expected modification
+		std::vector<std::string>	actual;
+		std::string			new_sender;
+
+		if (config.do_verify) {
+			for (unsigned int i = message.num_forged_headers; i > 0; --i) {
+				std::ostringstream	mod;
+				mod << "m " << i << " X-Batv-Status ";
+				expected.push_back(mod.str());
+			}
+			if (message.rcpt_kind != RCPT_PLAIN) {
+				expected.push_back(std::string("h X-Batv-Status ") + (message.rcpt_kind == RCPT_VALID ? "valid" : "invalid"));
+				expected.push_back("h X-Batv-Delivered-To <" + message.rcpt + ">");
+				expected.push_back("- <" + message.rcpt + ">");
+				expected.push_back("+ " + config.signed_sender);
+			}
+		}
+		const bool			expect_chgfrom = config.do_sign && session.is_internal && message.is_signed_sender;
+
+		for (size_t i = 0; i < session.mods.size(); ++i) {
+			const Milter_modification&	mod = session.mods[i];
+			if (mod.type == MILTER_REPLY_CHGFROM) {
+				if (!new_sender.empty() || mod.args.empty()) {
+					return "bad chgfrom";
+				}
+				new_sender = mod.args[0];
+				continue;
+			}
+			std::ostringstream	description;
+			description << mod.type;
+			if (mod.type == MILTER_REPLY_CHGHEADER || mod.type == MILTER_REPLY_INSHEADER) {
+				description << ' ' << mod.index;
+			}
+			for (size_t j = 0; j < mod.args.size(); ++j) {
+				description << ' ' << mod.args[j];
+			}
+			actual.push_back(description.str());
+		}
+
+		if (actual != expected) {
+			std::string	description("expected modifications {");
+			for (size_t i = 0; i < expected.size(); ++i) {
+				description += (i ? ", " : "") + expected[i];
+			}
+			description += "}, got {";
+			for (size_t i = 0; i < actual.size(); ++i) {
+				description += (i ? ", " : "") + actual[i];
+			}
+			return description + "}";
+		}
+
+		if (expect_chgfrom != !new_sender.empty()) {
+			return expect_chgfrom ? "sender not signed" : "unexpected chgfrom to " + new_sender;
+		}
+		if (expect_chgfrom) {
+			Email_address		address;
+			Batv_address		batv_address;
+			address.parse(canon_address(new_sender.c_str()).c_str());
+			if (!batv_address.parse(address, config.sub_address_delimiter) || batv_address.tag_type != "prvs" ||
+					batv_address.orig_mailfrom.make_string() != message.env_from ||
+					!prvs_validate(batv_address, config.address_lifetime, config.key)) {
+				return "sender signed incorrectly: " + new_sender;
+			}
+		}
+		return "";
+	}
+
+	// Queue steps until one needs a reply (or there are none left)
+	void advance (Session& session)
+	{
+		while (!session.awaiting_reply && session.next_step < session.steps.size()) {
+			const Step&	step = session.steps[session.next_step];
+			if (step.command != MILTER_CMD_OPTNEG && milter_skips_command(session.protocol, step.command)) {
+				++session.next_step;
+				continue;
+			}
+			milter_append_packet(session.out, step.command, step.data);
+			if (step.command == MILTER_CMD_OPTNEG || !milter_skips_reply(session.protocol, step.command)) {
+				session.awaiting_reply = true;
+				session.sent_at = now();
+			} else {
+				++session.next_step;
+			}
+		}
+	}
+
+	// Skip the remaining steps of the current message (after the milter ended it early)
+	void skip_message (Session& session)
+	{
+		size_t		message = session.steps[session.next_step].message;
+		++session.next_step;
+		while (session.next_step < session.steps.size() &&
+				session.steps[session.next_step].message == message &&
+				session.steps[session.next_step].command != MILTER_CMD_QUIT) {
+			++session.next_step;
+		}
+	}
+
+	// Handle the packets in the session's input buffer.  Returns false on a protocol error.
+	bool handle_replies (const Bench_config& config, Session& session, Results& results)
+	{
+		Milter_packet		packet;
+		while (milter_parse_packet(session.in, packet)) {
+			if (!session.awaiting_reply) {
+				std::clog << "Unexpected packet from milter: " << packet.command << std::endl;
+				return false;
+			}
+			const Step&	step = session.steps[session.next_step];
+
+			if (step.command == MILTER_CMD_OPTNEG) {
+				if (packet.command != MILTER_REPLY_OPTNEG || packet.data.size() < 12) {
+					std::clog << "Milter did not negotiate options" << std::endl;
+					return false;
+				}
+				const unsigned char*	p = reinterpret_cast<const unsigned char*>(packet.data.data()) + 8;
+				session.protocol = (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			} else if (milter_is_modification(packet.command)) {
+				if (step.command != MILTER_CMD_BODYEOB) {
+					std::clog << "Milter sent modification outside end of message" << std::endl;
+					return false;
+				}
+				session.mods.push_back(Milter_modification());
+				session.mods.back().parse(packet);
+				continue;
+			} else if (packet.command == MILTER_REPLY_PROGRESS) {
+				continue;
+			} else if (!milter_is_final_response(packet.command)) {
+				std::clog << "Unexpected response from milter: " << packet.command << std::endl;
+				return false;
+			}
+
+			results.latencies[step.phase].push_back((now() - session.sent_at) * 1e6);
+			session.awaiting_reply = false;
+
+			if (step.command == MILTER_CMD_BODYEOB) {
+				++results.num_messages;
+				std::string	failure(verify_message(config, session, session.messages[step.message], packet.command));
+				if (!failure.empty()) {
+					if (results.num_failures < 10) {
+						std::clog << "Verification failed: " << session.messages[step.message].rcpt << ": " << failure << std::endl;
+					}
+					++results.num_failures;
+				}
+				session.mods.clear();
+				++session.next_step;
+			} else if (step.command != MILTER_CMD_OPTNEG && packet.command != MILTER_REPLY_CONTINUE) {
+				// Milter decided the fate of the message early
+				++results.num_messages;
+				if (results.num_failures < 10) {
+					std::clog << "Verification failed: " << session.messages[step.message].rcpt << ": expected continue after " << phase_names[step.phase] << ", got " << packet.command << std::endl;
+				}
+				++results.num_failures;
+				skip_message(session);
+			} else {
+				++session.next_step;
+			}
+			advance(session);
+		}
+		return true;
+	}
+
+	bool flush (Session& session)
+	{
+		while (!session.out.empty()) {
+			ssize_t		bytes_written = send(session.fd, session.out.data(), session.out.size(), MSG_NOSIGNAL);
+			if (bytes_written == -1) {
+				return errno == EAGAIN || errno == EINTR;
+			}
+			session.out.erase(0, bytes_written);
+		}
+		return true;
+	}
+
+	bool start_session (const Bench_config& config, Session& session)
+	{
+		plan_session(config, session);
+		try {
+			session.fd = milter_connect(config.socket_spec, true);
+		} catch (const Milter_error& e) {
+			std::clog << e.message << std::endl;
+			session.fd = -1;
+			return false;
+		}
+		session.is_connecting = true;
+		advance(session);
+		return true;
+	}
+
+	double percentile (const std::vector<double>& sorted, double p)
+	{
+		if (sorted.empty()) {
+			return 0;
+		}
+		size_t		index = static_cast<size_t>(p * sorted.size());
+		return sorted[std::min(index, sorted.size() - 1)];
+	}
+
+	void print_results (Results& results, double elapsed)
+	{
+		std::cout << "phase\tcount\tp50_us\tp99_us\tp999_us\tmax_us" << std::endl;
+		for (int i = 0; i < NUM_PHASES; ++i) {
+			std::vector<double>&	latencies = results.latencies[i];
+			if (latencies.empty()) {
+				continue;
+			}
+			std::sort(latencies.begin(), latencies.end());
+			char			line[256];
+			std::sprintf(line, "%s\t%lu\t%.1f\t%.1f\t%.1f\t%.1f", phase_names[i], static_cast<unsigned long>(latencies.size()),
+					percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999), latencies.back());
+			std::cout << line << std::endl;
+		}
+		std::cout << "messages\t" << results.num_messages << std::endl;
+		std::cout << "elapsed_s\t" << elapsed << std::endl;
+		std::cout << "messages_per_s\t" << static_cast<unsigned long>(results.num_messages / elapsed) << std::endl;
+		std::cout << "verification_failures\t" << results.num_failures << std::endl;
+		std::cout << "session_errors\t" << results.num_errors << std::endl;
+	}
+
+	bool parse_percent (const char* arg, unsigned int& percent)
+	{
+		percent = std::atoi(arg);
+		return percent <= 100;
+	}
+}
+
+int main (int argc, char** argv)
+try {
+	Bench_config		config;
+	std::string		key_file;
+	unsigned int		seed = 1;
+
+	int			flag;
+	while ((flag = getopt(argc, argv, "s:k:f:u:c:n:m:I:S:V:X:E:F:H:i:e:l:d:M:D:R:")) != -1) {
+		bool		ok = true;
+		switch (flag) {
+		case 's': config.socket_spec = optarg; break;
+		case 'k': key_file = optarg; break;
+		case 'f': config.signed_sender = optarg; break;
+		case 'u': config.unsigned_sender = optarg; break;
+		case 'c': config.concurrency = std::atoi(optarg); ok = config.concurrency > 0; break;
+		case 'n': config.num_sessions = std::strtoul(optarg, NULL, 10); break;
+		case 'm': config.messages_per_session = std::atoi(optarg); ok = config.messages_per_session > 0; break;
+		case 'I': ok = parse_percent(optarg, config.internal_percent); break;
+		case 'S': ok = parse_percent(optarg, config.signed_percent); break;
+		case 'V': ok = parse_percent(optarg, config.valid_percent); break;
+		case 'X': ok = parse_percent(optarg, config.invalid_percent); break;
+		case 'E': ok = parse_percent(optarg, config.expired_percent); break;
+		case 'F': ok = parse_percent(optarg, config.forged_percent); break;
+		case 'H':
+			ok = std::sscanf(optarg, "%u:%u", &config.min_headers, &config.max_headers) == 2 && config.min_headers <= config.max_headers;
+			break;
+		case 'i': config.internal_address = optarg; break;
+		case 'e': config.external_address = optarg; break;
+		case 'l':
+			config.address_lifetime = std::atoi(optarg);
+			ok = config.address_lifetime >= 1 && config.address_lifetime <= 999;
+			break;
+		case 'd':
+			ok = std::strlen(optarg) == 1;
+			config.sub_address_delimiter = optarg[0];
+			break;
+		case 'M':
+			config.do_sign = std::strcmp(optarg, "sign") == 0 || std::strcmp(optarg, "both") == 0;
+			config.do_verify = std::strcmp(optarg, "verify") == 0 || std::strcmp(optarg, "both") == 0;
+			ok = config.do_sign || config.do_verify;
+			break;
+		case 'D': config.daemon_name = optarg; break;
+		case 'R': seed = std::atoi(optarg); break;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+		if (!ok) {
+			std::clog << argv[0] << ": invalid argument to -" << static_cast<char>(flag) << ": " << optarg << std::endl;
+			return 2;
+		}
+	}
+	if (config.socket_spec.empty() || key_file.empty() || optind != argc) {
+		print_usage(argv[0]);
+		return 2;
+	}
+	if (config.valid_percent + config.invalid_percent + config.expired_percent > 100) {
+		std::clog << argv[0] << ": the percentages of BATV recipients (-V, -X, -E) add up to more than 100" << std::endl;
+		return 2;
+	}
+
+	std::ifstream		key_in(key_file.c_str());
+	if (!key_in) {
+		std::clog << argv[0] << ": " << key_file << ": Unable to open key file" << std::endl;
+		return 1;
+	}
+	load_key(config.key, key_in);
+
+	signal(SIGPIPE, SIG_IGN);
+	std::srand(seed);
+
+	// Run the sessions, keeping config.concurrency of them open at once
+	std::vector<Session>	sessions(std::min<unsigned long>(config.concurrency, config.num_sessions));
+	std::vector<struct pollfd> pollfds(sessions.size());
+	unsigned long		num_started = 0;
+	unsigned long		num_active = 0;
+	Results			results;
+	const double		start = now();
+
+	for (size_t i = 0; i < sessions.size(); ++i) {
+		sessions[i].fd = -1;
+		while (num_started < config.num_sessions && sessions[i].fd == -1) {
+			++num_started;
+			if (start_session(config, sessions[i])) {
+				++num_active;
+			} else {
+				++results.num_errors;
+			}
+		}
+	}
+
+	while (num_active > 0) {
+		for (size_t i = 0; i < sessions.size(); ++i) {
+			pollfds[i].fd = sessions[i].fd;
+			pollfds[i].events = POLLIN | (sessions[i].is_connecting || !sessions[i].out.empty() ? POLLOUT : 0);
+			pollfds[i].revents = 0;
+		}
+		if (poll(&pollfds[0], pollfds.size(), -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::clog << argv[0] << ": poll: " << std::strerror(errno) << std::endl;
+			return 1;
+		}
+
+		for (size_t i = 0; i < sessions.size(); ++i) {
+			Session&	session = sessions[i];
+			short		revents = pollfds[i].revents;
+			if (session.fd == -1 || revents == 0) {
+				continue;
+			}
+
+			bool		ok = true;
+			if (session.is_connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+				int		error = 0;
+				socklen_t	error_len = sizeof(error);
+				getsockopt(session.fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+				if (error) {
+					std::clog << config.socket_spec << ": " << std::strerror(error) << std::endl;
+					ok = false;
+				}
+				session.is_connecting = false;
+			}
+			if (ok && (revents & (POLLIN | POLLHUP))) {
+				char		buffer[16384];
+				ssize_t		bytes_read = read(session.fd, buffer, sizeof(buffer));
+				if (bytes_read > 0) {
+					session.in.append(buffer, bytes_read);
+					try {
+						ok = handle_replies(config, session, results);
+					} catch (const Milter_error& e) {
+						std::clog << e.message << std::endl;
+						ok = false;
+					}
+				} else if (bytes_read == 0 || (errno != EAGAIN && errno != EINTR)) {
+					// The milter closes the connection after QUIT
+					ok = session.next_step == session.steps.size() && session.out.empty();
+					if (!ok) {
+						std::clog << "Milter closed the connection unexpectedly" << std::endl;
+					}
+					close(session.fd);
+					session.fd = -1;
+				}
+			}
+			if (ok && session.fd != -1 && !session.is_connecting) {
+				ok = flush(session);
+			}
+
+			bool		is_done = session.fd != -1 && session.next_step == session.steps.size() && session.out.empty();
+			if (!ok || is_done || session.fd == -1) {
+				if (!ok) {
+					++results.num_errors;
+				}
+				if (session.fd != -1) {
+					close(session.fd);
+					session.fd = -1;
+				}
+				--num_active;
+				while (num_started < config.num_sessions && session.fd == -1) {
+					++num_started;
+					if (start_session(config, session)) {
+						++num_active;
+					} else {
+						++results.num_errors;
+					}
+				}
+			}
+		}
+	}
+
+	print_results(results, now() - start);
+	return results.num_failures || results.num_errors ? 1 : 0;
+} catch (const Config_error& e) {
+	std::clog << argv[0] << ": " << e.message << std::endl;
+	return 1;
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "milter-client.hpp"
+#include "capture.hpp"
+#include "common.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace batv;
+
+namespace {
+	void print_usage (const char* argv0)
+	{
+		std::clog << "Usage: " << argv0 << " -s SOCKET [OPTIONS...] CAPTURE_FILE..." << std::endl;
+		std::clog << "Replays transactions captured by batv-milter against a running batv-milter," << std::endl;
+		std::clog << "and checks that it does the same thing with them as the original milter did." << std::endl;
+		std::clog << "The milter must have the same keys and settings, and trust-clock-macro enabled." << std::endl;
+		std::clog << "Options:" << std::endl;
+		std::clog << " -s SOCKET          -- milter socket (/PATH, unix:PATH, inet:PORT@HOST, inet6:PORT@HOST)" << std::endl;
+		std::clog << " -x SPEED           -- 0 to replay as fast as possible (the default), 1 to replay with" << std::endl;
+		std::clog << "                       the original timing, N to replay N times faster than that" << std::endl;
+		std::clog << " -D DAEMON_NAME     -- value of the {daemon_name} macro (default: the one captured)" << std::endl;
+	}
+
+	struct Outcome {
+		bool				did_sign;
+		bool				did_rewrite_rcpt;
+		Capture_record::Verdict		verdict;
+		unsigned int			num_removed_headers;
+
+		explicit Outcome (const Capture_record& record)
+		{
+			did_sign = record.did_sign;
+			did_rewrite_rcpt = record.did_rewrite_rcpt;
+			verdict = record.verdict;
+			num_removed_headers = record.num_removed_headers;
+		}
+
+		explicit Outcome (const std::vector<Milter_modification>& mods)
+		{
+			did_sign = false;
+			did_rewrite_rcpt = false;
+			verdict = Capture_record::VERDICT_NONE;
+			num_removed_headers = 0;
+			for (size_t i = 0; i < mods.size(); ++i) {
+				const Milter_modification&	mod = mods[i];
+				const bool			is_status = !mod.args.empty() && strcasecmp(mod.args[0].c_str(), "X-Batv-Status") == 0;
+				if (mod.type == MILTER_REPLY_CHGFROM) {
+					did_sign = true;
+				} else if (mod.type == MILTER_REPLY_DELRCPT) {
+					did_rewrite_rcpt = true;
+				} else if (mod.type == MILTER_REPLY_CHGHEADER && is_status) {
+					++num_removed_headers;
+				} else if (mod.type == MILTER_REPLY_ADDHEADER && is_status && mod.args.size() == 2) {
+					verdict = mod.args[1] == "valid" ? Capture_record::VERDICT_VALID : Capture_record::VERDICT_INVALID;
+				}
+			}
+		}
+
+		bool operator== (const Outcome& other) const
+		{
+			return did_sign == other.did_sign && did_rewrite_rcpt == other.did_rewrite_rcpt &&
+				verdict == other.verdict && num_removed_headers == other.num_removed_headers;
+		}
+
+		std::string describe () const
+		{
+			static const char*	verdict_names[] = { "none", "valid", "invalid" };
+			std::ostringstream	description;
+			description << "sign=" << did_sign << " rewrite-rcpt=" << did_rewrite_rcpt
+				<< " status=" << verdict_names[verdict] << " removed-headers=" << num_removed_headers;
+			return description.str();
+		}
+	};
+
+	std::string client_address_string (const Capture_record& record)
+	{
+		char			buffer[INET6_ADDRSTRLEN];
+		if (record.client_family == 4) {
+			return inet_ntop(AF_INET, record.client_address + 12, buffer, sizeof(buffer));
+		} else if (record.client_family == 6) {
+			return inet_ntop(AF_INET6, record.client_address, buffer, sizeof(buffer));
+		}
+		return "";
+	}
+
+	// Replay one transaction, returning a description of the discrepancy, or the empty string
+	std::string replay (const std::string& socket_spec, const std::string& daemon_name, const Capture_record& record)
+	{
+		Milter_connection		milter;
+		std::vector<Milter_modification> mods;
+		std::vector<std::string>	macros;
+		char				response;
+
+		milter.open(socket_spec);
+
+		// Replay under the listener the transaction came in on, unless overridden
+		const std::string&		use_daemon_name = !daemon_name.empty() ? daemon_name : record.daemon_name;
+		if (!use_daemon_name.empty()) {
+			macros.push_back("{daemon_name}");
+			macros.push_back(use_daemon_name);
+			milter.macros(MILTER_CMD_CONNECT, macros);
+		}
+		if ((response = milter.command(MILTER_CMD_CONNECT, milter_connect_data("client.example", client_address_string(record), 25))) != MILTER_REPLY_CONTINUE) {
+			return std::string("connect: got ") + response;
+		}
+
+		std::ostringstream		clock;
+		clock << record.time / 1000000;
+		macros.clear();
+		macros.push_back("{batv_clock}");
+		macros.push_back(clock.str());
+		if (record.is_authenticated) {
+			macros.push_back("{auth_authen}");
+			macros.push_back("replay");
+		}
+		milter.macros(MILTER_CMD_MAIL, macros);
+		if ((response = milter.command(MILTER_CMD_MAIL, milter_strings_data(record.env_from))) != MILTER_REPLY_CONTINUE) {
+			return std::string("mail: got ") + response;
+		}
+		for (size_t i = 0; i < record.rcpts.size(); ++i) {
+			if ((response = milter.command(MILTER_CMD_RCPT, milter_strings_data(record.rcpts[i]))) != MILTER_REPLY_CONTINUE) {
+				return std::string("rcpt: got ") + response;
+			}
+		}
+		if ((response = milter.command(MILTER_CMD_DATA, "")) != MILTER_REPLY_CONTINUE) {
+			return std::string("data: got ") + response;
+		}
+		for (size_t i = 0; i < record.headers.size(); ++i) {
+			const std::string&	value = record.headers[i].second.empty() ? " -" : record.headers[i].second;
+			if ((response = milter.command(MILTER_CMD_HEADER, milter_strings_data(record.headers[i].first, value))) != MILTER_REPLY_CONTINUE) {
+				return std::string("header: got ") + response;
+			}
+		}
+		if ((response = milter.command(MILTER_CMD_EOH, "")) != MILTER_REPLY_CONTINUE) {
+			return std::string("eoh: got ") + response;
+		}
+		if ((response = milter.command(MILTER_CMD_BODYEOB, "", &mods)) != MILTER_REPLY_ACCEPT) {
+			return std::string("eom: got ") + response;
+		}
+		milter.send(MILTER_CMD_QUIT, "");
+
+		Outcome				expected(record);
+		Outcome				actual(mods);
+		if (!(actual == expected)) {
+			return "expected " + expected.describe() + ", got " + actual.describe();
+		}
+		return "";
+	}
+
+	// Sleep until the given time
+	void sleep_until (double when)
+	{
+		double			delay = when - now();
+		if (delay > 0) {
+			struct timespec		ts;
+			ts.tv_sec = static_cast<time_t>(delay);
+			ts.tv_nsec = static_cast<long>((delay - ts.tv_sec) * 1000000000.0);
+			while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+		}
+	}
+}
+
+int main (int argc, char** argv)
+try {
+	std::string		socket_spec;
+	std::string		daemon_name;
+	double			speed = 0;
+
+	int			flag;
+	while ((flag = getopt(argc, argv, "s:x:D:")) != -1) {
+		switch (flag) {
+		case 's':
+			socket_spec = optarg;
+			break;
+		case 'x':
+			speed = std::atof(optarg);
+			if (speed < 0) {
+				std::clog << argv[0] << ": speed (as specified by -x) must not be negative" << std::endl;
+				return 1;
+			}
+			break;
+		case 'D':
+			daemon_name = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (socket_spec.empty() || argc - optind < 1) {
+		print_usage(argv[0]);
+		return 2;
+	}
+
+	unsigned long		num_replayed = 0;
+	unsigned long		num_mismatches = 0;
+	unsigned long		num_errors = 0;
+	double			start_time = now();
+	uint64_t		first_record_time = 0;
+
+	for (int i = optind; i < argc; ++i) {
+		std::ifstream	in(argv[i], std::ios::in | std::ios::binary);
+		if (!in) {
+			std::clog << argv[0] << ": " << argv[i] << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+		char		magic[sizeof(capture_file_magic)];
+		if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, capture_file_magic, sizeof(magic)) != 0) {
+			std::clog << argv[0] << ": " << argv[i] << ": Not a batv-milter capture file" << std::endl;
+			return 1;
+		}
+
+		Capture_record	record;
+		for (unsigned long n = 1; read_capture_record(in, record); ++n) {
+			if (speed > 0) {
+				if (first_record_time == 0) {
+					first_record_time = record.time;
+				}
+				if (record.time > first_record_time) {
+					sleep_until(start_time + (record.time - first_record_time) / 1000000.0 / speed);
+				}
+			}
+
+			++num_replayed;
+			try {
+				std::string	discrepancy(replay(socket_spec, daemon_name, record));
+				if (!discrepancy.empty()) {
+					std::clog << argv[i] << ": record " << n << ": " << discrepancy << std::endl;
+					++num_mismatches;
+				}
+			} catch (const Milter_error& e) {
+				std::clog << argv[i] << ": record " << n << ": " << e.message << std::endl;
+				++num_errors;
+			}
+		}
+	}
+
+	std::cout << "replayed\t" << num_replayed << std::endl;
+	std::cout << "mismatches\t" << num_mismatches << std::endl;
+	std::cout << "errors\t" << num_errors << std::endl;
+	return num_mismatches || num_errors ? 1 : 0;
+} catch (const Config_error& e) {
+	std::clog << argv[0] << ": " << e.message << std::endl;
+	return 1;
+}
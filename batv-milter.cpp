@@ -33,10 +33,15 @@
 #include "address.hpp"
 #include "key.hpp"
 #include "common.hpp"
-#include "openssl-threads.hpp"
+#include "capture.hpp"
+#include "key-map-watcher.hpp"
+#include "key-provider.hpp"
+#include "overload.hpp"
+#include "sha1.hpp"
 #include <iostream>
 #include <signal.h>
 #include <fstream>
+#include <sstream>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -51,15 +56,61 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#include <dirent.h>
+#endif
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
 
 using namespace batv;
 
 namespace {
 	const Config*			config;
+	Key_map_watcher*		key_map_watcher;	// if watching the key map for changes
+	Key_cache*			key_cache;		// if getting keys from a key provider
+	Overload_guard*			overload_guard;		// if protecting against overload
+	int				capture_fd = -1;	// file to record transactions to, if capturing
+	int				num_connections;	// open connections (for letting them finish at exit)
+
+	// Get the keys for a sender from the key map, or failing that, the key provider.
+	// If failed is non-NULL, it's set to true if the key provider couldn't be asked.
+	// Keys from a watched key map are only valid while lock is locked (see
+	// Key_map_watcher::get_key).  Asking the key provider unlocks it first, so that a
+	// slow provider doesn't hold up key map updates, so any earlier key from the key
+	// map which is still needed must be pinned.
+	Key_ref lookup_key (const std::string& sender_address, Key_map_watcher::Read_lock& lock, bool* failed =NULL)
+	{
+		lock.lock();
+		Key_ref		key(key_map_watcher ? key_map_watcher->get_key(sender_address) : config->get_key(sender_address));
+		if (!key && key_cache) {
+			lock.unlock();
+			if (!key_cache->get_key(sender_address, key) && failed) {
+				*failed = true;
+			}
+		}
+		return key;
+	}
+
+	bool may_have_key (const std::string& domain)
+	{
+		return key_cache || (key_map_watcher ? key_map_watcher->may_have_key(domain) : config->keys.may_have_key(domain));
+	}
 
 	struct Batv_context {
 		// Connection state (applicable to entire SMTP connection):
+		const Listener_config*	listener;		// settings for the listener the connection came in on
 		bool			client_is_internal;
+		Overload_guard::Connection connection;		// for timing callbacks, if overload_guard
 
 		// Message state (applicable only to the current message):
 		unsigned int		num_batv_status_headers;// number of existing X-Batv-Status headers in the message
@@ -67,15 +118,20 @@ namespace {
 		bool			is_batv_rcpt;		// is the message destined to a BATV address?
 		Batv_address		batv_rcpt;		// the message recipient, valid iff is_batv_rcpt==true
 		std::string		batv_rcpt_string;	// original message recipient string, iff is_batv_rcpt==true
-		const Key*		batv_rcpt_key;		// the key to be used to sign the address, iff is_batv_rcpt==true
+		Key_ref			batv_rcpt_key;		// the key to be used to sign the address, iff is_batv_rcpt==true
+		std::time_t		now;			// the time of the message, for signing and validation
+		Capture_record		capture;		// the transaction so far, if capturing (client fields
+								// apply to the entire connection)
 
 
 		Batv_context ()
 		{
+			listener = config;
 			client_is_internal = false;
 			num_batv_status_headers = 0;
 			is_batv_rcpt = false;
-			batv_rcpt_key = NULL;
+			batv_rcpt_key = Key_ref();
+			now = 0;
 		}
 
 		void clear_message_state ()
@@ -83,9 +139,93 @@ namespace {
 			num_batv_status_headers = 0;
 			env_from.clear();
 			is_batv_rcpt = false;
+
+			if (capture_fd != -1) {
+				unsigned char	client_family = capture.client_family;
+				unsigned char	client_address[16];
+				std::string	daemon_name;
+				std::memcpy(client_address, capture.client_address, sizeof(client_address));
+				daemon_name.swap(capture.daemon_name);
+				capture.clear();
+				capture.client_family = client_family;
+				std::memcpy(capture.client_address, client_address, sizeof(client_address));
+				capture.daemon_name.swap(daemon_name);
+			}
 		}
 	};
 
+	// Replace a local part with a keyed hash, so that captures don't reveal who is mailing whom
+	std::string hash_local_part (const std::string& local_part)
+	{
+		unsigned char		hash[20];
+		hmac_sha1(hash, &config->capture_hash_key[0], config->capture_hash_key.size(),
+				reinterpret_cast<const unsigned char*>(local_part.data()), local_part.size());
+		char			hex[18];
+		std::sprintf(hex, "u%02x%02x%02x%02x%02x%02x%02x%02x", hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+		return hex;
+	}
+
+	// Anonymize an address for capture, if configured to.  A BATV address is re-signed
+	// for its hashed address with the same expiration day, and if its signature was
+	// invalid the new one is made invalid too, so replays get the same verdicts.
+	std::string anonymize_address (const Listener_config& listener, const std::string& address, std::time_t now)
+	{
+		if (config->capture_hash_key.empty()) {
+			return address;
+		}
+
+		std::string		canon(canon_address(address.c_str()));
+		Email_address		email_address;
+		Batv_address		batv_address;
+		Key_map_watcher::Read_lock	lock(key_map_watcher);
+		Key_ref			key;
+		std::string		result;
+		email_address.parse(canon.c_str());
+
+		unsigned int		expiration_day;
+		if (batv_address.parse(email_address, listener.sub_address_delimiter) && batv_address.tag_type == "prvs" &&
+				prvs_expiration_day(batv_address, expiration_day) &&
+				(key = lookup_key(batv_address.orig_mailfrom.make_string(), lock).pin()).get() != NULL) {
+			Email_address	hashed_address(batv_address.orig_mailfrom);
+			hashed_address.local_part = hash_local_part(hashed_address.local_part);
+			Key_ref		hashed_key = lookup_key(hashed_address.make_string(), lock);
+			if (hashed_key.get() && hashed_key->can_sign()) {
+				unsigned int	today = (now / 86400) % 1000;
+				std::time_t	sign_time = now + static_cast<std::time_t>((expiration_day + 2000 - today - listener.address_lifetime) % 1000) * 86400;
+				Batv_address	resigned(prvs_generate(hashed_address, listener.address_lifetime, *hashed_key, sign_time));
+				if (!prvs_validate(batv_address, 999, *key, now)) {
+					char&	digit = resigned.tag_val[9];
+					digit = digit == '0' ? '1' : '0';
+				}
+				result = resigned.make_string(listener.sub_address_delimiter);
+			} else {
+				// Address-specific key that doesn't apply to the hashed address; the verdict can't be preserved
+				result = hashed_address.make_string();
+			}
+		} else {
+			email_address.local_part = hash_local_part(email_address.local_part);
+			result = email_address.make_string();
+		}
+		return canon.size() != address.size() ? "<" + result + ">" : result;
+	}
+
+	void write_capture (const Batv_context* batv_ctx)
+	{
+		Capture_record		record(batv_ctx->capture);
+		record.env_from = anonymize_address(*batv_ctx->listener, record.env_from, batv_ctx->now);
+		for (size_t i = 0; i < record.rcpts.size(); ++i) {
+			record.rcpts[i] = anonymize_address(*batv_ctx->listener, record.rcpts[i], batv_ctx->now);
+		}
+
+		// Records are written with a single write to a file opened with O_APPEND,
+		// so records from concurrent connections don't interleave.
+		std::string		data;
+		record.encode(data);
+		if (write(capture_fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+			std::clog << "Error writing to capture file: " << strerror(errno) << std::endl;
+		}
+	}
+
 	sfsistat milter_status (Config::Failure_mode failure_mode)
 	{
 		switch (failure_mode) {
@@ -101,23 +241,49 @@ namespace {
 		if (config->debug) std::cerr << "on_connect " << ctx << '\n';
 
 		Batv_context*		batv_ctx = new Batv_context;
+		if (overload_guard && !overload_guard->admit(&batv_ctx->connection)) {
+			// Shed the connection right away, so the MTA isn't kept waiting on us
+			delete batv_ctx;
+			return milter_status(config->on_overload);
+		}
 		if (smfi_setpriv(ctx, batv_ctx) == MI_FAILURE) {
+			if (overload_guard) {
+				overload_guard->release(&batv_ctx->connection);
+			}
 			delete batv_ctx;
 			std::clog << "on_connect: smfi_setpriv failed" << std::endl;
 			return milter_status(config->on_internal_error);
 		}
+		__sync_add_and_fetch(&num_connections, 1);
+		Overload_guard::Timer	timer(overload_guard, &batv_ctx->connection, "on_connect");
+
+		const char*		daemon_name = smfi_getsymval(ctx, const_cast<char*>("{daemon_name}"));
+		batv_ctx->listener = &config->get_listener(daemon_name);
+		if (capture_fd != -1 && daemon_name) {
+			batv_ctx->capture.daemon_name = daemon_name;
+		}
 
 		if (!hostaddr) {
 			// Probably a local user calling sendmail directly
 			batv_ctx->client_is_internal = true;
 		} else if (hostaddr->sa_family == AF_INET) {
-			batv_ctx->client_is_internal = config->is_internal_host(reinterpret_cast<struct sockaddr_in*>(hostaddr)->sin_addr);
+			batv_ctx->client_is_internal = batv_ctx->listener->is_internal_host(reinterpret_cast<struct sockaddr_in*>(hostaddr)->sin_addr);
 		} else if (hostaddr->sa_family == AF_INET6) {
-			batv_ctx->client_is_internal = config->is_internal_host(reinterpret_cast<struct sockaddr_in6*>(hostaddr)->sin6_addr);
+			batv_ctx->client_is_internal = batv_ctx->listener->is_internal_host(reinterpret_cast<struct sockaddr_in6*>(hostaddr)->sin6_addr);
 		} else {
 			// Unsupported socket family. Can't tell if client is internal.
 		}
 
+		if (capture_fd != -1 && hostaddr && hostaddr->sa_family == AF_INET) {
+			const struct in_addr&	addr = reinterpret_cast<struct sockaddr_in*>(hostaddr)->sin_addr;
+			batv_ctx->capture.client_family = 4;
+			batv_ctx->capture.client_address[10] = batv_ctx->capture.client_address[11] = 0xFF;
+			std::memcpy(batv_ctx->capture.client_address + 12, &addr.s_addr, 4);
+		} else if (capture_fd != -1 && hostaddr && hostaddr->sa_family == AF_INET6) {
+			batv_ctx->capture.client_family = 6;
+			std::memcpy(batv_ctx->capture.client_address, reinterpret_cast<struct sockaddr_in6*>(hostaddr)->sin6_addr.s6_addr, 16);
+		}
+
 		return SMFIS_CONTINUE;
 	}
 
@@ -130,15 +296,36 @@ namespace {
 			std::clog << "on_envfrom: smfi_getpriv failed" << std::endl;
 			return milter_status(config->on_internal_error);
 		}
+		Overload_guard::Timer	timer(overload_guard, &batv_ctx->connection, "on_envfrom");
 
-		if (!batv_ctx->client_is_internal && smfi_getsymval(ctx, const_cast<char*>("{auth_authen}")) != NULL) {
+		bool			is_authenticated = smfi_getsymval(ctx, const_cast<char*>("{auth_authen}")) != NULL;
+		if (!batv_ctx->client_is_internal && is_authenticated) {
 			// Authenticated client
 			batv_ctx->client_is_internal = true;
 		}
 
+		// Determine the time of the message.  When replaying captured transactions,
+		// the replay tool supplies the original time in the {batv_clock} macro.
+		struct timeval		tv;
+		gettimeofday(&tv, NULL);
+		batv_ctx->now = tv.tv_sec;
+		uint64_t		time_usec = static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+		if (config->trust_clock_macro) {
+			if (const char* clock = smfi_getsymval(ctx, const_cast<char*>("{batv_clock}"))) {
+				batv_ctx->now = std::strtol(clock, NULL, 10);
+				time_usec = static_cast<uint64_t>(batv_ctx->now) * 1000000;
+			}
+		}
+
 		// Make note of the envelope sender
 		batv_ctx->env_from.parse(canon_address(args[0]).c_str());
 
+		if (capture_fd != -1) {
+			batv_ctx->capture.time = time_usec;
+			batv_ctx->capture.is_authenticated = is_authenticated;
+			batv_ctx->capture.env_from = args[0];
+		}
+
 		return SMFIS_CONTINUE;
 	}
 
@@ -151,18 +338,32 @@ namespace {
 			std::clog << "on_envrcpt: smfi_getpriv failed" << std::endl;
 			return milter_status(config->on_internal_error);
 		}
+		Overload_guard::Timer	timer(overload_guard, &batv_ctx->connection, "on_envrcpt");
+
+		if (capture_fd != -1) {
+			batv_ctx->capture.rcpts.push_back(args[0]);
+		}
 
 		// Check to see if this message is destined to a BATV address
 		// (if we haven't already determined that it is)
 		if (!batv_ctx->is_batv_rcpt) {
 			Email_address		rcpt_to;
 			rcpt_to.parse(canon_address(args[0]).c_str());
-			// Make sure that the BATV address is syntactically valid AND it's using a known tag type:
-			if (batv_ctx->batv_rcpt.parse(rcpt_to, config->sub_address_delimiter) &&
+			// Skip recipients whose domain can't have keys.  Otherwise, make sure that
+			// the BATV address is syntactically valid AND it's using a known tag type:
+			if (may_have_key(rcpt_to.domain) &&
+					batv_ctx->batv_rcpt.parse(rcpt_to, batv_ctx->listener->sub_address_delimiter) &&
 					batv_ctx->batv_rcpt.tag_type == "prvs") {
-				// Get the key for this sender:
-				batv_ctx->batv_rcpt_key = config->get_key(batv_ctx->batv_rcpt.orig_mailfrom.make_string());
-				if (batv_ctx->batv_rcpt_key != NULL) {
+				// Get the key for this sender (pinned, since it's kept until end of message):
+				bool		failed = false;
+				Key_map_watcher::Read_lock	lock(key_map_watcher);
+				batv_ctx->batv_rcpt_key = lookup_key(batv_ctx->batv_rcpt.orig_mailfrom.make_string(), lock, &failed).pin();
+				lock.unlock();
+				if (failed) {
+					std::clog << "on_envrcpt: unable to get keys from key provider" << std::endl;
+					return milter_status(config->on_internal_error);
+				}
+				if (batv_ctx->batv_rcpt_key.get() != NULL) {
 					// A non-NULL key means this is a BATV sender.
 					batv_ctx->is_batv_rcpt = true;
 					batv_ctx->batv_rcpt_string = args[0];
@@ -182,12 +383,18 @@ namespace {
 			std::clog << "on_header: smfi_getpriv failed" << std::endl;
 			return milter_status(config->on_internal_error);
 		}
+		Overload_guard::Timer	timer(overload_guard, &batv_ctx->connection, "on_header");
 
 		// Count the number of existing X-Batv-Status headers so we can remove them later.
 		if (strcasecmp(name, "X-Batv-Status") == 0) {
 			++batv_ctx->num_batv_status_headers;
 		}
 
+		if (capture_fd != -1) {
+			batv_ctx->capture.headers.push_back(std::make_pair(std::string(name),
+						strcasecmp(name, "X-Batv-Status") == 0 ? std::string(value) : std::string()));
+		}
+
 		return SMFIS_CONTINUE;
 	}
 
@@ -200,8 +407,11 @@ namespace {
 			std::clog << "on_eom: smfi_getpriv failed" << std::endl;
 			return milter_status(config->on_internal_error);
 		}
+		Overload_guard::Timer	timer(overload_guard, &batv_ctx->connection, "on_eom");
+
+		if (batv_ctx->listener->do_verify) {
+			batv_ctx->capture.num_removed_headers = batv_ctx->num_batv_status_headers;
 
-		if (config->do_verify) {
 			// Remove all existing X-Batv-Status headers from the message.
 			// This is to prevent a malicious sender from trying to fake us out.
 			while (batv_ctx->num_batv_status_headers > 0) {
@@ -218,10 +428,11 @@ namespace {
 				const char* status = "invalid";
 
 				if (batv_ctx->batv_rcpt.tag_type == "prvs") {
-					if (prvs_validate(batv_ctx->batv_rcpt, config->address_lifetime, *batv_ctx->batv_rcpt_key)) {
+					if (prvs_validate(batv_ctx->batv_rcpt, batv_ctx->listener->address_lifetime, *batv_ctx->batv_rcpt_key, batv_ctx->now)) {
 						status = "valid";
 					}
 				}
+				batv_ctx->capture.verdict = std::strcmp(status, "valid") == 0 ? Capture_record::VERDICT_VALID : Capture_record::VERDICT_INVALID;
 
 				if (smfi_addheader(ctx, const_cast<char*>("X-Batv-Status"), const_cast<char*>(status)) == MI_FAILURE) {
 					std::clog << "on_eom: smfi_addheader failed (1)" << std::endl;
@@ -247,26 +458,39 @@ namespace {
 					batv_ctx->clear_message_state();
 					return milter_status(config->on_internal_error);
 				}
+				batv_ctx->capture.did_rewrite_rcpt = true;
 			}
 		}
 
-		if (config->do_sign) {
-			const Key*	sender_key = NULL;
+		if (batv_ctx->listener->do_sign) {
+			Key_map_watcher::Read_lock	lock(key_map_watcher);
+			Key_ref		sender_key;
+			bool		failed = false;
 			if (batv_ctx->client_is_internal &&
-					!is_batv_address(batv_ctx->env_from, config->sub_address_delimiter) &&
-					(sender_key = config->get_key(batv_ctx->env_from.make_string())) != NULL) {
+					!is_batv_address(batv_ctx->env_from, batv_ctx->listener->sub_address_delimiter) &&
+					(sender_key = lookup_key(batv_ctx->env_from.make_string(), lock, &failed)).get() != NULL &&
+					sender_key->can_sign()) {
 				// Message from internal sender who uses BATV -> rewrite the envelope sender to a BATV address.
 				// (We only do this if the envelope sender isn't already a BATV address)
-				Batv_address new_sender(prvs_generate(batv_ctx->env_from, config->address_lifetime, *sender_key));
+				Batv_address new_sender(prvs_generate(batv_ctx->env_from, batv_ctx->listener->address_lifetime, *sender_key, batv_ctx->now));
+				lock.unlock();	// (not held while talking to the MTA; sender_key isn't used after this)
 
-				if (smfi_chgfrom(ctx, const_cast<char*>(new_sender.make_string(config->sub_address_delimiter).c_str()), NULL) == MI_FAILURE) {
+				if (smfi_chgfrom(ctx, const_cast<char*>(new_sender.make_string(batv_ctx->listener->sub_address_delimiter).c_str()), NULL) == MI_FAILURE) {
 					std::clog << "on_eom: smfi_chgfrom failed" << std::endl;
 					batv_ctx->clear_message_state();
 					return milter_status(config->on_internal_error);
 				}
+				batv_ctx->capture.did_sign = true;
+			} else if (failed) {
+				std::clog << "on_eom: unable to get keys from key provider" << std::endl;
+				batv_ctx->clear_message_state();
+				return milter_status(config->on_internal_error);
 			}
 		}
 
+		if (capture_fd != -1) {
+			write_capture(batv_ctx);
+		}
 
 		batv_ctx->clear_message_state();
 		return SMFIS_ACCEPT;
@@ -284,11 +508,222 @@ namespace {
 	{
 		if (config->debug) std::cerr << "on_close " << ctx << '\n';
 
-		delete static_cast<Batv_context*>(smfi_getpriv(ctx));
+		Batv_context*		batv_ctx = static_cast<Batv_context*>(smfi_getpriv(ctx));
+		if (batv_ctx && overload_guard) {
+			overload_guard->release(&batv_ctx->connection);
+		}
+		if (batv_ctx) {
+			__sync_sub_and_fetch(&num_connections, 1);
+		}
+		delete batv_ctx;
 		smfi_setpriv(ctx, NULL); // this shouldn't matter because we never access the private
 					 // data again but libmilter complains if it's not NULL'ed out.
 		return SMFIS_CONTINUE; // return value doesn't matter in on_close()
 	}
+
+	// Get the PID in the PID file, or 0 if there isn't one
+	pid_t read_pid_file ()
+	{
+		std::ifstream	pid_in(config->pid_file.c_str());
+		long		pid = 0;
+		return pid_in >> pid && pid > 0 ? pid : 0;
+	}
+
+	void write_pid_file ()
+	{
+		std::ofstream	pid_out(config->pid_file.c_str());
+		pid_out << getpid() << '\n';
+	}
+
+#ifdef __linux__
+	// Taking over the socket needs to know about sockets that aren't ours, which only
+	// Linux lets us find out without connecting to them (see Config::validate).
+
+	// Find the listening UNIX domain socket bound to the file with the given device and
+	// inode (even if the file has since been renamed or removed), by asking the kernel
+	// rather than connecting to it.  Sets socket_ino to the socket's inode and queue_len
+	// to the number of connections waiting to be accepted.  Returns 1 if found, 0 if
+	// nothing is listening, or -1 if the kernel can't tell us.
+	int find_listening_socket (const struct stat& st, unsigned int& socket_ino, unsigned int& queue_len)
+	{
+		int			fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG);
+		if (fd == -1) {
+			return -1;
+		}
+		struct {
+			struct nlmsghdr		header;
+			struct unix_diag_req	body;
+		}			request;
+		std::memset(&request, '\0', sizeof(request));
+		request.header.nlmsg_len = sizeof(request);
+		request.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+		request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		request.body.sdiag_family = AF_UNIX;
+		request.body.udiag_states = 1 << 10;	// TCP_LISTEN
+		request.body.udiag_show = UDIAG_SHOW_VFS | UDIAG_SHOW_RQLEN;
+		if (send(fd, &request, sizeof(request), 0) == -1) {
+			close(fd);
+			return -1;
+		}
+
+		int			result = 0;
+		bool			done = false;
+		long			buffer[8192 / sizeof(long)];
+		while (!done) {
+			ssize_t		len = recv(fd, buffer, sizeof(buffer), 0);
+			if (len == -1 && errno == EINTR) {
+				continue;
+			}
+			if (len <= 0) {
+				result = -1;
+				break;
+			}
+			for (struct nlmsghdr* msg = reinterpret_cast<struct nlmsghdr*>(buffer); NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+				if (msg->nlmsg_type == NLMSG_DONE || msg->nlmsg_type == NLMSG_ERROR) {
+					result = msg->nlmsg_type == NLMSG_ERROR ? -1 : result;
+					done = true;
+					break;
+				}
+				struct unix_diag_msg*	diag = static_cast<struct unix_diag_msg*>(NLMSG_DATA(msg));
+				int			attrs_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*diag));
+				bool			is_match = false;
+				unsigned int		rqueue = 0;
+				for (struct rtattr* attr = reinterpret_cast<struct rtattr*>(diag + 1); RTA_OK(attr, attrs_len); attr = RTA_NEXT(attr, attrs_len)) {
+					if (attr->rta_type == UNIX_DIAG_VFS) {
+						// unix_diag reports the file's device as the kernel stores it
+						// (MAJOR << 20 | MINOR, see linux/kdev_t.h), not in the encoding
+						// that stat() returns st_dev in, so split it into major and minor
+						// and encode those the way st_dev is before comparing.
+						const struct unix_diag_vfs*	vfs = static_cast<const struct unix_diag_vfs*>(RTA_DATA(attr));
+						is_match = vfs->udiag_vfs_ino == st.st_ino &&
+								makedev(vfs->udiag_vfs_dev >> 20, vfs->udiag_vfs_dev & 0xFFFFF) == st.st_dev;
+					} else if (attr->rta_type == UNIX_DIAG_RQLEN) {
+						rqueue = static_cast<const struct unix_diag_rqlen*>(RTA_DATA(attr))->udiag_rqueue;
+					}
+				}
+				if (is_match) {
+					socket_ino = diag->udiag_ino;
+					queue_len = rqueue;
+					result = 1;
+				}
+			}
+		}
+		close(fd);
+		return result;
+	}
+
+	// Does the process with the given PID have the socket with the given inode open?
+	bool has_socket_open (pid_t pid, unsigned int socket_ino)
+	{
+		char			target[32];
+		std::sprintf(target, "socket:[%u]", socket_ino);
+
+		std::ostringstream	fd_dir_path;
+		fd_dir_path << "/proc/" << pid << "/fd";
+		DIR*			fd_dir = opendir(fd_dir_path.str().c_str());
+		if (!fd_dir) {
+			return false;
+		}
+		bool			found = false;
+		while (struct dirent* fd_ent = found ? NULL : readdir(fd_dir)) {
+			char		link[64];
+			ssize_t		link_len = readlink((fd_dir_path.str() + "/" + fd_ent->d_name).c_str(), link, sizeof(link) - 1);
+			found = link_len > 0 && (link[link_len] = '\0', std::strcmp(link, target) == 0);
+		}
+		closedir(fd_dir);
+		return found;
+	}
+
+	// Get the PID of the milter listening on the UNIX domain socket file with the given
+	// device and inode, which is the PID from its PID file, as long as that process is
+	// the one listening (the file may be stale, and its PID reused).  Returns 0 if nothing
+	// is listening on the socket, or -1 if something is but its PID is unknown.
+	pid_t get_listener_pid (const struct stat& st, pid_t pid_file_pid)
+	{
+		unsigned int		socket_ino;
+		unsigned int		queue_len;
+		int			found = find_listening_socket(st, socket_ino, queue_len);
+		if (found != 1) {
+			return found;
+		}
+		return pid_file_pid && pid_file_pid != getpid() && has_socket_open(pid_file_pid, socket_ino) ? pid_file_pid : -1;
+	}
+
+	struct Takeover {
+		pid_t			old_pid;
+		std::string		spare_path;	// another link to our socket
+	};
+
+	// Wait for the milter whose socket we took over to exit.  Milters from before taking
+	// over was supported remove the socket path (and PID file) as they exit, even though
+	// they're ours by then, so put them back if they're gone.
+	void* finish_takeover (void* arg)
+	{
+		Takeover*		takeover = static_cast<Takeover*>(arg);
+		while (kill(takeover->old_pid, 0) == 0 || errno == EPERM) {
+			usleep(100000);
+		}
+
+		if (link(takeover->spare_path.c_str(), config->socket_spec.c_str()) == 0) {
+			std::clog << "Restored " << config->socket_spec << ", which the old milter removed as it exited" << std::endl;
+		} else if (errno != EEXIST) {
+			std::clog << "Unable to restore " << config->socket_spec << ": " << strerror(errno) << std::endl;
+		}
+		unlink(takeover->spare_path.c_str());
+
+		if (access(config->pid_file.c_str(), F_OK) == -1 && errno == ENOENT) {
+			write_pid_file();
+		}
+
+		delete takeover;
+		return NULL;
+	}
+
+	// Having renamed our socket over the socket file, whose previous listener was old_pid
+	// (see get_listener_pid) on the socket file old_st, make sure our socket is listening,
+	// then stop the old milter and start a thread to wait for it to exit.  Returns true
+	// if the thread was started, in which case it's responsible for spare_path.
+	bool stop_old_milter (pid_t old_pid, const struct stat& old_st, const struct stat* socket_st, const std::string& spare_path)
+	{
+		// New connections now come to us, as long as our socket is listening
+		unsigned int	socket_ino;
+		unsigned int	queue_len;
+		if (old_pid != 0 && (!socket_st || find_listening_socket(*socket_st, socket_ino, queue_len) == 0)) {
+			std::clog << "Took over " << config->socket_spec << ", but our socket isn't listening; leaving the old milter running" << std::endl;
+			return false;
+		}
+		if (old_pid == -1) {
+			std::clog << "Took over " << config->socket_spec << ", but the old milter's PID is unknown (it isn't the one in " << config->pid_file << "); it must be stopped separately" << std::endl;
+			return false;
+		}
+		if (old_pid == 0) {
+			return false;
+		}
+
+		// Let the old milter accept the connections already queued for it (for up to
+		// 5 seconds), then have it stop accepting, finish its open connections, and exit
+		// (libmilter does the first on SIGTERM).
+		for (unsigned int i = 0; i < 500 && find_listening_socket(old_st, socket_ino, queue_len) == 1 && queue_len > 0; ++i) {
+			usleep(10000);
+		}
+		if (kill(old_pid, SIGTERM) == -1) {
+			std::clog << "Took over " << config->socket_spec << ", but unable to stop the old milter (PID " << old_pid << "): " << strerror(errno) << std::endl;
+			return false;
+		}
+		std::clog << "Took over " << config->socket_spec << " from PID " << old_pid << std::endl;
+		Takeover*	takeover = new Takeover;
+		takeover->old_pid = old_pid;
+		takeover->spare_path = spare_path;
+		try {
+			start_background_thread(finish_takeover, takeover);
+		} catch (const Config_error& e) {
+			std::clog << "Unable to wait for the old milter to exit: " << e.message << std::endl;
+			delete takeover;
+			return false;
+		}
+		return true;
+	}
+#endif
 }
 
 int main (int argc, const char** argv)
@@ -306,14 +741,17 @@ int main (int argc, const char** argv)
 			}
 		}
 		main_config.validate();
-		if (main_config.keys.empty()) {
+		if (main_config.keys.empty() && main_config.key_provider_socket.empty()) {
 			std::clog << argv[0] << ": Warning: no keys specified in config.  This program will do nothing useful." << std::endl;
+		} else if (main_config.key_map_stats.num_entries) {
+			std::clog << argv[0] << ": Loaded key map: " << main_config.key_map_stats << std::endl;
 		}
 	} catch (const Config_error& e) {
 		std::clog << argv[0] << ": Configuration error: " << e.message << std::endl;
 		return 1;
 	}
 	config = &main_config;
+	set_derived_key_cache_size(config->derived_key_cache_size);
 
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGPIPE, SIG_IGN);
@@ -343,7 +781,7 @@ int main (int argc, const char** argv)
 	if (config->socket_spec[0] == '/') {
 		// If the socket starts with a /, assume it's a path to a UNIX
 		// domain socket and treat it specially.
-		if (access(config->socket_spec.c_str(), F_OK) == 0) {
+		if (!config->takeover && access(config->socket_spec.c_str(), F_OK) == 0) {
 			std::clog << config->socket_spec << ": socket file already exists" << std::endl;
 			return 1;
 		}
@@ -352,10 +790,64 @@ int main (int argc, const char** argv)
 		conn_spec = config->socket_spec;
 	}
 
+	if (!config->capture_file.empty()) {
+		capture_fd = open(config->capture_file.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+		struct stat	st;
+		if (capture_fd == -1 || fstat(capture_fd, &st) == -1) {
+			std::clog << config->capture_file << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+		if (st.st_size == 0 && write(capture_fd, capture_file_magic, sizeof(capture_file_magic)) != sizeof(capture_file_magic)) {
+			std::clog << config->capture_file << ": " << strerror(errno) << std::endl;
+			return 1;
+		}
+	}
+
 	drop_privileges(config->user_name, config->group_name);
 
+#ifdef __linux__
+	// The milter we're taking over from is found through the PID file, which we're about to replace
+	pid_t			pid_file_pid = config->takeover ? read_pid_file() : 0;
+#endif
+
 	if (config->daemon) {
 		daemonize(config->pid_file, "");
+	} else if (config->takeover) {
+		// So that the next milter can take over from us
+		write_pid_file();
+	}
+
+	// Start watching the key map, asking the key provider, and the overload watchdog
+	// after forking, since they run in their own threads
+	if (config->watch_key_map) {
+		try {
+			key_map_watcher = new Key_map_watcher(main_config);
+			key_map_watcher->start();
+		} catch (const Config_error& e) {
+			std::clog << argv[0] << ": Unable to watch key map: " << e.message << std::endl;
+			return 1;
+		}
+	} else {
+		main_config.key_map_lines.clear();
+	}
+	if (config->overload_latency || config->callback_deadline) {
+		try {
+			overload_guard = new Overload_guard(config->overload_latency, config->overload_connections, config->callback_deadline);
+			overload_guard->start();
+		} catch (const Config_error& e) {
+			std::clog << argv[0] << ": Unable to start overload watchdog: " << e.message << std::endl;
+			return 1;
+		}
+	}
+	if (!config->key_provider_socket.empty()) {
+		try {
+			key_cache = new Key_cache(*new Socket_key_provider(config->key_provider_socket, config->key_provider_timeout),
+						config->key_cache_size, config->key_provider_max_stale);
+			key_cache->start();
+		} catch (const Config_error& e) {
+			std::clog << argv[0] << ": Unable to start key provider client: " << e.message << std::endl;
+			return 1;
+		}
 	}
 
 	if (config->socket_mode != -1) {
@@ -366,10 +858,19 @@ int main (int argc, const char** argv)
 		umask(~config->socket_mode & 0777);
 	}
 
-	openssl_init_threads();
-
 	smfi_setdbg(config->debug);
 
+	// To take over the socket from a running milter, listen on a temporary socket
+	// (named after our PID, which is known now that we've forked), and rename it
+	// over the socket path once it's listening.
+	std::string		takeover_path;
+	if (config->takeover) {
+		std::ostringstream	path;
+		path << config->socket_spec << '.' << getpid();
+		takeover_path = path.str();
+		conn_spec = "unix:" + takeover_path;
+	}
+
 	bool			ok = true;
 
 	if (ok && smfi_setconn(const_cast<char*>(conn_spec.c_str())) == MI_FAILURE) {
@@ -382,19 +883,60 @@ int main (int argc, const char** argv)
 		ok = false;
 	}
 
+	// Create a UNIX domain socket now, rather than in smfi_main, so we know which socket is ours
+	struct stat		socket_st;
+	bool			have_socket = false;
+	std::string		spare_path(takeover_path + ".spare");
+	if (ok && config->socket_spec[0] == '/') {
+#ifdef __linux__
+		struct stat	old_st;
+		pid_t		old_pid = config->takeover && stat(config->socket_spec.c_str(), &old_st) == 0 ? get_listener_pid(old_st, pid_file_pid) : 0;
+#endif
+		if (smfi_opensocket(false) == MI_FAILURE) {
+			std::clog << "smfi_opensocket failed" << std::endl;
+			ok = false;
+		} else if (config->takeover && (link(takeover_path.c_str(), spare_path.c_str()) == -1 ||
+						rename(takeover_path.c_str(), config->socket_spec.c_str()) == -1)) {
+			std::clog << config->socket_spec << ": " << strerror(errno) << std::endl;
+			unlink(takeover_path.c_str());
+			unlink(spare_path.c_str());
+			ok = false;
+		} else {
+			have_socket = stat(config->socket_spec.c_str(), &socket_st) == 0;
+		}
+
+		bool		is_finishing_takeover = false;	// (using the spare link to our socket)
+#ifdef __linux__
+		is_finishing_takeover = ok && stop_old_milter(old_pid, old_st, have_socket ? &socket_st : NULL, spare_path);
+#endif
+		if (config->takeover && !is_finishing_takeover) {
+			unlink(spare_path.c_str());
+		}
+	}
+
 	// Run the milter
 	if (ok && smfi_main() == MI_FAILURE) {
 		std::clog << "smfi_main failed" << std::endl;
 		ok = false;
 	}
 
-	// Clean up
-	openssl_cleanup_threads();
+	// Let open connections finish (e.g. when another milter has taken over the socket)
+	for (unsigned int i = 0; __sync_add_and_fetch(&num_connections, 0) > 0 && i < config->drain_timeout * 10; ++i) {
+		usleep(100000);
+	}
+	if (int remaining = __sync_add_and_fetch(&num_connections, 0)) {
+		std::clog << "Exiting with " << remaining << " connections still open" << std::endl;
+	}
 
-	if (config->socket_spec[0] == '/') {
+	// Clean up, leaving the socket and PID file alone if another milter has taken them over
+	struct stat		st;
+	if (have_socket && lstat(config->socket_spec.c_str(), &st) == 0 && st.st_dev == socket_st.st_dev && st.st_ino == socket_st.st_ino) {
 		unlink(config->socket_spec.c_str());
 	}
-	if (!config->pid_file.empty()) {
+	if (config->takeover) {
+		unlink(spare_path.c_str());
+	}
+	if (!config->pid_file.empty() && read_pid_file() == getpid()) {
 		unlink(config->pid_file.c_str());
 	}
        
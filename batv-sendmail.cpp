@@ -0,0 +1,220 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "prvs.hpp"
+#include "key.hpp"
+#include "common.hpp"
+#include "address.hpp"
+#include "daemon-client.hpp"
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <string.h>
+
+using namespace batv;
+
+namespace {
+	// Sign the sender address, returning the exit status (0 on success)
+	int sign_sender (const char* argv0, const std::string& sender, std::string& batv_sender)
+	{
+		char		sub_address_delimiter = '+';
+		unsigned int	address_lifetime = 7;
+		std::string	key_file;
+		std::string	key_map_file;
+
+		if (const char* delimiter = std::getenv("BATV_DELIMITER")) {
+			if (*delimiter) {
+				if (std::strlen(delimiter) != 1) {
+					std::clog << argv0 << ": sub address delimiter (as specified by $BATV_DELIMITER) must be exactly one character" << std::endl;
+					return 1;
+				}
+				sub_address_delimiter = delimiter[0];
+			}
+		}
+		if (const char* path = std::getenv("BATV_KEY_FILE")) {
+			key_file = path;
+		}
+		if (const char* lifetime = std::getenv("BATV_LIFETIME")) {
+			if (*lifetime) {
+				address_lifetime = std::atoi(lifetime);
+				if (address_lifetime < 1 || address_lifetime > 999) {
+					std::clog << argv0 << ": address lifetime (as specified by $BATV_LIFETIME) must be between 1 and 999, inclusive" << std::endl;
+					return 1;
+				}
+			}
+		}
+
+		// Use batv-daemon if it's running and no key file was given
+		if (key_file.empty()) {
+			Daemon_client	daemon;
+			int		code = -1;
+			if (daemon.connect(daemon_socket_path())) {
+				code = daemon.request('S', address_lifetime, sub_address_delimiter, sender, batv_sender);
+			}
+			if (code == DAEMON_OK) {
+				return 0;
+			} else if (code == DAEMON_NO_KEY) {
+				std::clog << argv0 << ": " << sender << ": No key available for this sender" << std::endl;
+				return 1;
+			} else if (code == DAEMON_NO_DOMAIN) {
+				std::clog << argv0 << ": " << sender << ": Address is missing domain name" << std::endl;
+				return 1;
+			}
+		}
+
+		// Load the key and key map
+		check_personal_key_path(key_file, ".batv-key");
+		check_personal_key_path(key_map_file, ".batv-keys");
+
+		if (key_file.empty() && key_map_file.empty()) {
+			std::clog << argv0 << ": Neither ~/.batv-key nor ~/.batv-keys exist." << std::endl;
+			std::clog << "Please create one and/or the other or specify an alternative path using $BATV_KEY_FILE" << std::endl;
+			return 1;
+		}
+
+		Key_entry	key;
+		Key_map		key_map;
+		if (!key_file.empty()) {
+			std::ifstream	key_in(key_file.c_str());
+			load_key(key, key_in);
+		}
+		if (!key_map_file.empty()) {
+			std::ifstream	key_map_in(key_map_file.c_str());
+			load_key_map(key_map, key_map_in);
+		}
+
+		// Determine what key to use to sign this message
+		Key_ref		use_key = get_key(key_map, sender, !key.empty() ? &key : NULL);
+		if (!use_key || !use_key->can_sign()) {
+			std::clog << argv0 << ": " << sender << ": No key available for this sender" << std::endl;
+			return 1;
+		}
+
+		// Generate the BATV address
+		Email_address	from_address;
+		from_address.parse(sender.c_str());
+		if (from_address.domain.empty()) {
+			std::clog << argv0 << ": " << sender << ": Address is missing domain name" << std::endl;
+			return 1;
+		}
+
+		batv_sender = prvs_generate(from_address, address_lifetime, *use_key).make_string(sub_address_delimiter);
+		return 0;
+	}
+}
+
+// A drop-in replacement for sendmail which signs the sender address (given with
+// -f or -r) and then execs sendmail.  Takes the same options as sendmail.
+int main (int argc, char** argv)
+try {
+	// Relevant sendmail options:
+	//  B:		body type 7bit or 8bitmime
+	//  C:		config file
+	//  F:		sender fullname
+	//  f:		sender address
+	//  i		ignore dots
+	//  h:		hop count
+	//  L:		syslog label
+	//  N:		DSN conditions
+	//  n		don't do aliasing
+	//  O:		set option
+	//  o:		set option (important for -oi... but note syntax sometimes demands two args)
+	//  R:		return limit
+	//  r:		obsolete form of -f
+	//  t		extract recips from header
+	//  V:		original envelope ID
+	//  v		verbose mode
+	std::string			sender;
+	std::vector<std::string>	sendmail_options;
+
+	// Like the shell's getopts: stop at the first non-option and report errors ourselves
+	int				flag;
+	while ((flag = getopt(argc, argv, "+:B:C:F:f:ih:L:N:nO:o:R:r:tV:v")) != -1) {
+		switch (flag) {
+		case '?':
+			std::clog << argv[0] << ": Unknown option: " << static_cast<char>(optopt) << std::endl;
+			return 2;
+		case ':':
+			std::clog << argv[0] << ": Option requires an argument: " << static_cast<char>(optopt) << std::endl;
+			return 2;
+		case 'f':
+		case 'r':
+			sender = optarg;
+			break;
+		case 'o':
+			sendmail_options.push_back(std::string("-o") + optarg);
+			break;
+		case 'B': case 'C': case 'F': case 'h': case 'L': case 'N': case 'O': case 'R': case 'V':
+			sendmail_options.push_back(std::string("-") + static_cast<char>(flag));
+			sendmail_options.push_back(optarg);
+			break;
+		default:
+			sendmail_options.push_back(std::string("-") + static_cast<char>(flag));
+			break;
+		}
+	}
+
+	if (sender.empty()) {
+		std::clog << argv[0] << ": Sender must be specified with -f" << std::endl;
+		return 2;
+	}
+
+	std::string			batv_sender;
+	if (int status = sign_sender(argv[0], sender, batv_sender)) {
+		return status;
+	}
+
+	// exec sendmail -f BATV_SENDER SENDMAIL_OPTIONS... -- ARGS...
+	std::vector<char*>		args;
+	args.push_back(const_cast<char*>("sendmail"));
+	args.push_back(const_cast<char*>("-f"));
+	args.push_back(const_cast<char*>(batv_sender.c_str()));
+	for (size_t i = 0; i < sendmail_options.size(); ++i) {
+		args.push_back(const_cast<char*>(sendmail_options[i].c_str()));
+	}
+	args.push_back(const_cast<char*>("--"));
+	for (int i = optind; i < argc; ++i) {
+		args.push_back(argv[i]);
+	}
+	args.push_back(NULL);
+
+	execvp("sendmail", &args[0]);
+	std::clog << argv[0] << ": sendmail: " << strerror(errno) << std::endl;
+	return errno == ENOENT ? 127 : 126;
+
+} catch (const Config_error& e) {
+	std::clog << argv[0] << ": " << e.message << std::endl;
+	return 1;
+}
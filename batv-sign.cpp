@@ -32,12 +32,15 @@
 #include "key.hpp"
 #include "common.hpp"
 #include "address.hpp"
+#include "daemon-client.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <cstdlib>
+#include <vector>
 #include <string>
 #include <string.h>
 
@@ -47,26 +50,147 @@ namespace {
 	void print_usage (const char* argv0)
 	{
 		std::clog << "Usage: " << argv0 << " [OPTIONS...] FROM_ADDRESS" << std::endl;
+		std::clog << "       " << argv0 << " -b [OPTIONS...]" << std::endl;
 		std::clog << "Options:" << std::endl;
+		std::clog << " -b                 -- sign every address on stdin (one per line), writing" << std::endl;
+		std::clog << "                       the signed addresses to stdout in the same order" << std::endl;
+		std::clog << " -j THREADS         -- number of threads to use in -b mode (default: # of CPUs)" << std::endl;
 		std::clog << " -k KEY_FILE        -- path to key file (default: ~/.batv-key)" << std::endl;
 		std::clog << " -K KEY_MAP_FILE    -- path to key map file (default: ~/.batv-keys)" << std::endl;
 		std::clog << " -l LIFETIME        -- lifetime, in days, of BATV address (default: 7)" << std::endl;
 		std::clog << " -d SUB_ADDR_DELIM  -- sub address delimiter (default: +)" << std::endl;
 	}
+
+	struct Bulk_signing {
+		const Key_map*			key_map;
+		const Key_entry*		default_key;
+		unsigned int			address_lifetime;
+		char				sub_address_delimiter;
+		std::vector<const char*>	addresses;	// NUL-terminated lines of the input buffer
+		std::vector<std::string>	results;	// signed addresses, or empty if unable to sign
+	};
+
+	void bulk_sign_address (size_t index, void* arg)
+	{
+		Bulk_signing&		bulk = *static_cast<Bulk_signing*>(arg);
+		const char*		address = bulk.addresses[index];
+		Key_ref			use_key = get_key(*bulk.key_map, address, bulk.default_key);
+		Email_address		from_address;
+		from_address.parse(address);
+		if (use_key.get() && use_key->can_sign() && !from_address.domain.empty()) {
+			bulk.results[index] = prvs_generate(from_address, bulk.address_lifetime, *use_key).make_string(bulk.sub_address_delimiter);
+		} else {
+			bulk.results[index].clear();
+		}
+	}
+
+	void write_all (int fd, const char* p, size_t len)
+	{
+		while (len > 0) {
+			ssize_t		bytes_written = write(fd, p, len);
+			if (bytes_written == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw Config_error(std::string("Error writing output: ") + strerror(errno));
+			}
+			p += bytes_written;
+			len -= bytes_written;
+		}
+	}
+
+	// Sign every address on stdin, in batches.  Each batch is read with large reads, signed in
+	// parallel, and written out with a single write so output to a pipe is efficient.
+	// Addresses which can't be signed are written out unchanged.  Returns the number of such addresses.
+	unsigned long bulk_sign (const char* argv0, Bulk_signing& bulk, unsigned int num_threads)
+	{
+		const size_t		batch_bytes = 1024 * 1024;
+		std::vector<char>	input;
+		size_t			input_len = 0;	// bytes of input held in input
+		bool			eof = false;
+		std::string		output;
+		unsigned long		num_failed = 0;
+
+		while (!eof || input_len > 0) {
+			// Read another batch's worth of input (or until EOF), leaving room for a NUL
+			input.resize(input_len + batch_bytes + 1);
+			while (!eof && input_len < input.size() - 1) {
+				ssize_t		bytes_read = read(0, &input[input_len], input.size() - 1 - input_len);
+				if (bytes_read == -1 && errno == EINTR) {
+					continue;
+				}
+				if (bytes_read == -1) {
+					throw Config_error(std::string("Error reading input: ") + strerror(errno));
+				}
+				eof = bytes_read == 0;
+				input_len += bytes_read;
+			}
+
+			// Split complete lines (and a final unterminated line at EOF) into addresses
+			bulk.addresses.clear();
+			char*		line = &input[0];
+			char*		input_end = &input[0] + input_len;
+			while (char* newline = static_cast<char*>(std::memchr(line, '\n', input_end - line))) {
+				*newline = '\0';
+				bulk.addresses.push_back(line);
+				line = newline + 1;
+			}
+			if (eof && line < input_end) {
+				*input_end = '\0';
+				bulk.addresses.push_back(line);
+				line = input_end;
+			}
+
+			bulk.results.resize(bulk.addresses.size());
+			parallel_for(bulk.addresses.size(), num_threads, bulk_sign_address, &bulk);
+
+			output.clear();
+			for (size_t i = 0; i < bulk.addresses.size(); ++i) {
+				if (bulk.results[i].empty() && bulk.addresses[i][0] != '\0') {
+					std::clog << argv0 << ": " << bulk.addresses[i] << ": Unable to sign address (no key available or missing domain name)" << std::endl;
+					output.append(bulk.addresses[i]);
+					++num_failed;
+				} else {
+					output.append(bulk.results[i]);
+				}
+				output.push_back('\n');
+			}
+			write_all(1, output.data(), output.size());
+
+			// Keep any incomplete line for the next batch
+			input_len = input_end - line;
+			std::memmove(&input[0], line, input_len);
+			if (eof && bulk.addresses.empty()) {
+				break;
+			}
+		}
+		return num_failed;
+	}
 }
 
 int main (int argc, char** argv)
 try {
 	char		sub_address_delimiter = '+';
 	unsigned int	address_lifetime = 7;
-	Key		key;
+	Key_entry	key;
 	std::string	key_file;
 	Key_map		key_map;
 	std::string	key_map_file;
+	bool		is_bulk = false;
+	unsigned int	num_threads = num_processors();
 
 	int		flag;
-	while ((flag = getopt(argc, argv, "k:K:l:d:")) != -1) {
+	while ((flag = getopt(argc, argv, "bj:k:K:l:d:")) != -1) {
 		switch (flag) {
+		case 'b':
+			is_bulk = true;
+			break;
+		case 'j':
+			if (!parse_num_threads(optarg, num_threads)) {
+				std::clog << argv[0] << ": number of threads (as specified by -j) must be between 1 and " << MAX_THREADS << ", inclusive" << std::endl;
+				return 1;
+			}
+			break;
 		case 'k':
 			key_file = optarg;
 			break;
@@ -89,7 +213,7 @@ try {
 		}
 	}
 
-	if (argc - optind != 1) {
+	if (argc - optind != (is_bulk ? 0 : 1)) {
 		print_usage(argv[0]);
 		return 2;
 	}
@@ -99,6 +223,27 @@ try {
 		return 1;
 	}
 
+	// If no key paths were given and a batv-daemon is running, have it sign the address
+	// (saving us from having to load the keys).  Otherwise, fall back to doing it ourselves.
+	if (!is_bulk && key_file.empty() && key_map_file.empty()) {
+		Daemon_client	daemon;
+		std::string	result;
+		int		code = -1;
+		if (daemon.connect(daemon_socket_path())) {
+			code = daemon.request('S', address_lifetime, sub_address_delimiter, argv[optind], result);
+		}
+		if (code == DAEMON_OK) {
+			std::cout << result << std::endl;
+			return 0;
+		} else if (code == DAEMON_NO_KEY) {
+			std::clog << argv[0] << ": " << argv[optind] << ": No key available for this sender" << std::endl;
+			return 1;
+		} else if (code == DAEMON_NO_DOMAIN) {
+			std::clog << argv[0] << ": " << argv[optind] << ": Address is missing domain name" << std::endl;
+			return 1;
+		}
+	}
+
 	// Load the key
 	if (key_file.empty()) {
 		if (const char* home_dir = std::getenv("HOME")) {
@@ -135,10 +280,21 @@ try {
 		std::ifstream	key_map_in(key_map_file.c_str());
 		load_key_map(key_map, key_map_in);
 	}
+
+	if (is_bulk) {
+		Bulk_signing	bulk;
+		bulk.key_map = &key_map;
+		bulk.default_key = !key.empty() ? &key : NULL;
+		bulk.address_lifetime = address_lifetime;
+		bulk.sub_address_delimiter = sub_address_delimiter;
+
+		unsigned long	num_failed = bulk_sign(argv[0], bulk, num_threads);
+		return num_failed ? 1 : 0;
+	}
 	
 	// Determine what key to use to sign this message
-	const Key*		use_key = get_key(key_map, argv[optind], !key.empty() ? &key : NULL);
-	if (!use_key) {
+	Key_ref			use_key = get_key(key_map, argv[optind], !key.empty() ? &key : NULL);
+	if (!use_key || !use_key->can_sign()) {
 		std::clog << argv[0] << ": " << argv[optind] << ": No key available for this sender" << std::endl;
 		return 1;
 	}
@@ -32,15 +32,23 @@
 #include "key.hpp"
 #include "common.hpp"
 #include "address.hpp"
+#include "mail.hpp"
+#include "daemon-client.hpp"
+#include "parallel.hpp"
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <cstring>
 #include <cstdlib>
 #include <vector>
 #include <utility>
-#include <limits>
 #include <sstream>
 #include <set>
 #include <string>
@@ -53,63 +61,130 @@ namespace {
 	{
 		std::clog << "Usage:" << std::endl;
 		std::clog << " " << argv0 << " [OPTIONS...] BATV-ADDRESS" << std::endl;
-		std::clog << " " << argv0 << " [-f|-m] [OPTIONS...]" << std::endl;
+		std::clog << " " << argv0 << " [-f|-m] [-M] [OPTIONS...]" << std::endl;
+		std::clog << " " << argv0 << " -D [OPTIONS...] [MAILDIR...]" << std::endl;
 		std::clog << "Options:" << std::endl;
 		std::clog << " -f                 -- filter message on stdin, add X-Batv-Status header" << std::endl;
 		std::clog << " -m                 -- read message from stdin, validate the recipient address" << std::endl;
+		std::clog << " -M                 -- stdin is an mbox containing any number of messages; with -f," << std::endl;
+		std::clog << "                       filter each one; with -m, print a verdict for each one" << std::endl;
+		std::clog << " -D                 -- validate every message in the given Maildirs (or in the" << std::endl;
+		std::clog << "                       files listed on stdin), printing a verdict for each" << std::endl;
+		std::clog << " -j THREADS         -- number of threads to use in -D mode (default: # of CPUs)" << std::endl;
 		std::clog << " -k KEY_FILE        -- path to key file (default: ~/.batv-key)" << std::endl;
 		std::clog << " -K KEY_MAP_FILE    -- path to key map file (default: ~/.batv-keys)" << std::endl;
 		std::clog << " -l LIFETIME        -- lifetime, in days, of BATV addresses (default: 7)" << std::endl;
 		std::clog << " -d SUB_ADDR_DELIM  -- sub address delimiter (default: +)" << std::endl;
-		std::clog << " -h RCPT_HEADER     -- envelope recipient header (for -f and -m mode)" << std::endl;
+		std::clog << " -h RCPT_HEADER     -- envelope recipient header (for -f, -m, and -D mode)" << std::endl;
 		std::clog << "                       (default: Delivered-To)" << std::endl;
 	}
 
 	struct Validate_config {
 		Key_map			keys;			// map from sender address/domain to their HMAC key
-		Key			default_key;		// key to use if address/domain not in key map
+		Key_entry		default_key;		// key to use if address/domain not in key map
 		unsigned int		address_lifetime;	// in days, how long BATV address is valid
 		char			sub_address_delimiter;	// e.g. "+"
 		std::string		rcpt_header;		// e.g. "Delivered-To"
+		Daemon_client*		daemon;			// batv-daemon to ask instead of using the keys, or NULL
+		std::string		key_file;		// key and key map to load if not using the daemon
+		std::string		key_map_file;		// (empty for ~/.batv-key and ~/.batv-keys)
 
 		Validate_config ()
 		{
+			daemon = NULL;
 			address_lifetime = 7;
 			sub_address_delimiter = '+';
 			rcpt_header = "Delivered-To";
 		}
 
-		const Key*		get_key (const std::string& sender_address) const
+		Key_ref			get_key (const std::string& sender_address) const
 		{
 			return batv::get_key(keys, sender_address, !default_key.empty() ? &default_key : NULL);
 		}
+		bool			may_have_key (const std::string& domain) const
+		{
+			return !default_key.empty() || keys.may_have_key(domain);
+		}
+
+		// Stop using the daemon (if any), and load the default key and key map instead.
+		// Throws Config_error if there are neither.
+		void			load_keys ()
+		{
+			daemon = NULL;
+			check_personal_key_path(key_file, ".batv-key");
+			check_personal_key_path(key_map_file, ".batv-keys");
+
+			if (key_file.empty() && key_map_file.empty()) {
+				throw Config_error("Neither ~/.batv-key nor ~/.batv-keys exist.\n"
+						"Please create one and/or the other or specify alternative paths using -k or -K");
+			}
+
+			if (!key_file.empty()) {
+				std::ifstream	key_in(key_file.c_str());
+				load_key(default_key, key_in);
+			}
+			if (!key_map_file.empty()) {
+				std::ifstream	key_map_in(key_map_file.c_str());
+				load_key_map(keys, key_map_in);
+			}
+		}
 	};
 
-	struct Input_error {
-		std::string		message;
-		explicit Input_error (const std::string& m) : message(m) { }
+	// Exit statuses, also used as verdicts in -D mode
+	enum {
+		STATUS_VALID		= 0,
+		STATUS_INVALID		= 10,	// invalid signature
+		STATUS_NOT_BATV		= 11,	// not a BATV address
+		STATUS_NO_KEY		= 12,	// no key available for the sender
+		STATUS_NO_RCPT		= 13	// no envelope recipient header found in message
 	};
 
-	void parse_header (const std::string& first_line, std::istream& in, std::string& name, std::string& value)
+	const char* status_name (int status)
 	{
-		if (first_line[0] == ' ' || first_line[0] == '\t') {
-			throw Input_error("Malformed message headers: unexpected continuation header");
+		switch (status) {
+		case STATUS_VALID:	return "valid";
+		case STATUS_INVALID:	return "invalid";
+		case STATUS_NOT_BATV:	return "not-batv";
+		case STATUS_NO_KEY:	return "no-key";
+		case STATUS_NO_RCPT:	return "no-rcpt";
+		}
+		return "error";
+	}
+
+	// Validate a single envelope recipient, returning one of the above statuses.
+	// If it's a BATV address, batv_rcpt is set to the parsed address.  If the daemon
+	// fails, the keys are loaded into config and used from then on.
+	int validate_rcpt (Validate_config& config, const Email_address& rcpt_to, Batv_address& batv_rcpt)
+	{
+		if (!batv_rcpt.parse(rcpt_to, config.sub_address_delimiter) || batv_rcpt.tag_type != "prvs") {
+			return STATUS_NOT_BATV;
+		}
+
+		if (config.daemon) {
+			std::string	result;
+			int		code = config.daemon->request('V', config.address_lifetime, config.sub_address_delimiter, rcpt_to.make_string(), result);
+			if (code == DAEMON_OK || code == DAEMON_INVALID || code == DAEMON_NOT_BATV || code == DAEMON_NO_KEY) {
+				return code;
+			}
+			if (code == DAEMON_BAD_REQUEST) {
+				// Contains control characters (e.g. from a folded header), so it's not a usable address
+				return STATUS_NOT_BATV;
+			}
+			// Carry on without the daemon, as batv-sign does when it can't use it
+			std::clog << "Warning: lost connection to batv-daemon; loading the keys instead" << std::endl;
+			config.load_keys();
 		}
 
-		// Parse first line of header
-		std::string::size_type	colon_pos = first_line.find(':');
-		if (colon_pos == std::string::npos) {
-			throw Input_error("No colon in message header line");
+		// Get the key for this sender:
+		if (!config.may_have_key(batv_rcpt.orig_mailfrom.domain)) {
+			return STATUS_NO_KEY;
 		}
-		name = first_line.substr(0, colon_pos);
-		value = first_line.substr(colon_pos + 1);
-
-		// Read in continuation lines, if any
-		while (in.peek() == ' ' || in.peek() == '\t') {
-			std::string	line;
-			std::getline(in, line);
-			value.append("\n").append(line);
+		Key_ref		batv_rcpt_key = config.get_key(batv_rcpt.orig_mailfrom.make_string());
+		if (!batv_rcpt_key) {
+			return STATUS_NO_KEY;
 		}
+
+		return prvs_validate(batv_rcpt, config.address_lifetime, *batv_rcpt_key) ? STATUS_VALID : STATUS_INVALID;
 	}
 
 	const char* after_ws (const char* p)
@@ -118,111 +193,275 @@ namespace {
 		return p;
 	}
 
-	// Read and parse the message, returning all the Delivered-To (or equivalent) headers.
-	std::vector<Email_address> parse_mail (const Validate_config& config, std::istream& in)
+	// Read and parse the message headers, returning all the Delivered-To (or equivalent) headers.
+	// Stops reading at the end of the headers, so the time taken doesn't depend on the size of the body.
+	std::vector<Email_address> parse_mail (const Validate_config& config, Mail_reader& in)
 	{
 		std::vector<Email_address>	rcpt_tos;
-		bool				first = true;	// becomes false after the first line of input
-		while (in.peek() != -1 && in.peek() != '\n') {
-			// Read first line of header
-			std::string		first_line;
-			std::getline(in, first_line);
-
-			if (first && std::strncmp(first_line.c_str(), "From ", 5) == 0) {
-				// The input must be in mbox format.  Skip the "From " line.
-				first = false;
-				continue;
-			}
 
-			// Parse the header, possibly reading in continuation lines
-			std::string	name;
-			std::string	value;
-			parse_header(first_line, in, name, value);
+		// If the input is in mbox format, skip the "From " line.
+		in.read_from_line(NULL);
 
-			// Process the header
-			if (strcasecmp(name.c_str(), config.rcpt_header.c_str()) == 0) {
+		Header				header;
+		while (in.next_header(header)) {
+			if (header.name_is(config.rcpt_header)) {
 				rcpt_tos.push_back(Email_address());
-				rcpt_tos.back().parse(canon_address(after_ws(value.c_str())).c_str());
+				rcpt_tos.back().parse(canon_address(after_ws(header.value_string().c_str())).c_str());
 			}
-			first = false;
 		}
 
-		// Ignore the rest of the input
-		in.ignore(std::numeric_limits<std::streamsize>::max());
-
 		return rcpt_tos;
 	}
 
-	void filter (const Validate_config& config, std::istream& in, std::ostream& out)
+	// Filter the "From " line (if any) and headers of a message, leaving the input positioned at the body
+	void filter_headers (Validate_config& config, Mail_reader& in, std::ostream& out)
 	{
-		bool	done = false;	// becomes true when we've processed the envelope recipient
-		bool	first = true;	// becomes false after the first line of input
-		while (in.peek() != -1 && in.peek() != '\n') {
-			// Read first line of header
-			std::string		first_line;
-			std::getline(in, first_line);
-
-			if (first && std::strncmp(first_line.c_str(), "From ", 5) == 0) {
-				// The input must be in mbox format.  Pass through the "From " line.
-				out << first_line << '\n';
-				first = false;
-				continue;
-			}
+		bool		done = false;	// becomes true when we've processed the envelope recipient
 
-			// Parse the header, possibly reading in continuation lines
-			std::string	name;
-			std::string	value;
-			parse_header(first_line, in, name, value);
+		// If the input is in mbox format, pass through the "From " line.
+		std::string	from_line;
+		if (in.read_from_line(&from_line)) {
+			out << from_line << '\n';
+		}
 
+		Header		header;
+		while (in.next_header(header)) {
 			// Process the header
-			if (strcasecmp(name.c_str(), "X-Batv-Status") == 0) {
+			if (header.name_is("X-Batv-Status")) {
 				// Remove this header to prevent malicious senders from faking us out
 
-			} else if (!done && strcasecmp(name.c_str(), config.rcpt_header.c_str()) == 0) {
+			} else if (!done && header.name_is(config.rcpt_header)) {
+				std::string		value(header.value_string());
 				Email_address		rcpt_to;
 				rcpt_to.parse(canon_address(after_ws(value.c_str())).c_str());
 
-				// Make sure that the BATV address is syntactically valid AND it's using a known tag type:
+				// Only rewrite syntactically valid BATV addresses of senders with keys
 				Batv_address		batv_rcpt;
-				if (batv_rcpt.parse(rcpt_to, config.sub_address_delimiter) && batv_rcpt.tag_type == "prvs") {
-					// Get the key for this sender:
-					const Key*	batv_rcpt_key = config.get_key(batv_rcpt.orig_mailfrom.make_string());
-					if (batv_rcpt_key != NULL) {
-						// A non-NULL key means this is a BATV sender.
-
-						// Restore original envelope recipient
-						out << name << ": " << batv_rcpt.orig_mailfrom.make_string() << '\n';
-
-						// But also leave the original BATV envelope recipient in a different header
-						out << "X-Batv-Delivered-To:" << value << '\n';
-
-						// Validate the address and put the status in the X-Batv-Status header
-						if (prvs_validate(batv_rcpt, config.address_lifetime, *batv_rcpt_key)) {
-							out << "X-Batv-Status: valid\n";
-						} else {
-							out << "X-Batv-Status: invalid\n";
-						}
-
-						// Set a flag so we don't do this again.
-						done = true;
+				int			status = validate_rcpt(config, rcpt_to, batv_rcpt);
+				if (status == STATUS_VALID || status == STATUS_INVALID) {
+					// Restore original envelope recipient
+					out.write(header.name, header.name_len);
+					out << ": " << batv_rcpt.orig_mailfrom.make_string() << '\n';
+
+					// But also leave the original BATV envelope recipient in a different header
+					out << "X-Batv-Delivered-To:" << value << '\n';
+
+					// Put the validation status in the X-Batv-Status header
+					if (status == STATUS_VALID) {
+						out << "X-Batv-Status: valid\n";
+					} else {
+						out << "X-Batv-Status: invalid\n";
 					}
+
+					// Set a flag so we don't do this again.
+					done = true;
 				}
 				if (!done) {
 					// Copy through the header unmodified
-					out << name << ':' << value << '\n';
+					out.write(header.raw(), header.raw_len());
+					out << '\n';
 				}
 
 			} else {
 				// Copy through this header unmodified
-				out << name << ':' << value << '\n';
+				out.write(header.raw(), header.raw_len());
+				out << '\n';
 			}
+		}
+	}
 
+	void filter (Validate_config& config, Mail_reader& in, std::ostream& out)
+	{
+		filter_headers(config, in, out);
 
-			first = false;
+		// Copy through the message body
+		in.copy_rest(out);
+	}
+
+	// Filter every message in an mbox in a single pass
+	void filter_mbox (Validate_config& config, Mail_reader& in, std::ostream& out)
+	{
+		if (in.at_end()) {
+			return;
 		}
+		do {
+			try {
+				filter_headers(config, in, out);
+			} catch (const Input_error& e) {
+				// The malformed header hasn't been consumed yet, so it and the rest
+				// of the message will be copied through unmodified below.
+				std::clog << "Warning: " << e.message << std::endl;
+			}
+		} while (in.copy_message_body(&out));
+	}
 
-		// Copy through the message body
-		out << in.rdbuf();
+	// Validate the envelope recipients of the message, appending TAB VERDICT [TAB ORIGINAL-RECIPIENT] to line
+	void append_verdict (std::string& line, Validate_config& config, Mail_reader& in)
+	{
+		std::vector<Email_address>	rcpt_tos(parse_mail(config, in));
+
+		int				status = STATUS_NO_RCPT;
+		Batv_address			batv_rcpt;
+		for (size_t i = 0; i < rcpt_tos.size() && status != STATUS_VALID; ++i) {
+			status = validate_rcpt(config, rcpt_tos[i], batv_rcpt);
+		}
+		line.append("\t").append(status_name(status));
+		if (status == STATUS_VALID) {
+			line.append("\t").append(batv_rcpt.orig_mailfrom.make_string());
+		}
+	}
+
+	// Validate every message in an mbox in a single pass, writing a line of the form
+	// MESSAGE-NUMBER<TAB>VERDICT[<TAB>DETAIL] for each (nothing if the mbox is empty)
+	void validate_mbox (Validate_config& config, Mail_reader& in, std::ostream& out)
+	{
+		if (in.at_end()) {
+			return;
+		}
+		unsigned long		message_number = 0;
+		std::ostringstream	line_out;
+		do {
+			line_out.str("");
+			line_out << ++message_number;
+			std::string	line(line_out.str());
+			try {
+				append_verdict(line, config, in);
+			} catch (const Input_error& e) {
+				line.append("\terror\t").append(e.message);
+			}
+			line.push_back('\n');
+			out.write(line.data(), line.size());
+		} while (in.copy_message_body(NULL));
+	}
+
+	// A read-only memory mapping of an entire file
+	struct Mapped_file {
+		const char*		data;
+		size_t			size;
+
+		explicit Mapped_file (const std::string& path)
+		{
+			data = NULL;
+			size = 0;
+			int		fd = open(path.c_str(), O_RDONLY);
+			if (fd == -1) {
+				throw Input_error(strerror(errno));
+			}
+			struct stat	st;
+			if (fstat(fd, &st) == -1) {
+				int	saved_errno = errno;
+				close(fd);
+				throw Input_error(strerror(saved_errno));
+			}
+			size = st.st_size;
+			if (size > 0) {
+				void*	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p == MAP_FAILED) {
+					int	saved_errno = errno;
+					close(fd);
+					throw Input_error(strerror(saved_errno));
+				}
+				data = static_cast<const char*>(p);
+			}
+			close(fd);
+		}
+		~Mapped_file ()
+		{
+			if (data) {
+				munmap(const_cast<char*>(data), size);
+			}
+		}
+	private:
+		Mapped_file (const Mapped_file&);
+		Mapped_file& operator= (const Mapped_file&);
+	};
+
+	// Recursively find the messages in the cur and new directories of a Maildir tree
+	// (including Maildir++ sub-folders), appending their paths to paths.
+	void find_maildir_messages (const std::string& dir_path, bool is_message_dir, std::vector<std::string>& paths)
+	{
+		DIR*		dir = opendir(dir_path.c_str());
+		if (!dir) {
+			std::clog << dir_path << ": " << strerror(errno) << std::endl;
+			return;
+		}
+
+		while (struct dirent* ent = readdir(dir)) {
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+				continue;
+			}
+
+			std::string	path(dir_path + "/" + ent->d_name);
+			bool		is_dir;
+			bool		is_file;
+			if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+				is_dir = ent->d_type == DT_DIR;
+				is_file = ent->d_type == DT_REG;
+			} else {
+				struct stat	st;
+				if (stat(path.c_str(), &st) == -1) {
+					continue;
+				}
+				is_dir = S_ISDIR(st.st_mode);
+				is_file = S_ISREG(st.st_mode);
+			}
+
+			if (is_file && is_message_dir) {
+				paths.push_back(path);
+			} else if (is_dir && std::strcmp(ent->d_name, "tmp") != 0) {
+				find_maildir_messages(path, std::strcmp(ent->d_name, "cur") == 0 || std::strcmp(ent->d_name, "new") == 0, paths);
+			}
+		}
+		closedir(dir);
+	}
+
+	struct Bulk_validation {
+		Validate_config*		config;		// (not changed, since -D mode doesn't use the daemon)
+		std::vector<std::string>	paths;
+		pthread_mutex_t			output_mutex;
+	};
+
+	// Validate one message file, writing a line of the form PATH<TAB>VERDICT[<TAB>DETAIL] to stdout
+	void bulk_validate_message (size_t index, void* arg)
+	{
+		Bulk_validation&		bulk = *static_cast<Bulk_validation*>(arg);
+		const std::string&		path = bulk.paths[index];
+		std::string			line(path);
+		try {
+			Mapped_file		file(path);
+			Mail_reader		in(file.data, file.size);
+			append_verdict(line, *bulk.config, in);
+		} catch (const Input_error& e) {
+			line.append("\terror\t").append(e.message);
+		}
+		line.push_back('\n');
+
+		pthread_mutex_lock(&bulk.output_mutex);
+		std::cout.write(line.data(), line.size());
+		pthread_mutex_unlock(&bulk.output_mutex);
+	}
+
+	void bulk_validate (Validate_config& config, char** maildirs, int num_maildirs, unsigned int num_threads)
+	{
+		Bulk_validation			bulk;
+		bulk.config = &config;
+		if (num_maildirs > 0) {
+			for (int i = 0; i < num_maildirs; ++i) {
+				find_maildir_messages(maildirs[i], false, bulk.paths);
+			}
+		} else {
+			std::string		path;
+			while (std::getline(std::cin, path)) {
+				if (!path.empty()) {
+					bulk.paths.push_back(path);
+				}
+			}
+		}
+
+		pthread_mutex_init(&bulk.output_mutex, NULL);
+		parallel_for(bulk.paths.size(), num_threads, bulk_validate_message, &bulk);
+		pthread_mutex_destroy(&bulk.output_mutex);
+		std::cout.flush();
 	}
 }
 
@@ -230,12 +469,13 @@ int main (int argc, char** argv)
 try {
 	bool		is_filter = false;
 	bool		is_mail_input = false;
+	bool		is_bulk = false;
+	bool		is_mbox = false;
+	unsigned int	num_threads = num_processors();
 	Validate_config	config;
-	std::string	key_file;
-	std::string	key_map_file;
 
 	int		flag;
-	while ((flag = getopt(argc, argv, "fmk:K:l:d:h:")) != -1) {
+	while ((flag = getopt(argc, argv, "fmMDj:k:K:l:d:h:")) != -1) {
 		switch (flag) {
 		case 'f':
 			is_filter = true;
@@ -243,11 +483,23 @@ try {
 		case 'm':
 			is_mail_input = true;
 			break;
+		case 'M':
+			is_mbox = true;
+			break;
+		case 'D':
+			is_bulk = true;
+			break;
+		case 'j':
+			if (!parse_num_threads(optarg, num_threads)) {
+				std::clog << argv[0] << ": number of threads (as specified by -j) must be between 1 and " << MAX_THREADS << ", inclusive" << std::endl;
+				return 1;
+			}
+			break;
 		case 'k':
-			key_file = optarg;
+			config.key_file = optarg;
 			break;
 		case 'K':
-			key_map_file = optarg;
+			config.key_map_file = optarg;
 			break;
 		case 'l':
 			config.address_lifetime = std::atoi(optarg);
@@ -269,16 +521,22 @@ try {
 	}
 
 	// Validate arguments
-	if (is_filter && is_mail_input) {
-		std::clog << argv[0] << ": can't specify both -f and -m" << std::endl;
+	if (is_filter + is_mail_input + is_bulk > 1) {
+		std::clog << argv[0] << ": can't specify more than one of -f, -m, and -D" << std::endl;
+		print_usage(argv[0]);
+		return 2;
+	}
+
+	if (is_mbox && !is_filter && !is_mail_input) {
+		std::clog << argv[0] << ": -M must be used with -f or -m" << std::endl;
 		print_usage(argv[0]);
 		return 2;
 	}
 
-	if (!is_filter && !is_mail_input && argc - optind != 1) {
+	if (!is_bulk && !is_filter && !is_mail_input && argc - optind != 1) {
 		print_usage(argv[0]);
 		return 2;
-	} else if ((is_filter || is_mail_input) && argc - optind != 0) {
+	} else if (!is_bulk && (is_filter || is_mail_input) && argc - optind != 0) {
 		print_usage(argv[0]);
 		return 2;
 	}
@@ -288,38 +546,42 @@ try {
 		return 1;
 	}
 
-	// Load the default key and key map
-	check_personal_key_path(key_file, ".batv-key");
-	check_personal_key_path(key_map_file, ".batv-keys");
-
-	if (key_file.empty() && key_map_file.empty()) {
-		std::clog << argv[0] << ": Neither ~/.batv-key nor ~/.batv-keys exist." << std::endl;
-		std::clog << "Please create one and/or the other or specify alternative paths using -k or -K" << std::endl;
-		return 1;
-	}
-
-	if (!key_file.empty()) {
-		std::ifstream	key_in(key_file.c_str());
-		load_key(config.default_key, key_in);
-	}
-	if (!key_map_file.empty()) {
-		std::ifstream	key_map_in(key_map_file.c_str());
-		load_key_map(config.keys, key_map_in);
+	// If no key paths were given and a batv-daemon is running, have it do the
+	// validation (saving us from having to load the keys).  The daemon isn't
+	// used in -D mode, which validates many messages in parallel.
+	Daemon_client	daemon;
+	if (!is_bulk && config.key_file.empty() && config.key_map_file.empty() && daemon.connect(daemon_socket_path())) {
+		config.daemon = &daemon;
+	} else {
+		config.load_keys();
 	}
 
 	// Do the validation/filtering
-	if (is_filter) {
-		filter(config, std::cin, std::cout);
+	if (is_bulk) {
+		bulk_validate(config, argv + optind, argc - optind, num_threads);
+
+	} else if (is_filter) {
+		Mail_reader	in(0);
+		if (is_mbox) {
+			filter_mbox(config, in, std::cout);
+		} else {
+			filter(config, in, std::cout);
+		}
+
+	} else if (is_mbox) {
+		Mail_reader	in(0);
+		validate_mbox(config, in, std::cout);
 
 	} else {
 		std::vector<Email_address>	rcpt_tos;
 		if (is_mail_input) {
 			// Get the possible envelope recipients from the message on stdin
-			rcpt_tos = parse_mail(config, std::cin);
+			Mail_reader	in(0);
+			rcpt_tos = parse_mail(config, in);
 			if (rcpt_tos.empty()) {
 				// no envelope recipient header found
 				std::clog << argv[0] << ": No envelope recipient header (" << config.rcpt_header << ") found in message (use -h to specify a different header)" << std::endl;
-				return 13;
+				return STATUS_NO_RCPT;
 			}
 		} else {
 			// Get the one and only envelope recipient from the command line argument
@@ -335,36 +597,18 @@ try {
 		int			status = 1;
 		for (size_t i = 0; i < rcpt_tos.size(); ++i) {
 			Batv_address		batv_rcpt;
-			if (!batv_rcpt.parse(rcpt_tos[i], config.sub_address_delimiter) || batv_rcpt.tag_type != "prvs") {
-				// Not a BATV address
+			status = validate_rcpt(config, rcpt_tos[i], batv_rcpt);
+			if (status == STATUS_NOT_BATV) {
 				errors << argv[0] << ": " << rcpt_tos[i].make_string() << ": Not a BATV address" << std::endl;
-				status = 11;
-				continue;
-			}
-
-			// Get the key for this sender:
-			const Key*	batv_rcpt_key = config.get_key(batv_rcpt.orig_mailfrom.make_string());
-			if (batv_rcpt_key == NULL) {
-				// No key for this sender
+			} else if (status == STATUS_NO_KEY) {
 				errors << argv[0] << ": " << batv_rcpt.orig_mailfrom.make_string() << ": No key available for this sender" << std::endl;
-				status = 12;
-				continue;
-			}
-
-			// Validate the address
-			if (!prvs_validate(batv_rcpt, config.address_lifetime, *batv_rcpt_key)) {
-				// Invalid signature
+			} else if (status == STATUS_INVALID) {
 				errors << argv[0] << ": " << rcpt_tos[i].make_string() << ": Invalid signature" << std::endl;
-				status = 10;
-				continue;
+			} else {
+				// Valid signature -> output original envelope recipient
+				std::cout << batv_rcpt.orig_mailfrom.make_string() << std::endl;
+				break;
 			}
-
-			// Valid signature
-
-			// Output original envelope recipient
-			std::cout << batv_rcpt.orig_mailfrom.make_string() << std::endl;
-			status = 0;
-			break;
 		}
 
 		if (status != 0) {
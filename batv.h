@@ -0,0 +1,113 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+/*
+ * libbatv: sign and validate BATV addresses from C or C++ programs.
+ *
+ * Link with -lbatv.  All functions which take a const batv_keyring* may be
+ * called concurrently from multiple threads.  A keyring must not be modified
+ * (by the batv_keyring_load_* functions) while other threads are using it.
+ *
+ * Addresses are passed without angle brackets.  Results are written to the
+ * caller's buffer as NUL-terminated strings.
+ */
+
+#ifndef BATV_H
+#define BATV_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Return values.  Apart from BATV_ERROR and BATV_BUFFER_TOO_SMALL, these
+ * match the exit statuses of batv-validate. */
+#define BATV_OK			0	/* success */
+#define BATV_ERROR		1	/* error (see batv_keyring_error) */
+#define BATV_BUFFER_TOO_SMALL	3	/* result doesn't fit in the buffer */
+#define BATV_INVALID		10	/* invalid signature */
+#define BATV_NOT_BATV		11	/* not a BATV address */
+#define BATV_NO_KEY		12	/* no key available for the sender */
+#define BATV_NO_DOMAIN		14	/* address is missing domain name */
+
+/* Enough room for any address (RFC 5321 limits paths to 256 octets) plus BATV tag */
+#define BATV_ADDRESS_MAX	320
+
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define BATV_EXPORT __attribute__((visibility("default")))
+#else
+#define BATV_EXPORT
+#endif
+
+typedef struct batv_keyring batv_keyring;
+
+/* Create an empty keyring.  Returns NULL if out of memory. */
+BATV_EXPORT batv_keyring*	batv_keyring_new (void);
+BATV_EXPORT void		batv_keyring_free (batv_keyring*);
+
+/* Load the default key (used for senders not in the key map) from a key file,
+ * or entries from a key map file (same format as for batv-milter).
+ * Return BATV_OK or BATV_ERROR. */
+BATV_EXPORT int		batv_keyring_load_key (batv_keyring*, const char* key_file);
+BATV_EXPORT int		batv_keyring_load_key_map (batv_keyring*, const char* key_map_file);
+
+/* Description of the last error from batv_keyring_load_*, or "" */
+BATV_EXPORT const char*	batv_keyring_error (const batv_keyring*);
+
+/* Sign the sender address, which is valid for LIFETIME (1-999) days.
+ * A sub_address_delimiter of 0 uses the standard prvs=TAG=user@domain syntax;
+ * otherwise user+prvs=TAG@domain (with the given delimiter) is used.
+ * Returns BATV_OK, BATV_NO_KEY, BATV_NO_DOMAIN, BATV_BUFFER_TOO_SMALL, or BATV_ERROR. */
+BATV_EXPORT int		batv_sign (const batv_keyring*, const char* address, unsigned int lifetime, char sub_address_delimiter,
+				char* out, size_t out_size);
+
+/* Validate the recipient address, writing the original address to OUT if it's
+ * a BATV address.  Returns BATV_OK, BATV_INVALID, BATV_NOT_BATV, BATV_NO_KEY,
+ * BATV_BUFFER_TOO_SMALL, or BATV_ERROR.  OUT is left empty for BATV_NOT_BATV. */
+BATV_EXPORT int		batv_validate (const batv_keyring*, const char* address, unsigned int lifetime, char sub_address_delimiter,
+				char* out, size_t out_size);
+
+/* Batch variants: process COUNT addresses, writing the result for addresses[i]
+ * to outs[i] (each OUT_SIZE bytes long) and its return value to statuses[i].
+ * The output buffers must not overlap the addresses.
+ * Return the number of addresses whose status is not BATV_OK. */
+BATV_EXPORT size_t		batv_sign_batch (const batv_keyring*, size_t count, const char* const* addresses,
+				unsigned int lifetime, char sub_address_delimiter,
+				char* const* outs, size_t out_size, int* statuses);
+BATV_EXPORT size_t		batv_validate_batch (const batv_keyring*, size_t count, const char* const* addresses,
+				unsigned int lifetime, char sub_address_delimiter,
+				char* const* outs, size_t out_size, int* statuses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+// Microbenchmarks for the hot paths of signing and validation.
+//
+//	make bench			(runs every benchmark)
+//	bench/bench [-f FILTER] [-t MIN_SECONDS] [-r REPEATS]
+//	bench/bench -g key-map N KEY_FILE	(print a synthetic key map)
+//	bench/bench -g cidrs N			(print synthetic internal-host directives)
+//
+// Results are written to stdout as tab-separated values, one line per
+// benchmark and parameter, so two builds can be compared with bench/compare.sh.
+// Each benchmark generates its inputs from its own fixed seed and the prvs
+// clock is fixed, so inputs don't depend on the date, the filter, or the run.
+
+#include "../prvs.hpp"
+#include "../address.hpp"
+#include "../key.hpp"
+#include "../common.hpp"
+#include "../config.hpp"
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <time.h>
+
+using namespace batv;
+
+namespace {
+	// 2013-05-28 00:00:00 UTC
+	std::time_t fixed_clock ()
+	{
+		return 1369699200;
+	}
+
+	// Deterministic random numbers (so runs with the same seed get the same inputs)
+	class Random {
+		unsigned long long	state;
+	public:
+		explicit Random (unsigned long long seed) : state(seed) { }
+		unsigned int	next ()
+		{
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			return state >> 33;
+		}
+		unsigned int	next (unsigned int limit) { return next() % limit; }
+	};
+
+	std::string	filter;
+	double		min_time = 0.2;
+	unsigned int	repeats = 5;
+	volatile unsigned long sink;	// keeps results from being optimized away
+
+	// Run op(i) for i = 0, 1, 2, ... enough times to take min_time, repeats times,
+	// and print the minimum and median time per operation.
+	template<class Op> void run (const char* name, unsigned long param, Op& op)
+	{
+		if (!filter.empty() && std::string(name).find(filter) == std::string::npos) {
+			return;
+		}
+
+		// Calibrate the number of iterations
+		unsigned long		iterations = 1;
+		for (;;) {
+			double		start = now();
+			for (unsigned long i = 0; i < iterations; ++i) {
+				op(i);
+			}
+			double		elapsed = now() - start;
+			if (elapsed >= min_time / 4 || iterations >= 1UL << 30) {
+				iterations = std::max(1UL, static_cast<unsigned long>(iterations * (min_time / std::max(elapsed, 1e-9))));
+				break;
+			}
+			iterations *= 4;
+		}
+
+		std::vector<double>	ns_per_op;
+		for (unsigned int r = 0; r < repeats; ++r) {
+			double		start = now();
+			for (unsigned long i = 0; i < iterations; ++i) {
+				op(i);
+			}
+			ns_per_op.push_back((now() - start) * 1e9 / iterations);
+		}
+		std::sort(ns_per_op.begin(), ns_per_op.end());
+
+		std::cout << name << '\t' << param << '\t' << ns_per_op[0] << '\t' << ns_per_op[ns_per_op.size() / 2] << '\t' << iterations << std::endl;
+	}
+
+	// Synthetic inputs
+
+	std::string random_local_part (Random& random)
+	{
+		static const char*	words[] = { "bounces", "info", "noreply", "andrew", "support", "list", "billing", "root" };
+		std::ostringstream	out;
+		out << words[random.next(8)];
+		if (random.next(2)) {
+			out << '.' << random.next(100000);
+		}
+		return out.str();
+	}
+
+	std::string domain_name (unsigned int n)
+	{
+		std::ostringstream	out;
+		out << "mail" << n << ".example" << n % 97 << ".com";
+		return out.str();
+	}
+
+	// A key map with num_entries entries: 3/4 domains ("@domain") and 1/4 addresses
+	void generate_key_map (std::vector<std::string>& entries, unsigned int num_entries, Random& random)
+	{
+		for (unsigned int i = 0; i < num_entries; ++i) {
+			if (i % 4 == 3) {
+				entries.push_back(random_local_part(random) + "@" + domain_name(i));
+			} else {
+				entries.push_back("@" + domain_name(i));
+			}
+		}
+	}
+
+	// num_cidrs internal-host values: 3/4 IPv4 with prefixes /8-/32, 1/4 IPv6 /32-/128
+	void generate_cidrs (std::vector<std::string>& cidrs, unsigned int num_cidrs, Random& random)
+	{
+		for (unsigned int i = 0; i < num_cidrs; ++i) {
+			std::ostringstream	out;
+			if (i % 4 == 3) {
+				out << std::hex << "2001:db8:" << random.next(0x10000) << ':' << random.next(0x10000) << "::" << random.next(0x10000)
+					<< std::dec << '/' << 32 + random.next(97);
+			} else {
+				out << 1 + random.next(223) << '.' << random.next(256) << '.' << random.next(256) << '.' << random.next(256)
+					<< '/' << 8 + random.next(25);
+			}
+			cidrs.push_back(out.str());
+		}
+	}
+
+	Key random_key (Random& random, size_t len)
+	{
+		Key			key(len);
+		for (size_t i = 0; i < len; ++i) {
+			key[i] = random.next(256);
+		}
+		return key;
+	}
+
+	// Benchmarks
+
+	struct Prvs_generate {
+		std::vector<Email_address>	addresses;
+		Key				key;
+		void operator() (unsigned long i)
+		{
+			sink += prvs_generate(addresses[i % addresses.size()], 7, key).tag_val[9];
+		}
+	};
+
+	struct Prvs_validate {
+		std::vector<Batv_address>	addresses;
+		Key				key;
+		void operator() (unsigned long i)
+		{
+			sink += prvs_validate(addresses[i % addresses.size()], 7, key);
+		}
+	};
+
+	struct Batv_parse {
+		std::vector<Email_address>	addresses;
+		char				sub_address_delimiter;
+		void operator() (unsigned long i)
+		{
+			Batv_address		batv_address;
+			sink += batv_address.parse(addresses[i % addresses.size()], sub_address_delimiter);
+		}
+	};
+
+	struct Batv_make_string {
+		std::vector<Batv_address>	addresses;
+		char				sub_address_delimiter;
+		void operator() (unsigned long i)
+		{
+			sink += addresses[i % addresses.size()].make_string(sub_address_delimiter).size();
+		}
+	};
+
+	struct Canon_address {
+		std::vector<std::string>	addresses;
+		void operator() (unsigned long i)
+		{
+			sink += canon_address(addresses[i % addresses.size()].c_str()).size();
+		}
+	};
+
+	struct Get_key {
+		Key_map				key_map;
+		std::vector<std::string>	senders;	// half in the map (by address or domain), half not
+		void operator() (unsigned long i)
+		{
+			sink += get_key(key_map, senders[i % senders.size()]).get() != NULL;
+		}
+	};
+
+	struct May_have_key {
+		Key_map				key_map;
+		std::vector<std::string>	domains;	// none in the map
+		void operator() (unsigned long i)
+		{
+			sink += key_map.may_have_key(domains[i % domains.size()]);
+		}
+	};
+
+	struct Is_internal_host {
+		Config				config;
+		std::vector<struct in6_addr>	addresses;
+		void operator() (unsigned long i)
+		{
+			sink += config.is_internal_host(addresses[i % addresses.size()]);
+		}
+	};
+
+	const size_t		num_inputs = 1024;
+
+	void bench_prvs ()
+	{
+		Random			random(1);
+		Prvs_generate		generate;
+		Prvs_validate		validate;
+		generate.key = validate.key = random_key(random, 64);
+		for (size_t i = 0; i < num_inputs; ++i) {
+			Email_address	address;
+			address.local_part = random_local_part(random);
+			address.domain = domain_name(i);
+			generate.addresses.push_back(address);
+			validate.addresses.push_back(prvs_generate(address, 7, validate.key));
+		}
+		run("prvs_generate", 0, generate);
+		run("prvs_validate", 0, validate);
+	}
+
+	void bench_address ()
+	{
+		Random			random(2);
+		Batv_parse		parse;
+		Batv_make_string	make_string;
+		Canon_address		canon;
+		Key			key(random_key(random, 64));
+		parse.sub_address_delimiter = make_string.sub_address_delimiter = '+';
+		for (size_t i = 0; i < num_inputs; ++i) {
+			Email_address	address;
+			address.local_part = random_local_part(random);
+			address.domain = domain_name(i);
+			Batv_address	batv_address(prvs_generate(address, 7, key));
+			make_string.addresses.push_back(batv_address);
+			std::string	str(batv_address.make_string('+'));
+			canon.addresses.push_back(i % 2 ? "<" + str + ">" : str);
+			parse.addresses.push_back(Email_address());
+			parse.addresses.back().parse(str.c_str());
+		}
+		run("batv_address_parse", 0, parse);
+		run("batv_address_make_string", 0, make_string);
+		run("canon_address", 0, canon);
+	}
+
+	void bench_get_key ()
+	{
+		Random			random(3);
+		for (unsigned int num_entries = 10; num_entries <= 1000000; num_entries *= 10) {
+			if (!filter.empty() && std::string("get_key").find(filter) == std::string::npos) {
+				return;
+			}
+			Get_key				get;
+			std::vector<std::string>	entries;
+			generate_key_map(entries, num_entries, random);
+			Key				key(random_key(random, 16));
+			for (size_t i = 0; i < entries.size(); ++i) {
+				get.key_map[entries[i]].generations[0] = Shared_key(key);
+			}
+			for (size_t i = 0; i < num_inputs; ++i) {
+				const std::string&	entry = entries[random.next(entries.size())];
+				if (i % 2) {
+					get.senders.push_back("nobody@" + domain_name(num_entries + i));
+				} else if (entry[0] == '@') {
+					get.senders.push_back(random_local_part(random) + entry);
+				} else {
+					get.senders.push_back(entry);
+				}
+			}
+			run("get_key", num_entries, get);
+		}
+	}
+
+	// get_key with a catch-all HKDF entry, so keys are derived (or found in the
+	// derived key cache) per domain
+	void bench_get_key_derived ()
+	{
+		Random			random(5);
+		for (unsigned int num_domains = 10; num_domains <= 1000000; num_domains *= 10) {
+			if (!filter.empty() && std::string("get_key_derived").find(filter) == std::string::npos) {
+				return;
+			}
+			Get_key				get;
+			Key_entry&			entry = get.key_map["*"];
+			entry.generations[0] = Shared_key(random_key(random, 20));
+			entry.derivation = Key_entry::DERIVE_DOMAIN;
+			entry.serial = num_domains;
+			for (size_t i = 0; i < num_inputs; ++i) {
+				get.senders.push_back(random_local_part(random) + "@" + domain_name(random.next(num_domains)));
+			}
+			run("get_key_derived", num_domains, get);
+		}
+	}
+
+	// get_key with pattern entries, which are matched by one DFA however many there are
+	void bench_get_key_patterns ()
+	{
+		Random			random(6);
+		for (unsigned int num_patterns = 10; num_patterns <= 1000; num_patterns *= 10) {
+			if (!filter.empty() && std::string("get_key_patterns").find(filter) == std::string::npos) {
+				return;
+			}
+			Get_key				get;
+			Key				key(random_key(random, 16));
+			for (unsigned int i = 0; i < num_patterns; ++i) {
+				std::ostringstream	pattern;
+				pattern << "bounces-" << i << "-*@" << domain_name(i);
+				get.key_map[pattern.str()].generations[0] = Shared_key(key);
+			}
+			get.key_map.compile();
+			for (size_t i = 0; i < num_inputs; ++i) {
+				std::ostringstream	sender;
+				unsigned int		n = random.next(num_patterns);
+				sender << (i % 2 ? "bounces-" : "nobody-") << n << "-" << random_local_part(random) << "@" << domain_name(n);
+				get.senders.push_back(sender.str());
+			}
+			run("get_key_patterns", num_patterns, get);
+		}
+	}
+
+	// Senders in domains without keys, ruled out by the domain filter (may_have_key)
+	// or by a full lookup (get_key_miss)
+	void bench_key_filter ()
+	{
+		Random			random(7);
+		for (unsigned int num_entries = 10; num_entries <= 1000000; num_entries *= 10) {
+			if (!filter.empty() && std::string("may_have_key get_key_miss").find(filter) == std::string::npos) {
+				return;
+			}
+			May_have_key			may_have;
+			Get_key				get;
+			std::vector<std::string>	entries;
+			generate_key_map(entries, num_entries, random);
+			Key				key(random_key(random, 16));
+			for (size_t i = 0; i < entries.size(); ++i) {
+				may_have.key_map[entries[i]].generations[0] = Shared_key(key);
+				get.key_map[entries[i]].generations[0] = Shared_key(key);
+			}
+			may_have.key_map.compile();
+			get.key_map.compile();
+			for (size_t i = 0; i < num_inputs; ++i) {
+				std::string		domain(domain_name(num_entries + i));
+				may_have.domains.push_back(domain);
+				get.senders.push_back("nobody@" + domain);
+			}
+			run("may_have_key", num_entries, may_have);
+			run("get_key_miss", num_entries, get);
+		}
+	}
+
+	void bench_is_internal_host ()
+	{
+		Random			random(4);
+		for (unsigned int num_cidrs = 10; num_cidrs <= 100000; num_cidrs *= 10) {
+			if (!filter.empty() && std::string("is_internal_host").find(filter) == std::string::npos) {
+				return;
+			}
+			Is_internal_host		is_internal;
+			std::vector<std::string>	cidrs;
+			generate_cidrs(cidrs, num_cidrs, random);
+			for (size_t i = 0; i < cidrs.size(); ++i) {
+				is_internal.config.set("internal-host", cidrs[i]);
+			}
+			// Mostly external addresses, as for incoming mail
+			for (size_t i = 0; i < num_inputs; ++i) {
+				struct in6_addr		address;
+				std::memset(&address, 0, sizeof(address));
+				address.s6_addr[10] = address.s6_addr[11] = 0xFF;
+				for (int j = 12; j < 16; ++j) {
+					address.s6_addr[j] = random.next(256);
+				}
+				is_internal.addresses.push_back(address);
+			}
+			run("is_internal_host", num_cidrs, is_internal);
+		}
+	}
+
+	int generate (int argc, char** argv)
+	{
+		Random				random(1);
+		std::vector<std::string>	lines;
+		if (argc == 3 && std::strcmp(argv[0], "key-map") == 0) {
+			generate_key_map(lines, std::atoi(argv[1]), random);
+			for (size_t i = 0; i < lines.size(); ++i) {
+				std::cout << lines[i] << '\t' << argv[2] << '\n';
+			}
+		} else if (argc == 2 && std::strcmp(argv[0], "cidrs") == 0) {
+			generate_cidrs(lines, std::atoi(argv[1]), random);
+			for (size_t i = 0; i < lines.size(); ++i) {
+				std::cout << "internal-host " << lines[i] << '\n';
+			}
+		} else {
+			return 2;
+		}
+		return 0;
+	}
+
+	void print_usage (const char* argv0)
+	{
+		std::clog << "Usage: " << argv0 << " [-f FILTER] [-t MIN_SECONDS] [-r REPEATS]" << std::endl;
+		std::clog << "       " << argv0 << " -g key-map N KEY_FILE" << std::endl;
+		std::clog << "       " << argv0 << " -g cidrs N" << std::endl;
+	}
+}
+
+int main (int argc, char** argv)
+{
+	bool		is_generate = false;
+	int		flag;
+	while ((flag = getopt(argc, argv, "f:t:r:g")) != -1) {
+		switch (flag) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 't':
+			min_time = std::atof(optarg);
+			break;
+		case 'r':
+			repeats = std::max(1, std::atoi(optarg));
+			break;
+		case 'g':
+			is_generate = true;
+			break;
+		default:
+			print_usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (is_generate) {
+		if (generate(argc - optind, argv + optind) != 0) {
+			print_usage(argv[0]);
+			return 2;
+		}
+		return 0;
+	}
+
+	set_prvs_clock(fixed_clock);
+
+	std::cout << "benchmark\tparam\tns_per_op_min\tns_per_op_median\titerations" << std::endl;
+	bench_prvs();
+	bench_address();
+	bench_get_key();
+	bench_get_key_derived();
+	bench_get_key_patterns();
+	bench_key_filter();
+	bench_is_internal_host();
+	return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+
+# Compare two sets of results from bench/bench:
+#
+#	bench/compare.sh OLD.tsv NEW.tsv [THRESHOLD_PERCENT]
+#
+# Prints the change in median time per operation for every benchmark in
+# both files, marking changes worse than THRESHOLD_PERCENT (default: 10)
+# as regressions.  Exits with status 1 if there are any regressions.
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+	echo "Usage: $0 OLD.tsv NEW.tsv [THRESHOLD_PERCENT]" >&2
+	exit 2
+fi
+
+awk -F '\t' -v threshold="${3:-10}" '
+	FNR == 1 { next }
+	NR == FNR { old[$1 "\t" $2] = $4; next }
+	($1 "\t" $2) in old {
+		change = ($4 - old[$1 "\t" $2]) * 100 / old[$1 "\t" $2]
+		flag = ""
+		if (change > threshold) {
+			flag = "\tREGRESSION"
+			regressions++
+		}
+		printf "%s\t%s\t%.1f\t%.1f\t%+.1f%%%s\n", $1, $2, old[$1 "\t" $2], $4, change, flag
+	}
+	END { exit regressions > 0 }
+' "$1" "$2"
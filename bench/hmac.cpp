@@ -0,0 +1,122 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+// Compare the in-house HMAC-SHA1 with OpenSSL's, for correctness and speed.
+// Every SHA-1 implementation supported by this CPU is checked against OpenSSL
+// over a range of key and message lengths before anything is timed.
+//
+//	make bench/hmac && bench/hmac [ITERATIONS]
+
+#include "../sha1.hpp"
+#include "../common.hpp"
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <time.h>
+
+using namespace batv;
+
+namespace {
+	const char*		implementation_names[] = { "sha-ni", "ssse3", "scalar" };
+
+	bool check (const char* implementation)
+	{
+		unsigned char		key[200];
+		unsigned char		data[300];
+		for (size_t i = 0; i < sizeof(key); ++i) {
+			key[i] = std::rand();
+		}
+		for (size_t i = 0; i < sizeof(data); ++i) {
+			data[i] = std::rand();
+		}
+
+		for (size_t key_len = 0; key_len <= sizeof(key); ++key_len) {
+			for (size_t data_len = 0; data_len <= sizeof(data); data_len += key_len % 7 + 1) {
+				unsigned char	expected[20];
+				unsigned char	actual[20];
+				HMAC(EVP_sha1(), key, key_len, data, data_len, expected, NULL);
+				hmac_sha1(actual, key, key_len, data, data_len);
+				if (std::memcmp(expected, actual, 20) != 0) {
+					std::cout << implementation << ": MISMATCH at key length " << key_len << ", data length " << data_len << std::endl;
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+}
+
+int main (int argc, char** argv)
+{
+	const unsigned long	iterations = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 2000000;
+	const char*		default_implementation = sha1_implementation();
+
+	// A typical prvs hash source: K DDD <orig-mailfrom>, under a 64 byte key
+	unsigned char		key[64];
+	const char*		message = "0123bounces-12345@lists.example.com";
+	const size_t		message_len = std::strlen(message);
+	std::memset(key, 0x42, sizeof(key));
+	unsigned char		out[20];
+	unsigned int		sink = 0;
+
+	bool			ok = true;
+	for (size_t i = 0; i < sizeof(implementation_names) / sizeof(implementation_names[0]); ++i) {
+		if (!set_sha1_implementation(implementation_names[i])) {
+			std::cout << implementation_names[i] << "\tnot supported" << std::endl;
+			continue;
+		}
+		if (!check(implementation_names[i])) {
+			ok = false;
+			continue;
+		}
+
+		double		start = now();
+		for (unsigned long n = 0; n < iterations; ++n) {
+			hmac_sha1(out, key, sizeof(key), reinterpret_cast<const unsigned char*>(message), message_len);
+			sink += out[0];
+		}
+		double		elapsed = now() - start;
+		std::cout << implementation_names[i] << "\t" << elapsed * 1e9 / iterations << " ns/hmac"
+			<< (std::strcmp(implementation_names[i], default_implementation) == 0 ? "\t(default)" : "") << std::endl;
+	}
+
+	double			start = now();
+	for (unsigned long n = 0; n < iterations; ++n) {
+		HMAC(EVP_sha1(), key, sizeof(key), reinterpret_cast<const unsigned char*>(message), message_len, out, NULL);
+		sink += out[0];
+	}
+	double			elapsed = now() - start;
+	std::cout << "openssl\t" << elapsed * 1e9 / iterations << " ns/hmac" << std::endl;
+
+	return ok && sink != 1 ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Compare the start-up cost of the compiled batv-sendmail with the shell
+# script it replaced, which is extracted from git history.  Run from a git
+# checkout of the source tree after building the tools:
+#
+#	bench/sendmail-startup.sh [ITERATIONS]
+#
+# A throwaway key and a stub sendmail (which exits immediately) are used, so
+# the timings cover only argument parsing, key loading, signing, and exec.
+
+iterations=${1:-200}
+top=$(cd "$(dirname "$0")/.." && pwd)
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/bin" "$tmp/home"
+ln -s "$(type -P true)" "$tmp/bin/sendmail"
+head -c 64 /dev/urandom > "$tmp/home/.batv-key"
+
+# The script was deleted by the commit after it was last seen
+old=$(git -C "$top" rev-list -n 1 HEAD -- batv-sendmail.sh) &&
+	git -C "$top" show "$old^:batv-sendmail.sh" > "$tmp/batv-sendmail.sh" || exit 1
+
+export HOME=$tmp/home
+export BATV_SOCKET=$tmp/no-daemon
+export PATH=$tmp/bin:$top:$PATH
+
+run () {
+	local start end i
+	start=$(date +%s%N)
+	for ((i = 0; i < iterations; i++))
+	do
+		"$@" -f user@example.com -i -t || exit 1
+	done
+	end=$(date +%s%N)
+	echo $(( (end - start) / iterations / 1000 ))
+}
+
+printf 'batv-sendmail.sh\t%s us/message\n' "$(run bash "$tmp/batv-sendmail.sh")"
+printf 'batv-sendmail\t%s us/message\n' "$(run "$top/batv-sendmail")"
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Measure the throughput of batv-sign -b.  Run from the top of the source
+# tree after building the tools:
+#
+#	bench/sign-bulk.sh [NUM_ADDRESSES] [THREADS]
+#
+# Prints the throughput in addresses per second.
+
+num_addresses=${1:-1000000}
+threads=${2:-$(getconf _NPROCESSORS_ONLN)}
+top=$(cd "$(dirname "$0")/.." && pwd)
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+head -c 64 /dev/urandom > "$tmp/key"
+awk -v n="$num_addresses" 'BEGIN { for (i = 0; i < n; i++) printf "bounces-%d@lists.example.com\n", i }' > "$tmp/addresses"
+
+start=$(date +%s%N)
+"$top/batv-sign" -b -j "$threads" -k "$tmp/key" -K /dev/null < "$tmp/addresses" | cat > /dev/null || exit 1
+end=$(date +%s%N)
+
+printf 'batv-sign -b\t%d threads\t%d addresses/s\n' "$threads" $(( num_addresses * 1000000000 / (end - start) ))
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+// Measure prvs_generate/prvs_validate throughput with 1, 8, 32, and 128 threads
+// signing and validating concurrently, as the milter's connection threads do.
+// Throughput should scale with the number of cores, up to the core count,
+// and stay flat beyond it.
+//
+//	make bench/threads && bench/threads [OPERATIONS_PER_THREAD]
+
+#include "../prvs.hpp"
+#include "../address.hpp"
+#include "../key.hpp"
+#include "../common.hpp"
+#include <pthread.h>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <time.h>
+
+using namespace batv;
+
+namespace {
+	const unsigned int	thread_counts[] = { 1, 8, 32, 128 };
+	const size_t		num_keys = 16;
+
+	struct Worker {
+		pthread_t		thread;
+		const Key*		keys;
+		unsigned long		num_operations;
+		unsigned long		num_failed;
+	};
+
+	void* work (void* arg)
+	{
+		Worker&			worker = *static_cast<Worker*>(arg);
+		for (unsigned long i = 0; i < worker.num_operations; ++i) {
+			std::ostringstream	address;
+			address << "user" << i % 1000 << "@domain" << i % num_keys << ".example";
+			Email_address		from;
+			from.parse(address.str().c_str());
+			const Key&		key = worker.keys[i % num_keys];
+			if (!prvs_validate(prvs_generate(from, 7, key), 7, key)) {
+				++worker.num_failed;
+			}
+		}
+		return NULL;
+	}
+}
+
+int main (int argc, char** argv)
+{
+	const unsigned long	operations_per_thread = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 20000;
+
+	Key			keys[num_keys];
+	for (size_t i = 0; i < num_keys; ++i) {
+		for (size_t j = 0; j < 64; ++j) {
+			keys[i].push_back(std::rand());
+		}
+	}
+
+	for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t) {
+		const unsigned int	num_threads = thread_counts[t];
+		Worker*			workers = new Worker[num_threads];
+
+		double			start = now();
+		for (unsigned int i = 0; i < num_threads; ++i) {
+			workers[i].keys = keys;
+			workers[i].num_operations = operations_per_thread;
+			workers[i].num_failed = 0;
+			pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+		}
+		unsigned long		num_failed = 0;
+		for (unsigned int i = 0; i < num_threads; ++i) {
+			pthread_join(workers[i].thread, NULL);
+			num_failed += workers[i].num_failed;
+		}
+		double			elapsed = now() - start;
+		delete[] workers;
+
+		if (num_failed) {
+			std::cerr << argv[0] << ": " << num_failed << " addresses failed to validate" << std::endl;
+			return 1;
+		}
+		std::cout << num_threads << " threads\t"
+			<< static_cast<unsigned long>(num_threads * operations_per_thread / elapsed) << " sign+validate/s" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "bloom.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <cmath>
+
+void	batv::Bloom_filter::reset (size_t expected_items, double false_positive_rate)
+{
+	// m = -n ln(p) / ln(2)^2 bits and k = (m / n) ln(2) hashes minimize the false positive rate.
+	// Bits are found by scaling 32-bit hashes, so there can be at most 2^32 of them.
+	const double		ln2 = std::log(2.0);
+	const double		n = std::max<size_t>(expected_items, 1);
+	const double		num_bits = std::min(4294967296.0, std::max(64.0, std::ceil(-n * std::log(false_positive_rate) / (ln2 * ln2))));
+	bits.assign(static_cast<size_t>((num_bits + 63) / 64), 0);
+	num_hashes = std::min(16, std::max(1, static_cast<int>(bits.size() * 64 / n * ln2 + 0.5)));
+	num_items = 0;
+}
+
+void	batv::Bloom_filter::clear ()
+{
+	std::vector<uint64_t>().swap(bits);
+	num_hashes = 0;
+	num_items = 0;
+}
+
+void	batv::Bloom_filter::add (const char* str, size_t len)
+{
+	if (bits.empty()) {
+		return;
+	}
+	// Derive the hashes from two halves of one hash (Kirsch and Mitzenmacher)
+	const uint64_t		h = hash_string(str, len);
+	const uint64_t		num_bits = bits.size() * 64;
+	uint32_t		h1 = h;
+	uint32_t		h2 = (h >> 32) | 1;
+	for (unsigned int i = 0; i < num_hashes; ++i, h1 += h2) {
+		uint64_t	bit = (h1 * num_bits) >> 32;	// h1 scaled to [0, num_bits), avoiding a division
+		bits[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+	++num_items;
+}
+
+bool	batv::Bloom_filter::may_contain (const char* str, size_t len) const
+{
+	return bits.empty() || may_contain_hash(hash_string(str, len));
+}
+
+bool	batv::Bloom_filter::may_contain_suffix (const char* str, size_t len, char delimiter) const
+{
+	if (bits.empty() || len == 0) {
+		return may_contain(str, len);
+	}
+	uint64_t		h = hash_start;
+	for (size_t i = len; i > 0; --i) {
+		h = hash_byte(h, str[i - 1]);
+		if ((i == 1 || str[i - 2] == delimiter) && may_contain_hash(finish_hash(h))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool	batv::Bloom_filter::may_contain_hash (uint64_t h) const
+{
+	const uint64_t		num_bits = bits.size() * 64;
+	uint32_t		h1 = h;
+	uint32_t		h2 = (h >> 32) | 1;
+	for (unsigned int i = 0; i < num_hashes; ++i, h1 += h2) {
+		uint64_t	bit = (h1 * num_bits) >> 32;	// h1 scaled to [0, num_bits), avoiding a division
+		if (!(bits[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+double	batv::Bloom_filter::false_positive_rate () const
+{
+	if (bits.empty()) {
+		return 1.0;
+	}
+	return std::pow(1.0 - std::exp(-static_cast<double>(num_hashes) * num_items / (bits.size() * 64.0)), num_hashes);
+}
+
+void	batv::Bloom_filter::swap (Bloom_filter& other)
+{
+	bits.swap(other.bits);
+	std::swap(num_hashes, other.num_hashes);
+	std::swap(num_items, other.num_items);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace batv {
+	// A Bloom filter of strings, for quickly ruling out strings which were never added.
+	// Hashing is case-insensitive.  An unsized filter may contain anything.
+	class Bloom_filter {
+		std::vector<uint64_t>	bits;
+		unsigned int		num_hashes;
+		size_t			num_items;
+
+		bool		may_contain_hash (uint64_t) const;
+	public:
+		Bloom_filter () : num_hashes(0), num_items(0) { }
+
+		// Empty the filter, sizing it for the given number of strings and false positive rate
+		void		reset (size_t expected_items, double false_positive_rate);
+		// Empty the filter and leave it unsized
+		void		clear ();
+
+		void		add (const char* str, size_t len);
+		bool		may_contain (const char* str, size_t len) const;
+		// Might the filter contain str, or any suffix of str which follows a delimiter?
+		// Takes one pass over str, so is cheaper than checking each suffix.
+		bool		may_contain_suffix (const char* str, size_t len, char delimiter) const;
+
+		bool		is_sized () const { return !bits.empty(); }
+		size_t		size () const { return num_items; }
+		size_t		size_bytes () const { return bits.size() * sizeof(uint64_t); }
+		double		false_positive_rate () const;	// expected, given the strings added
+		void		swap (Bloom_filter&);
+	};
+}
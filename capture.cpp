@@ -0,0 +1,190 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "capture.hpp"
+#include "common.hpp"
+#include <istream>
+#include <cstring>
+
+using namespace batv;
+
+const char	batv::capture_file_magic[8] = { 'B', 'A', 'T', 'V', 'C', 'A', 'P', '1' };
+
+namespace {
+	const uint32_t		max_record_len = 16 * 1024 * 1024;
+
+	void append_int (std::string& out, uint64_t n, int num_bytes)
+	{
+		while (num_bytes-- > 0) {
+			out.push_back(n >> (num_bytes * 8));
+		}
+	}
+
+	void append_string (std::string& out, const std::string& str)
+	{
+		size_t		len = str.size() < 0xFFFF ? str.size() : 0xFFFF;
+		append_int(out, len, 2);
+		out.append(str, 0, len);
+	}
+
+	class Decoder {
+		const std::string&	data;
+		size_t			pos;
+		bool			ok;
+	public:
+		explicit Decoder (const std::string& d) : data(d), pos(0), ok(true) { }
+
+		bool		is_ok () const { return ok && pos == data.size(); }
+
+		uint64_t	get_int (int num_bytes)
+		{
+			uint64_t	n = 0;
+			if (data.size() - pos < static_cast<size_t>(num_bytes)) {
+				ok = false;
+				return 0;
+			}
+			while (num_bytes-- > 0) {
+				n = (n << 8) | static_cast<unsigned char>(data[pos++]);
+			}
+			return n;
+		}
+
+		std::string	get_string ()
+		{
+			size_t		len = get_int(2);
+			if (data.size() - pos < len) {
+				ok = false;
+				return std::string();
+			}
+			pos += len;
+			return data.substr(pos - len, len);
+		}
+
+		void		get_bytes (unsigned char* out, size_t len)
+		{
+			if (data.size() - pos < len) {
+				ok = false;
+				return;
+			}
+			std::memcpy(out, data.data() + pos, len);
+			pos += len;
+		}
+	};
+}
+
+void	Capture_record::clear ()
+{
+	time = 0;
+	client_family = 0;
+	std::memset(client_address, '\0', sizeof(client_address));
+	daemon_name.clear();
+	is_authenticated = false;
+	did_sign = false;
+	did_rewrite_rcpt = false;
+	verdict = VERDICT_NONE;
+	num_removed_headers = 0;
+	env_from.clear();
+	rcpts.clear();
+	headers.clear();
+}
+
+void	Capture_record::encode (std::string& out) const
+{
+	std::string		fields;
+	append_int(fields, time, 8);
+	append_int(fields, client_family, 1);
+	fields.append(reinterpret_cast<const char*>(client_address), sizeof(client_address));
+	append_string(fields, daemon_name);
+	append_int(fields, (is_authenticated ? 0x01 : 0) | (did_sign ? 0x02 : 0) | (did_rewrite_rcpt ? 0x04 : 0), 1);
+	append_int(fields, verdict, 1);
+	append_int(fields, num_removed_headers, 2);
+	append_string(fields, env_from);
+	append_int(fields, rcpts.size(), 2);
+	for (size_t i = 0; i < rcpts.size() && i < 0xFFFF; ++i) {
+		append_string(fields, rcpts[i]);
+	}
+	append_int(fields, headers.size(), 2);
+	for (size_t i = 0; i < headers.size() && i < 0xFFFF; ++i) {
+		append_string(fields, headers[i].first);
+		append_string(fields, headers[i].second);
+	}
+
+	append_int(out, fields.size(), 4);
+	out.append(fields);
+}
+
+bool	Capture_record::decode (const std::string& data)
+{
+	clear();
+	Decoder			in(data);
+	time = in.get_int(8);
+	client_family = in.get_int(1);
+	in.get_bytes(client_address, sizeof(client_address));
+	daemon_name = in.get_string();
+	unsigned int		flags = in.get_int(1);
+	is_authenticated = flags & 0x01;
+	did_sign = flags & 0x02;
+	did_rewrite_rcpt = flags & 0x04;
+	unsigned int		verdict_code = in.get_int(1);
+	verdict = verdict_code == VERDICT_VALID ? VERDICT_VALID : verdict_code == VERDICT_INVALID ? VERDICT_INVALID : VERDICT_NONE;
+	num_removed_headers = in.get_int(2);
+	env_from = in.get_string();
+	for (unsigned int num_rcpts = in.get_int(2); num_rcpts > 0; --num_rcpts) {
+		rcpts.push_back(in.get_string());
+	}
+	for (unsigned int num_headers = in.get_int(2); num_headers > 0; --num_headers) {
+		std::string	name(in.get_string());
+		headers.push_back(std::make_pair(name, in.get_string()));
+	}
+	return in.is_ok();
+}
+
+bool	batv::read_capture_record (std::istream& in, Capture_record& record)
+{
+	unsigned char		len_bytes[4];
+	if (!in.read(reinterpret_cast<char*>(len_bytes), 4)) {
+		if (in.gcount() == 0) {
+			return false;
+		}
+		throw Config_error("Truncated capture record");
+	}
+	uint32_t		len = (static_cast<uint32_t>(len_bytes[0]) << 24) | (len_bytes[1] << 16) | (len_bytes[2] << 8) | len_bytes[3];
+	if (len > max_record_len) {
+		throw Config_error("Malformed capture record");
+	}
+	std::string		data(len, '\0');
+	if (len > 0 && !in.read(&data[0], len)) {
+		throw Config_error("Truncated capture record");
+	}
+	if (!record.decode(data)) {
+		throw Config_error("Malformed capture record");
+	}
+	return true;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <utility>
+#include <iosfwd>
+
+namespace batv {
+	// A recorded milter transaction (one message), as written by batv-milter's
+	// capture mode and read by batv-milter-replay.
+	//
+	// A capture file is the 8 bytes "BATVCAP1" followed by records, each of which is
+	// a 4 byte length followed by the encoded fields below, in order.  Integers are in
+	// network byte order; strings are a 2 byte length followed by the bytes.
+	struct Capture_record {
+		enum Verdict {
+			VERDICT_NONE	= 0,	// no BATV recipient
+			VERDICT_VALID	= 1,
+			VERDICT_INVALID	= 2
+		};
+
+		uint64_t		time;			// 8 bytes: microseconds since the epoch, at MAIL
+		unsigned char		client_family;		// 1 byte: 4, 6, or 0 if unknown/local
+		unsigned char		client_address[16];	// 16 bytes: IPv6 address (IPv4-mapped for IPv4)
+		std::string		daemon_name;		// string: {daemon_name} macro (empty if none)
+		bool			is_authenticated;	// 1 byte of flags: 0x01
+		bool			did_sign;		//                  0x02 (outcome: sender was signed)
+		bool			did_rewrite_rcpt;	//                  0x04 (outcome: recipient was rewritten)
+		Verdict			verdict;		// 1 byte (outcome: value of added X-Batv-Status)
+		unsigned int		num_removed_headers;	// 2 bytes (outcome: X-Batv-Status headers removed)
+		std::string		env_from;		// string
+		std::vector<std::string> rcpts;			// 2 byte count, strings (as given to RCPT)
+		std::vector<std::pair<std::string, std::string> > headers; // 2 byte count, name and value strings
+								// (only X-Batv-Status values are recorded)
+
+		Capture_record () { clear(); }
+
+		void			clear ();
+		void			encode (std::string& out) const;	// appends the length and fields
+		// Decode the fields (after the length) from data.  Returns false if malformed.
+		bool			decode (const std::string& data);
+	};
+
+	extern const char	capture_file_magic[8];
+
+	// Read the next record from a capture file, after the magic has been checked.
+	// Returns false at end of file; throws Config_error if the file is malformed.
+	bool			read_capture_record (std::istream& in, Capture_record& record);
+}
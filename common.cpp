@@ -39,7 +39,12 @@
 #include <pwd.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <fstream>
+#include <algorithm>
 
 using namespace batv;
 
@@ -148,3 +153,46 @@ void batv::daemonize (const std::string& pid_file, const std::string& stderr_fil
 	open("/dev/null", O_WRONLY);
 }
 
+void batv::list_directory (const std::string& dir_path, std::vector<std::string>& file_paths)
+{
+	DIR*		dir = opendir(dir_path.c_str());
+	if (!dir) {
+		throw Config_error("Unable to open directory " + dir_path + ": " + strerror(errno));
+	}
+	file_paths.clear();
+	while (struct dirent* ent = readdir(dir)) {
+		std::string	name(ent->d_name);
+		if (name[0] == '.' || name[name.size() - 1] == '~') {
+			continue;
+		}
+		std::string	path(dir_path + "/" + name);
+		struct stat	st;
+		if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+			file_paths.push_back(path);
+		}
+	}
+	closedir(dir);
+	std::sort(file_paths.begin(), file_paths.end());
+}
+
+double batv::now ()
+{
+	struct timespec		ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void batv::start_background_thread (void* (*thread_main)(void*), void* arg)
+{
+	sigset_t		all_signals;
+	sigset_t		old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	pthread_t		thread;
+	int			error = pthread_create(&thread, NULL, thread_main, arg);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (error) {
+		throw Config_error(std::string("pthread_create: ") + strerror(error));
+	}
+	pthread_detach(thread);
+}
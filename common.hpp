@@ -31,6 +31,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace batv {
 	struct Config_error {
@@ -44,4 +45,15 @@ namespace batv {
 	void drop_privileges (const std::string& username, const std::string& groupname);
 
 	void daemonize (const std::string& pid_file, const std::string& stderr_file);
+
+	// Seconds on a monotonic clock, for timing things
+	double now ();
+
+	// Start a detached thread, with signals blocked in it, so they're handled as
+	// they were before it existed.  Throws Config_error if it can't be started.
+	void start_background_thread (void* (*thread_main)(void*), void* arg);
+
+	// Get the paths of the regular files in a directory, sorted, skipping
+	// hidden files and editor backups (ending in ~)
+	void list_directory (const std::string& dir_path, std::vector<std::string>& file_paths);
 }
@@ -95,20 +95,58 @@ namespace {
 
 		return Config::Ipv6_cidr(address, prefix_len);
 	}
+
+	void			load_key_map_file (Config& config, const std::string& path)
+	{
+		std::ifstream			key_map_in(path.c_str());
+		if (!key_map_in) {
+			throw Config_error("Unable to open key map " + path);
+		}
+		std::vector<Key_map_line>&	lines = config.key_map_lines[path];
+		Key_map_stats			stats;
+		lines.clear();
+		parse_key_map(lines, key_map_in);
+		load_key_map(config.keys, lines, &stats);
+		config.key_map_stats += stats;
+	}
+
+	bool			parse_bool (const std::string& value)
+	{
+		if (value == "yes" || value == "true" || value == "on" || value == "1") {
+			return true;
+		} else if (value == "no" || value == "false" || value == "off" || value == "0") {
+			return false;
+		} else {
+			throw Config_error("Invalid boolean value " + value);
+		}
+	}
+
+	Config::Failure_mode	parse_failure_mode (const std::string& directive, const std::string& value)
+	{
+		if (value == "tempfail") {
+			return Config::FAILURE_TEMPFAIL;
+		} else if (value == "accept") {
+			return Config::FAILURE_ACCEPT;
+		} else if (value == "reject") {
+			return Config::FAILURE_REJECT;
+		} else {
+			throw Config_error("Invalid value for '" + directive + "' directive (should be 'tempfail', 'accept', or 'reject'): " + value);
+		}
+	}
 }
 
 
-const Key* Config::get_key (const std::string& sender_address) const
+Key_ref Config::get_key (const std::string& sender_address) const
 {
 	return batv::get_key(keys, sender_address);
 }
 
-bool Config::is_internal_host (const struct in_addr& addr) const
+bool Listener_config::is_internal_host (const struct in_addr& addr) const
 {
 	return is_internal_host(make_ipv4_mapped_address(addr));
 }
 
-bool Config::is_internal_host (const struct in6_addr& addr) const
+bool Listener_config::is_internal_host (const struct in6_addr& addr) const
 {
 	std::vector<Ipv6_cidr>::const_iterator it(internal_hosts.begin());
 	while (it != internal_hosts.end()) {
@@ -126,16 +164,54 @@ bool Config::is_internal_host (const struct in6_addr& addr) const
 	return false;
 }
 
-void	Config::set (const std::string& directive, const std::string& value)
+bool	Listener_config::set (const std::string& directive, const std::string& value)
 {
-	if (directive == "daemon") {
-		if (value == "yes" || value == "true" || value == "on" || value == "1") {
-			daemon = true;
-		} else if (value == "no" || value == "false" || value == "off" || value == "0") {
-			daemon = false;
+	if (directive == "mode") {
+		if (value == "sign") {
+			do_sign = true;
+			do_verify = false;
+		} else if (value == "verify") {
+			do_verify = true;
+			do_sign = false;
+		} else if (value == "both") {
+			do_verify = true;
+			do_sign = true;
 		} else {
-			throw Config_error("Invalid boolean value " + value);
+			throw Config_error("Invalid mode " + value);
+		}
+	} else if (directive == "lifetime") {
+		address_lifetime = std::atoi(value.c_str());
+		if (address_lifetime < 1 || address_lifetime > 999) {
+			throw Config_error("Invalid address lifetime " + value + " (must be between 1 and 999, inclusive)");
+		}
+	} else if (directive == "internal-host") {
+		internal_hosts.push_back(parse_cidr_string(value.c_str()));
+	} else if (directive == "sub-address-delimiter") {
+		if (value.size() != 1) {
+			throw Config_error("Sub address delimiter must be exactly one character");
 		}
+		sub_address_delimiter = value[0];
+	} else {
+		return false;
+	}
+	return true;
+}
+
+const Listener_config&	Config::get_listener (const char* daemon_name) const
+{
+	if (daemon_name) {
+		std::map<std::string, Listener_config>::const_iterator	it(listeners.find(daemon_name));
+		if (it != listeners.end()) {
+			return it->second;
+		}
+	}
+	return *this;
+}
+
+void	Config::set (const std::string& directive, const std::string& value)
+{
+	if (directive == "daemon") {
+		daemon = parse_bool(value);
 	} else if (directive == "debug") {
 		debug = std::atoi(value.c_str());
 	} else if (directive == "pid-file") {
@@ -153,6 +229,10 @@ void	Config::set (const std::string& directive, const std::string& value)
 		load(config_in);
 	} else if (directive == "socket") {
 		socket_spec = value;
+	} else if (directive == "takeover") {
+		takeover = parse_bool(value);
+	} else if (directive == "drain-timeout") {
+		drain_timeout = std::atoi(value.c_str());
 	} else if (directive == "socket-mode") {
 		if (value.size() != 3 ||
 				value[0] < '0' || value[0] > '7' ||
@@ -161,47 +241,77 @@ void	Config::set (const std::string& directive, const std::string& value)
 			throw Config_error("Invalid socket mode (not a 3 digit octal number): " + value);
 		}
 		socket_mode = ((value[0] - '0') << 6) | ((value[1] - '0') << 3) | (value[2] - '0');
-	} else if (directive == "mode") {
-		if (value == "sign") {
-			do_sign = true;
-			do_verify = false;
-		} else if (value == "verify") {
-			do_verify = true;
-			do_sign = false;
-		} else if (value == "both") {
-			do_verify = true;
-			do_sign = true;
-		} else {
-			throw Config_error("Invalid mode " + value);
+	} else if (directive == "listener") {
+		// Listener settings up to end-listener apply to this listener, which starts with the settings so far
+		if (value.empty()) {
+			throw Config_error("Listener name not specified");
 		}
-	} else if (directive == "lifetime") {
-		address_lifetime = std::atoi(value.c_str());
-		if (address_lifetime < 1 || address_lifetime > 999) {
-			throw Config_error("Invalid address lifetime " + value + " (must be between 1 and 999, inclusive)");
+		if (!current_listener.empty()) {
+			throw Config_error("Listener " + current_listener + " must be ended with end-listener before listener " + value);
 		}
-	} else if (directive == "internal-host") {
-		internal_hosts.push_back(parse_cidr_string(value.c_str()));
-	} else if (directive == "sub-address-delimiter") {
-		if (value.size() != 1) {
-			throw Config_error("Sub address delimiter must be exactly one character");
+		if (listeners.find(value) == listeners.end()) {
+			listeners.insert(std::make_pair(value, Listener_config(*this)));
 		}
-		sub_address_delimiter = value[0];
+		current_listener = value;
+	} else if (directive == "end-listener") {
+		if (current_listener.empty() || value != current_listener) {
+			throw Config_error("end-listener " + value + " doesn't match the current listener");
+		}
+		current_listener.clear();
+	} else if (!current_listener.empty() && listeners[current_listener].set(directive, value)) {
+		// Set for the current listener
+	} else if (Listener_config::set(directive, value)) {
+		// Set for connections not belonging to a listener
 	} else if (directive == "key-map") {
-		std::ifstream	key_map_in(value.c_str());
-		if (!key_map_in) {
-			throw Config_error("Unable to open key map " + value);
+		load_key_map_file(*this, value);
+		key_map_sources.push_back(Key_map_source(value, false));
+	} else if (directive == "key-map-dir") {
+		std::vector<std::string>	paths;
+		list_directory(value, paths);
+		for (size_t i = 0; i < paths.size(); ++i) {
+			load_key_map_file(*this, paths[i]);
 		}
-		load_key_map(keys, key_map_in);
+		key_map_sources.push_back(Key_map_source(value, true));
+	} else if (directive == "watch-key-map") {
+		watch_key_map = parse_bool(value);
 	} else if (directive == "on-internal-error") {
-		if (value == "tempfail") {
-			on_internal_error = FAILURE_TEMPFAIL;
-		} else if (value == "accept") {
-			on_internal_error = FAILURE_ACCEPT;
-		} else if (value == "reject") {
-			on_internal_error = FAILURE_REJECT;
-		} else {
-			throw Config_error("Invalid value for 'on-internal-error' directive (should be 'tempfail', 'accept', or 'reject'): " + value);
+		on_internal_error = parse_failure_mode(directive, value);
+	} else if (directive == "on-overload") {
+		on_overload = parse_failure_mode(directive, value);
+	} else if (directive == "overload-latency") {
+		overload_latency = std::atoi(value.c_str());
+	} else if (directive == "overload-connections") {
+		overload_connections = std::atoi(value.c_str());
+	} else if (directive == "callback-deadline") {
+		callback_deadline = std::atoi(value.c_str());
+	} else if (directive == "capture-file") {
+		capture_file = value;
+	} else if (directive == "capture-hash-key") {
+		std::ifstream	key_in(value.c_str());
+		if (!key_in) {
+			throw Config_error("Unable to open capture hash key " + value);
+		}
+		load_key(capture_hash_key, key_in);
+	} else if (directive == "trust-clock-macro") {
+		trust_clock_macro = parse_bool(value);
+	} else if (directive == "derived-key-cache-size") {
+		derived_key_cache_size = std::atoi(value.c_str());
+	} else if (directive == "key-provider") {
+		key_provider_socket = value;
+	} else if (directive == "key-provider-timeout") {
+		key_provider_timeout = std::atoi(value.c_str());
+	} else if (directive == "key-provider-max-stale") {
+		key_provider_max_stale = std::atoi(value.c_str());
+	} else if (directive == "key-cache-size") {
+		key_cache_size = std::atoi(value.c_str());
+	} else if (directive == "key-filter-fp-rate") {
+		double		rate = std::atof(value.c_str());
+		if (rate < 0 || rate >= 1) {
+			throw Config_error("Invalid key filter false positive rate " + value + " (must be at least 0 and less than 1)");
 		}
+		keys.set_filter_false_positive_rate(rate);
+		key_map_stats.filter_bytes = keys.filter().size_bytes();
+		key_map_stats.filter_fp_rate = keys.filter().false_positive_rate();
 	} else {
 		throw Config_error("Invalid config directive " + directive);
 	}
@@ -209,6 +319,7 @@ void	Config::set (const std::string& directive, const std::string& value)
 
 void	Config::load (std::istream& in)
 {
+	const std::string	outer_listener(current_listener);	// if included from within a listener
 	while (in.good() && in.peek() != -1) {
 		// Skip comments (lines starting with #) and blank lines
 		if (in.peek() == '#' || in.peek() == '\n') {
@@ -229,6 +340,11 @@ void	Config::load (std::istream& in)
 
 		set(directive, value);
 	}
+
+	// Otherwise, settings after the file (e.g. on the command line) would apply to the listener
+	if (current_listener != outer_listener) {
+		throw Config_error("Listener " + current_listener + " not ended with end-listener");
+	}
 }
 
 void	Config::validate () const
@@ -236,5 +352,21 @@ void	Config::validate () const
 	if (socket_spec.empty()) {
 		throw Config_error("Milter socket not specified");
 	}
+#ifndef __linux__
+	if (watch_key_map) {
+		throw Config_error("Watching the key map is only supported on Linux");
+	}
+#endif
+	if (takeover) {
+#ifndef __linux__
+		throw Config_error("Taking over the socket is only supported on Linux");
+#endif
+		if (socket_spec[0] != '/') {
+			throw Config_error("Taking over the socket requires a UNIX domain socket (specified as a path starting with /)");
+		}
+		if (pid_file.empty()) {
+			throw Config_error("Taking over the socket requires a pid-file, through which the running milter is found");
+		}
+	}
 }
 
@@ -39,9 +39,36 @@
 #include <iosfwd>
 
 namespace batv {
-	struct Config {
+	// The settings which can differ between listeners (see Config::listeners)
+	struct Listener_config {
 		typedef std::pair<struct in6_addr, unsigned int> Ipv6_cidr;	// an IPv6 address and prefix length
 
+		bool			do_sign;
+		bool			do_verify;
+		std::vector<Ipv6_cidr>	internal_hosts;		// we generate BATV addresses only for mail from these hosts
+		unsigned int		address_lifetime;	// in days, how long BATV address is valid
+		char			sub_address_delimiter;	// e.g. "+"
+
+		bool			is_internal_host (const struct in6_addr&) const;	// Is given IPv6 address internal?
+		bool			is_internal_host (const struct in_addr&) const;		// Is given IPv4 addres internal?
+
+		// Set one of the above.  Returns false if the directive isn't one of them.
+		bool			set (const std::string& directive, const std::string& value);
+
+		Listener_config ()
+		{
+			do_sign = true;
+			do_verify = true;
+			address_lifetime = 7;
+			sub_address_delimiter = 0;
+		}
+	};
+
+	// The Listener_config settings of a Config apply to connections which don't
+	// belong to one of its listeners.
+	struct Config : Listener_config {
+		typedef std::pair<std::string, bool> Key_map_source;		// a path, and whether it's a drop-in directory
+
 		enum Failure_mode {
 			FAILURE_TEMPFAIL,
 			FAILURE_ACCEPT,
@@ -55,18 +82,33 @@ namespace batv {
 		std::string		group_name;
 		std::string		socket_spec;
 		int			socket_mode;		// or -1 to use the umask
-		bool			do_sign;
-		bool			do_verify;
-		std::vector<Ipv6_cidr>	internal_hosts;		// we generate BATV addresses only for mail from these hosts
+		bool			takeover;		// take over the socket from a running milter
+		unsigned int		drain_timeout;		// in seconds, how long to let open connections finish at exit
+		std::map<std::string, Listener_config> listeners; // by the {daemon_name} of their connections
+		std::string		current_listener;	// the listener being configured (until end-listener), if any
 		Key_map			keys;			// map from sender address/domain to their HMAC key
-		unsigned int		address_lifetime;	// in days, how long BATV address is valid
-		char			sub_address_delimiter;	// e.g. "+"
+		Key_map_stats		key_map_stats;		// how loading the key map went
+		std::vector<Key_map_source> key_map_sources;	// key map files and drop-in directories, in order
+		std::map<std::string, std::vector<Key_map_line> > key_map_lines; // by key map file (kept for watch_key_map)
+		bool			watch_key_map;		// apply changes to the key map files as they happen
 		Failure_mode		on_internal_error;	// what to do when an internal error happens
+		Failure_mode		on_overload;		// what to do with connections shed while overloaded
+		unsigned int		overload_latency;	// in ms, average callback time above which we're overloaded (0 = never)
+		unsigned int		overload_connections;	// while overloaded, admit connections only while fewer are open
+		unsigned int		callback_deadline;	// in ms, report callbacks running longer than this (0 = never)
+		std::string		capture_file;		// record transactions to this file (if non-empty)
+		Key			capture_hash_key;	// if non-empty, hash local parts in captures with this key
+		bool			trust_clock_macro;	// take the current time from the {batv_clock} macro (for replay)
+		size_t			derived_key_cache_size;	// max number of HKDF-derived keys to cache
+		std::string		key_provider_socket;	// if non-empty, ask this key provider for keys not in the key map
+		unsigned int		key_provider_timeout;	// in milliseconds, how long to wait for the key provider
+		unsigned int		key_provider_max_stale;	// in seconds, how long past their TTL to use keys if the provider fails
+		size_t			key_cache_size;		// max number of senders to cache the key provider's answers for
 
-		const Key*		get_key (const std::string& sender_address) const;	// Get HMAC key for the given sender
+		Key_ref			get_key (const std::string& sender_address) const;	// Get HMAC key for the given sender
 												// (NULL if sender doesn't use BATV)
-		bool			is_internal_host (const struct in6_addr&) const;	// Is given IPv6 address internal?
-		bool			is_internal_host (const struct in_addr&) const;		// Is given IPv4 addres internal?
+		// Get the settings for a connection with the given {daemon_name} (which may be NULL)
+		const Listener_config&	get_listener (const char* daemon_name) const;
 
 		void			set (const std::string& directive, const std::string& value);
 		void			load (std::istream&);
@@ -77,11 +119,19 @@ namespace batv {
 			daemon = false;
 			debug = 0;
 			socket_mode = -1;
-			do_sign = true;
-			do_verify = true;
-			address_lifetime = 7;
-			sub_address_delimiter = 0;
+			takeover = false;
+			drain_timeout = 60;
 			on_internal_error = FAILURE_TEMPFAIL;
+			on_overload = FAILURE_ACCEPT;
+			overload_latency = 0;
+			overload_connections = 0;
+			callback_deadline = 0;
+			trust_clock_macro = false;
+			watch_key_map = false;
+			derived_key_cache_size = 10000;
+			key_provider_timeout = 1000;
+			key_provider_max_stale = 3600;
+			key_cache_size = 10000;
 		}
 
 	};
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "daemon-client.hpp"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace batv;
+
+bool Daemon_client::connect (const std::string& socket_path)
+{
+	disconnect();
+
+	struct sockaddr_un	addr;
+	if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+		return false;
+	}
+	std::memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, socket_path.c_str());
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return false;
+	}
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+		disconnect();
+		return false;
+	}
+	return true;
+}
+
+void Daemon_client::disconnect ()
+{
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+	in_buffer.clear();
+}
+
+int Daemon_client::request (char command, unsigned int lifetime, char sub_address_delimiter, const std::string& address, std::string& result)
+{
+	if (fd == -1) {
+		return -1;
+	}
+
+	char			prefix[32];
+	std::sprintf(prefix, "%c %u %c ", command, lifetime, sub_address_delimiter);
+	std::string		request(prefix);
+	request.append(address);
+	if (has_control_chars(request)) {
+		return DAEMON_BAD_REQUEST;
+	}
+	request.push_back('\n');
+
+	const char*		p = request.data();
+	size_t			len = request.size();
+	while (len > 0) {
+		ssize_t		bytes_written = send(fd, p, len, MSG_NOSIGNAL);
+		if (bytes_written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			disconnect();
+			return -1;
+		}
+		p += bytes_written;
+		len -= bytes_written;
+	}
+
+	std::string::size_type	newline_pos;
+	while ((newline_pos = in_buffer.find('\n')) == std::string::npos) {
+		char		buffer[1024];
+		ssize_t		bytes_read = read(fd, buffer, sizeof(buffer));
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			disconnect();
+			return -1;
+		}
+		in_buffer.append(buffer, bytes_read);
+	}
+
+	// Parse "CODE SP RESULT"
+	char*			code_end;
+	long			code = std::strtol(in_buffer.c_str(), &code_end, 10);
+	if (code_end == in_buffer.c_str() || *code_end != ' ' || code < 0) {
+		disconnect();
+		return -1;
+	}
+	result.assign(static_cast<const char*>(code_end) + 1, in_buffer.c_str() + newline_pos);
+	in_buffer.erase(0, newline_pos + 1);
+	return code;
+}
+
+bool batv::has_control_chars (const std::string& str)
+{
+	for (std::string::const_iterator it(str.begin()); it != str.end(); ++it) {
+		if (static_cast<unsigned char>(*it) < 0x20 || *it == 0x7F) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::string batv::daemon_socket_path ()
+{
+	if (const char* path = std::getenv("BATV_SOCKET")) {
+		return path;
+	}
+	std::string		path;
+	if (const char* home_dir = std::getenv("HOME")) {
+		path = home_dir;
+	}
+	return path + "/.batv-socket";
+}
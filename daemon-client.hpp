@@ -0,0 +1,79 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <string>
+
+namespace batv {
+	// Response codes of the batv-daemon protocol.  Apart from DAEMON_BAD_REQUEST,
+	// these match the exit statuses of batv-validate.
+	enum Daemon_status {
+		DAEMON_OK		= 0,
+		DAEMON_BAD_REQUEST	= 2,	// malformed request
+		DAEMON_INVALID		= 10,	// invalid signature
+		DAEMON_NOT_BATV		= 11,	// not a BATV address
+		DAEMON_NO_KEY		= 12,	// no key available for the sender
+		DAEMON_NO_DOMAIN	= 14	// address is missing domain name
+	};
+
+	// Client for the batv-daemon protocol.  Each request is one line:
+	//   COMMAND SP LIFETIME SP SUB-ADDRESS-DELIMITER SP ADDRESS LF
+	// where COMMAND is S (sign) or V (validate), and each response is one line:
+	//   CODE SP RESULT LF
+	// where RESULT is the signed (S) or original (V) address if CODE is 0.
+	// Requests may be pipelined; responses are sent in request order.
+	class Daemon_client {
+		int			fd;
+		std::string		in_buffer;
+
+		Daemon_client (const Daemon_client&);
+		Daemon_client& operator= (const Daemon_client&);
+	public:
+		Daemon_client () : fd(-1) { }
+		~Daemon_client () { disconnect(); }
+
+		bool			connect (const std::string& socket_path);	// returns false if no daemon is listening
+		void			disconnect ();
+		bool			is_connected () const { return fd != -1; }
+
+		// Send a request and wait for its response.  Returns the response code,
+		// or -1 if communication with the daemon failed.  Returns DAEMON_BAD_REQUEST
+		// without sending anything if the request would contain control characters.
+		int			request (char command, unsigned int lifetime, char sub_address_delimiter, const std::string& address, std::string& result);
+	};
+
+	// Does the string contain control characters (including CR, LF, and NUL)?
+	// They can't appear in requests, since they could end the request line early.
+	bool			has_control_chars (const std::string&);
+
+	// The path to the daemon's socket: $BATV_SOCKET, or ~/.batv-socket
+	std::string		daemon_socket_path ();
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "domain-table.hpp"
+#include "hash.hpp"
+#include <cstring>
+#include <algorithm>
+
+namespace {
+	bool equals_folded (const char* lower, const char* str, size_t len)
+	{
+		for (size_t i = 0; i < len; ++i) {
+			char	c = str[i];
+			if (c >= 'A' && c <= 'Z') {
+				c += 'a' - 'A';
+			}
+			if (lower[i] != c) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+batv::Domain_table::Domain_table ()
+{
+	table = new Table;
+	table->mask = 15;
+	table->slots = new Slot[table->mask + 1];
+	std::memset(table->slots, 0, sizeof(Slot) * (table->mask + 1));
+	table->previous = NULL;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+batv::Domain_table::~Domain_table ()
+{
+	destroy();
+	pthread_mutex_destroy(&mutex);
+}
+
+void	batv::Domain_table::destroy ()
+{
+	while (table) {
+		Table*		previous = table->previous;
+		delete[] table->slots;
+		delete table;
+		table = previous;
+	}
+	for (size_t i = 0; i < names.size(); ++i) {
+		delete[] names[i];
+	}
+	names.clear();
+}
+
+batv::Domain_table::Id	batv::Domain_table::find (const char* domain, size_t len) const
+{
+	return find(domain, len, hash_string(domain, len));
+}
+
+batv::Domain_table::Id	batv::Domain_table::find (const char* domain, size_t len, uint64_t hash) const
+{
+	const Table*		t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+	for (size_t i = hash & t->mask; ; i = (i + 1) & t->mask) {
+		const Slot&	slot = t->slots[i];
+		Id		id = __atomic_load_n(&slot.id, __ATOMIC_ACQUIRE);
+		if (id == 0) {
+			return 0;
+		}
+		if (slot.hash == hash && slot.len == len && equals_folded(slot.name, domain, len)) {
+			return id;
+		}
+	}
+}
+
+// Put a slot in the first empty place for it, publishing it to lookups
+void	batv::Domain_table::insert (Table* t, const Slot& slot)
+{
+	size_t			i = slot.hash & t->mask;
+	while (t->slots[i].id != 0) {
+		i = (i + 1) & t->mask;
+	}
+	t->slots[i].hash = slot.hash;
+	t->slots[i].name = slot.name;
+	t->slots[i].len = slot.len;
+	__atomic_store_n(&t->slots[i].id, slot.id, __ATOMIC_RELEASE);
+}
+
+batv::Domain_table::Id	batv::Domain_table::intern (const char* domain, size_t len)
+{
+	const uint64_t		hash = hash_string(domain, len);
+	pthread_mutex_lock(&mutex);
+	Id			id = find(domain, len, hash);
+	if (id == 0) {
+		// Keep the table at most half full, growing it into a new table so
+		// that lookups in the old one aren't disturbed
+		if ((names.size() + 1) * 2 > table->mask + 1) {
+			Table*		new_table = new Table;
+			new_table->mask = table->mask * 2 + 1;
+			new_table->slots = new Slot[new_table->mask + 1];
+			std::memset(new_table->slots, 0, sizeof(Slot) * (new_table->mask + 1));
+			new_table->previous = table;
+			for (size_t i = 0; i <= table->mask; ++i) {
+				if (table->slots[i].id != 0) {
+					insert(new_table, table->slots[i]);
+				}
+			}
+			__atomic_store_n(&table, new_table, __ATOMIC_RELEASE);
+		}
+
+		char*		name = new char[len + 1];
+		for (size_t i = 0; i < len; ++i) {
+			name[i] = domain[i] >= 'A' && domain[i] <= 'Z' ? domain[i] - 'A' + 'a' : domain[i];
+		}
+		name[len] = '\0';
+		names.push_back(name);
+
+		Slot		slot;
+		slot.hash = hash;
+		slot.name = name;
+		slot.len = len;
+		slot.id = id = names.size();
+		insert(table, slot);
+	}
+	pthread_mutex_unlock(&mutex);
+	return id;
+}
+
+size_t	batv::Domain_table::size () const
+{
+	pthread_mutex_lock(&mutex);
+	size_t			n = names.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+std::string	batv::Domain_table::name (Id id) const
+{
+	pthread_mutex_lock(&mutex);
+	std::string		result(id > 0 && id <= names.size() ? names[id - 1] : "");
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+void	batv::Domain_table::swap (Domain_table& other)
+{
+	std::swap(table, other.table);
+	names.swap(other.names);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+
+namespace batv {
+	// Interns domains (case-insensitively), mapping each to a small integer id which
+	// is stable for the life of the table, so that domains can be compared and hashed
+	// as integers.  Lookups are lock-free and may run while domains are being interned
+	// (which takes a lock).  Ids start at 1; 0 means a domain isn't in the table.
+	class Domain_table {
+	public:
+		typedef uint32_t	Id;
+
+	private:
+		struct Slot {
+			uint64_t	hash;		// see hash.hpp
+			const char*	name;		// lower-cased, owned by the table
+			size_t		len;
+			Id		id;		// 0 if the slot is empty; written last
+		};
+		struct Table {
+			size_t		mask;		// number of slots - 1 (a power of 2 - 1)
+			Slot*		slots;
+			Table*		previous;	// kept for lookups that may still be using it
+		};
+
+		Table*			table;		// the current table
+		std::vector<const char*> names;		// [id - 1] -> name
+		mutable pthread_mutex_t	mutex;		// held while interning
+
+		static void		insert (Table*, const Slot&);
+		void			destroy ();
+
+		Domain_table (const Domain_table&);
+		Domain_table& operator= (const Domain_table&);
+	public:
+		Domain_table ();
+		~Domain_table ();
+
+		// Get a domain's id, or 0 if it hasn't been interned
+		Id			find (const char* domain, size_t len) const;
+		Id			find (const char* domain, size_t len, uint64_t hash) const;	// hash from hash_string
+		// Get a domain's id, interning it if necessary
+		Id			intern (const char* domain, size_t len);
+
+		size_t			size () const;
+		std::string		name (Id) const;
+		void			swap (Domain_table&);	// not safe during lookups
+	};
+}
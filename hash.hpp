@@ -0,0 +1,69 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace batv {
+	// FNV-1a of a lower-cased string, taken from the end of the string so that the
+	// hashes of its suffixes (e.g. a domain's parents) are found along the way:
+	//   h = hash_start; for each byte, last first: h = hash_byte(h, byte); finish_hash(h)
+	// finish_hash mixes the result so that both halves are well distributed.
+	const uint64_t		hash_start = 14695981039346656037ULL;
+
+	inline uint64_t		hash_byte (uint64_t h, unsigned char c)
+	{
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		return (h ^ c) * 1099511628211ULL;
+	}
+
+	inline uint64_t		finish_hash (uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	inline uint64_t		hash_string (const char* str, size_t len)
+	{
+		uint64_t	h = hash_start;
+		for (size_t i = len; i > 0; --i) {
+			h = hash_byte(h, str[i - 1]);
+		}
+		return finish_hash(h);
+	}
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "key-map-watcher.hpp"
+#include "common.hpp"
+#include "pattern.hpp"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+using namespace batv;
+
+namespace {
+#ifdef __linux__
+	const uint32_t		watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE;
+#endif
+	const int		settle_ms = 100;	// wait this long for more changes before applying a batch...
+	const double		max_settle_time = 1.0;	// ... but no longer than this after the first change
+
+	bool is_pattern_name (const std::string& name)
+	{
+		return name != "*" && Pattern_set::is_pattern(name);
+	}
+
+	// Lines naming the same entry have the same canonical name: domains and patterns are case-insensitive
+	std::string canonical_name (const std::string& address)
+	{
+		std::string		name(address);
+		std::string::size_type	start = name.size();
+		if (is_pattern_name(name)) {
+			start = 0;
+		} else if (name.rfind('@') != std::string::npos) {
+			start = name.rfind('@');
+		}
+		for (std::string::size_type i = start; i < name.size(); ++i) {
+			if (name[i] >= 'A' && name[i] <= 'Z') {
+				name[i] += 'a' - 'A';
+			}
+		}
+		return name;
+	}
+
+	typedef std::map<std::string, std::vector<Key_map_line> > Lines_by_name;
+
+	void group_lines (const std::vector<Key_map_line>& lines, size_t begin, size_t end, Lines_by_name& by_name)
+	{
+		for (size_t i = begin; i < end; ++i) {
+			by_name[canonical_name(lines[i].address)].push_back(lines[i]);
+		}
+	}
+
+	// Add the canonical names of entries whose lines differ between old_lines and new_lines to changed_names
+	void diff_lines (const std::vector<Key_map_line>& old_lines, const std::vector<Key_map_line>& new_lines, std::set<std::string>& changed_names)
+	{
+		// Only the lines between the common prefix and suffix need comparing, since
+		// an entry's lines are the same in both if its lines in between are
+		size_t			prefix_len = 0;
+		size_t			suffix_len = 0;
+		while (prefix_len < old_lines.size() && prefix_len < new_lines.size() && old_lines[prefix_len] == new_lines[prefix_len]) {
+			++prefix_len;
+		}
+		while (suffix_len < old_lines.size() - prefix_len && suffix_len < new_lines.size() - prefix_len &&
+				old_lines[old_lines.size() - 1 - suffix_len] == new_lines[new_lines.size() - 1 - suffix_len]) {
+			++suffix_len;
+		}
+
+		Lines_by_name		old_by_name;
+		Lines_by_name		new_by_name;
+		group_lines(old_lines, prefix_len, old_lines.size() - suffix_len, old_by_name);
+		group_lines(new_lines, prefix_len, new_lines.size() - suffix_len, new_by_name);
+		for (Lines_by_name::const_iterator it(old_by_name.begin()); it != old_by_name.end(); ++it) {
+			Lines_by_name::const_iterator	new_it(new_by_name.find(it->first));
+			if (new_it == new_by_name.end() || new_it->second != it->second) {
+				changed_names.insert(it->first);
+			}
+		}
+		for (Lines_by_name::const_iterator it(new_by_name.begin()); it != new_by_name.end(); ++it) {
+			if (old_by_name.find(it->first) == old_by_name.end()) {
+				changed_names.insert(it->first);
+			}
+		}
+	}
+}
+
+Key_map_watcher::Key_map_watcher (Config& c) : config(c), inotify_fd(-1)
+{
+	pthread_rwlockattr_t	attr;
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	// Prefer writers, so a steady stream of lookups can't hold off an update
+	// (elsewhere, whether they're preferred depends on the default kind)
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+#ifdef __linux__
+void	Key_map_watcher::start ()
+{
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		throw Config_error(std::string("inotify_init1: ") + strerror(errno));
+	}
+
+	// Watch the directories containing key map files, rather than the files themselves,
+	// so that files which are replaced by renaming a new file over them are noticed
+	for (size_t i = 0; i < config.key_map_sources.size(); ++i) {
+		const std::string&	path = config.key_map_sources[i].first;
+		std::string		dir(path);
+		std::string		name(path);
+		if (!config.key_map_sources[i].second) {
+			std::string::size_type	slash_pos = path.rfind('/');
+			dir = slash_pos == std::string::npos ? "." : slash_pos == 0 ? "/" : path.substr(0, slash_pos);
+			name = path.substr(slash_pos == std::string::npos ? 0 : slash_pos + 1);
+		}
+		int			wd = inotify_add_watch(inotify_fd, dir.c_str(), watch_mask);
+		if (wd == -1) {
+			throw Config_error("Unable to watch " + dir + ": " + strerror(errno));
+		}
+		if (config.key_map_sources[i].second) {
+			drop_in_dirs[wd] = dir;
+		} else {
+			file_dirs[wd] = dir;
+			watched_files[dir + "/" + name] = path;
+		}
+	}
+
+	start_background_thread(thread_main, this);
+}
+
+void*	Key_map_watcher::thread_main (void* arg)
+{
+	static_cast<Key_map_watcher*>(arg)->run();
+	return NULL;
+}
+
+void	Key_map_watcher::run ()
+{
+	// Check every file once, in case it changed before it was watched
+	std::set<std::string>	changed_paths;
+	std::vector<std::string> paths;
+	try {
+		list_key_map_files(paths);
+	} catch (const Config_error& e) {
+		std::clog << "Key map watcher: " << e.message << std::endl;
+	}
+	changed_paths.insert(paths.begin(), paths.end());
+	for (std::map<std::string, std::vector<Key_map_line> >::const_iterator it(config.key_map_lines.begin()); it != config.key_map_lines.end(); ++it) {
+		changed_paths.insert(it->first);
+	}
+	double			first_change_time = now();
+
+	while (true) {
+		// Wait for a change, then for the changes to settle (a file may be written in several steps)
+		struct pollfd		pfd;
+		pfd.fd = inotify_fd;
+		pfd.events = POLLIN;
+		int			ready = poll(&pfd, 1, changed_paths.empty() ? -1 : settle_ms);
+		if (ready == -1 && errno != EINTR) {
+			std::clog << "Key map watcher: poll: " << strerror(errno) << std::endl;
+			return;
+		}
+		if (ready > 0) {
+			if (changed_paths.empty()) {
+				first_change_time = now();
+			}
+			read_events(changed_paths);
+			if (now() - first_change_time < max_settle_time) {
+				continue;
+			}
+		}
+		if (!changed_paths.empty()) {
+			apply(changed_paths, first_change_time);
+			changed_paths.clear();
+		}
+	}
+}
+
+void	Key_map_watcher::read_events (std::set<std::string>& changed_paths)
+{
+	char			buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t			len = read(inotify_fd, buffer, sizeof(buffer));
+	if (len == -1) {
+		if (errno != EINTR && errno != EAGAIN) {
+			std::clog << "Key map watcher: read: " << strerror(errno) << std::endl;
+		}
+		return;
+	}
+
+	for (char* p = buffer; p < buffer + len; ) {
+		const struct inotify_event*	event = reinterpret_cast<const struct inotify_event*>(p);
+		p += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			// Events were lost, so check everything
+			std::vector<std::string>	paths;
+			try {
+				list_key_map_files(paths);
+			} catch (const Config_error& e) {
+				std::clog << "Key map watcher: " << e.message << std::endl;
+			}
+			changed_paths.insert(paths.begin(), paths.end());
+			continue;
+		}
+		if (event->len == 0) {
+			continue;
+		}
+		std::string				name(event->name);
+		std::map<int, std::string>::const_iterator	dir(drop_in_dirs.find(event->wd));
+		if (dir != drop_in_dirs.end() && name[0] != '.' && name[name.size() - 1] != '~') {
+			changed_paths.insert(dir->second + "/" + name);
+		}
+		dir = file_dirs.find(event->wd);
+		if (dir != file_dirs.end()) {
+			std::map<std::string, std::string>::const_iterator	file(watched_files.find(dir->second + "/" + name));
+			if (file != watched_files.end()) {
+				changed_paths.insert(file->second);
+			}
+		}
+	}
+}
+#else
+void	Key_map_watcher::start ()
+{
+	// Config::validate rejects watch-key-map, so this isn't reached
+	throw Config_error("Watching the key map is only supported on Linux");
+}
+#endif
+
+// Get the key map files, in the order their lines apply
+void	Key_map_watcher::list_key_map_files (std::vector<std::string>& paths) const
+{
+	paths.clear();
+	for (size_t i = 0; i < config.key_map_sources.size(); ++i) {
+		if (config.key_map_sources[i].second) {
+			std::vector<std::string>	dir_paths;
+			list_directory(config.key_map_sources[i].first, dir_paths);
+			paths.insert(paths.end(), dir_paths.begin(), dir_paths.end());
+		} else {
+			paths.push_back(config.key_map_sources[i].first);
+		}
+	}
+}
+
+void	Key_map_watcher::apply (const std::set<std::string>& changed_paths, double first_change_time)
+{
+	std::vector<std::string>	paths;
+	try {
+		list_key_map_files(paths);
+	} catch (const Config_error& e) {
+		std::clog << "Key map update failed: " << e.message << std::endl;
+		return;
+	}
+
+	// Reparse the changed files, and find the entries whose lines changed
+	Lines_by_name::mapped_type	no_lines;
+	Lines_by_name			new_lines;
+	std::set<std::string>		changed_names;
+	for (std::set<std::string>::const_iterator path(changed_paths.begin()); path != changed_paths.end(); ++path) {
+		std::vector<Key_map_line>&	lines = new_lines[*path];
+		std::ifstream			in(path->c_str());
+		if (in && std::find(paths.begin(), paths.end(), *path) != paths.end()) {
+			parse_key_map(lines, in);
+		}
+		Lines_by_name::const_iterator	old_lines(config.key_map_lines.find(*path));
+		diff_lines(old_lines != config.key_map_lines.end() ? old_lines->second : no_lines, lines, changed_names);
+	}
+	if (changed_names.empty()) {
+		return;
+	}
+	bool				patterns_changed = false;
+	for (std::set<std::string>::const_iterator name(changed_names.begin()); name != changed_names.end(); ++name) {
+		patterns_changed |= is_pattern_name(*name);
+	}
+
+	// Load the changed entries from all their lines (from every file, in order).  Patterns
+	// are loaded together when any of them change, since their order matters.
+	std::vector<Key_map_line>	changed_lines;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		Lines_by_name::const_iterator	lines(new_lines.find(paths[i]));
+		if (lines == new_lines.end()) {
+			lines = config.key_map_lines.find(paths[i]);
+			if (lines == config.key_map_lines.end()) {
+				continue;
+			}
+		}
+		for (size_t j = 0; j < lines->second.size(); ++j) {
+			const std::string	name(canonical_name(lines->second[j].address));
+			if (changed_names.count(name) || (patterns_changed && is_pattern_name(name))) {
+				changed_lines.push_back(lines->second[j]);
+			}
+		}
+	}
+	Key_map				changed_keys;
+	try {
+		load_key_map(changed_keys, changed_lines);
+	} catch (const Config_error& e) {
+		// Leave the old lines in place, so the entries are retried when the files next change
+		std::clog << "Key map update failed: " << e.message << std::endl;
+		return;
+	}
+
+	// Apply them all at once.  The old entries are freed after unlocking.
+	pthread_rwlock_wrlock(&lock);
+	for (std::set<std::string>::const_iterator name(changed_names.begin()); name != changed_names.end(); ++name) {
+		if (is_pattern_name(*name)) {
+			continue;
+		} else if (changed_keys.find(*name)) {
+			config.keys[*name].swap(changed_keys[*name]);
+		} else {
+			config.keys.erase(*name);
+		}
+	}
+	if (patterns_changed) {
+		config.keys.swap_patterns(changed_keys);
+	}
+	const size_t			num_entries = config.keys.size();
+	pthread_rwlock_unlock(&lock);
+
+	for (Lines_by_name::iterator it(new_lines.begin()); it != new_lines.end(); ++it) {
+		if (it->second.empty() && std::find(paths.begin(), paths.end(), it->first) == paths.end()) {
+			config.key_map_lines.erase(it->first);
+		} else {
+			config.key_map_lines[it->first].swap(it->second);
+		}
+	}
+
+	const double			latency = now() - first_change_time;
+	std::clog << "Key map updated: " << changed_names.size() << " entries changed, " << num_entries
+		<< " entries, applied " << latency << "s after the change" << std::endl;
+}
+
+void	Key_map_watcher::Read_lock::lock ()
+{
+	if (watcher && !is_locked) {
+		pthread_rwlock_rdlock(&watcher->lock);
+		is_locked = true;
+	}
+}
+
+void	Key_map_watcher::Read_lock::unlock ()
+{
+	if (is_locked) {
+		pthread_rwlock_unlock(&watcher->lock);
+		is_locked = false;
+	}
+}
+
+Key_ref	Key_map_watcher::get_key (const std::string& sender_address) const
+{
+	return batv::get_key(config.keys, sender_address);
+}
+
+bool	Key_map_watcher::may_have_key (const std::string& domain) const
+{
+	pthread_rwlock_rdlock(&lock);
+	bool			result = config.keys.may_have_key(domain);
+	pthread_rwlock_unlock(&lock);
+	return result;
+}
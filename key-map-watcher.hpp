@@ -0,0 +1,93 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include "key.hpp"
+#include "config.hpp"
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+namespace batv {
+	// Watches a Config's key map files and drop-in directories with inotify, and
+	// applies changed entries to its key map in place, without reloading the rest.
+	// Each batch of changes is applied under a write lock, so lookups never see part
+	// of one.  The watching thread runs until the process exits.
+	class Key_map_watcher {
+		Config&					config;
+		mutable pthread_rwlock_t		lock;		// held for writing while applying a batch
+		int					inotify_fd;
+		std::map<int, std::string>		drop_in_dirs;	// inotify watch descriptor -> drop-in directory
+		std::map<int, std::string>		file_dirs;	// inotify watch descriptor -> directory of key map files
+		std::map<std::string, std::string>	watched_files;	// directory/name -> key map file path, as configured
+
+		static void*		thread_main (void*);
+		void			run ();
+		void			read_events (std::set<std::string>& changed_paths);
+		void			apply (const std::set<std::string>& changed_paths, double first_change_time);
+		void			list_key_map_files (std::vector<std::string>&) const;
+
+		Key_map_watcher (const Key_map_watcher&);
+		Key_map_watcher& operator= (const Key_map_watcher&);
+	public:
+		// config.key_map_lines must hold the lines from which config.keys was loaded
+		explicit Key_map_watcher (Config& config);
+
+		// Start watching, in a new thread.  Throws Config_error if unable to.
+		void			start ();
+
+		// Holds a watcher's read lock (if watcher isn't NULL) while locked, which it is
+		// from construction until unlock() or destruction.  A thread must not hold more
+		// than one, or call may_have_key while holding one.
+		class Read_lock {
+			const Key_map_watcher*	watcher;
+			bool			is_locked;
+
+			Read_lock (const Read_lock&);
+			Read_lock& operator= (const Read_lock&);
+		public:
+			explicit Read_lock (const Key_map_watcher* w) : watcher(w), is_locked(false) { lock(); }
+			~Read_lock () { unlock(); }
+
+			void		lock ();
+			void		unlock ();
+		};
+
+		// Get the keys for the given sender (see Config::get_key).  Must be called with
+		// a Read_lock locked, and the reference is only valid until it's unlocked, unless
+		// it's pinned.
+		Key_ref			get_key (const std::string& sender_address) const;
+		// See Key_map::may_have_key
+		bool			may_have_key (const std::string& domain) const;
+	};
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "key-provider.hpp"
+#include "common.hpp"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace batv;
+
+namespace {
+	const double		retry_interval = 1.0;	// after a failed request, wait this long before making another for the sender
+	const size_t		max_response_len = 4096;
+
+	// Parse the keys of an OK response: KEY [SP KEY...], where KEY is [GENERATION:]INLINE-KEY
+	bool parse_keys (const char* p, Key_entry& keys)
+	{
+		bool			found_key = false;
+		while (*p) {
+			const char*	end = std::strchr(p, ' ');
+			if (!end) {
+				end = p + std::strlen(p);
+			}
+			unsigned int	generation = 0;
+			if (p[0] >= '0' && p[0] <= '9' && p[1] == ':') {
+				generation = p[0] - '0';
+				p += 2;
+			}
+			Key		key;
+			if (!decode_inline_key(std::string(p, end), key) || key.empty()) {
+				return false;
+			}
+			keys.generations[generation] = Shared_key(key);
+			keys.current = generation;
+			found_key = true;
+			p = *end ? end + 1 : end;
+		}
+		return found_key;
+	}
+}
+
+Socket_key_provider::Socket_key_provider (const std::string& arg_socket_path, unsigned int arg_timeout_ms)
+: socket_path(arg_socket_path), timeout_ms(arg_timeout_ms)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+Socket_key_provider::~Socket_key_provider ()
+{
+	for (size_t i = 0; i < idle_fds.size(); ++i) {
+		close(idle_fds[i]);
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+int	Socket_key_provider::connect ()
+{
+	struct sockaddr_un	addr;
+	if (socket_path.size() >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	std::memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	std::strcpy(addr.sun_path, socket_path.c_str());
+
+	int			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	// Bound the time spent connecting and sending, in case the provider stops accepting
+	struct timeval		timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Send a request and read its response line (sans newline), waiting at most timeout_ms for it
+bool	Socket_key_provider::request (int fd, const std::string& sender_address, std::string& response)
+{
+	std::string		request(sender_address);
+	request.push_back('\n');
+	const char*		p = request.data();
+	size_t			len = request.size();
+	while (len > 0) {
+		ssize_t		bytes_written = send(fd, p, len, MSG_NOSIGNAL);
+		if (bytes_written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += bytes_written;
+		len -= bytes_written;
+	}
+
+	const double		deadline = now() + timeout_ms / 1000.0;
+	std::string::size_type	newline_pos;
+	response.clear();
+	while ((newline_pos = response.find('\n')) == std::string::npos) {
+		int		remaining_ms = static_cast<int>((deadline - now()) * 1000);
+		struct pollfd	pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int		ready = remaining_ms > 0 ? poll(&pfd, 1, remaining_ms) : 0;
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			return false;
+		}
+		char		buffer[1024];
+		ssize_t		bytes_read = recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0 || response.size() + bytes_read > max_response_len) {
+			return false;
+		}
+		response.append(buffer, bytes_read);
+	}
+	// Only one request is outstanding at a time, so anything after the response is a protocol error
+	if (newline_pos + 1 != response.size()) {
+		return false;
+	}
+	response.erase(newline_pos);
+	return true;
+}
+
+Key_provider::Result	Socket_key_provider::fetch (const std::string& sender_address, Key_entry& keys, unsigned int& ttl)
+{
+	if (sender_address.find('\n') != std::string::npos) {
+		ttl = 0;
+		return NOT_FOUND;
+	}
+
+	// Reuse an idle connection, skipping any the provider has closed (they're readable)
+	int			fd = -1;
+	pthread_mutex_lock(&mutex);
+	while (fd == -1 && !idle_fds.empty()) {
+		fd = idle_fds.back();
+		idle_fds.pop_back();
+		struct pollfd	pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	if (fd == -1 && (fd = connect()) == -1) {
+		return FAILED;
+	}
+
+	std::string		response;
+	Result			result = FAILED;
+	bool			is_well_formed = request(fd, sender_address, response);
+	if (is_well_formed) {
+		char*		ttl_end;
+		if (response.compare(0, 3, "OK ") == 0) {
+			ttl = std::strtoul(response.c_str() + 3, &ttl_end, 10);
+			is_well_formed = ttl_end != response.c_str() + 3 && *ttl_end == ' ' && parse_keys(ttl_end + 1, keys);
+			result = FOUND;
+		} else if (response.compare(0, 5, "NONE ") == 0) {
+			ttl = std::strtoul(response.c_str() + 5, &ttl_end, 10);
+			is_well_formed = ttl_end != response.c_str() + 5 && *ttl_end == '\0';
+			result = NOT_FOUND;
+		} else {
+			is_well_formed = response.compare(0, 5, "ERROR") == 0 && (response.size() == 5 || response[5] == ' ');
+			result = FAILED;
+		}
+	}
+
+	if (is_well_formed) {
+		pthread_mutex_lock(&mutex);
+		idle_fds.push_back(fd);
+		pthread_mutex_unlock(&mutex);
+		return result;
+	}
+	close(fd);
+	return FAILED;
+}
+
+Key_cache::Key_cache (Key_provider& arg_provider, size_t arg_max_entries, unsigned int arg_max_stale)
+: provider(arg_provider), max_entries(arg_max_entries), max_stale(arg_max_stale)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&fetch_done, NULL);
+	pthread_cond_init(&prefetch_wanted, NULL);
+	is_prefetching = false;
+	is_failing = false;
+}
+
+// Get the entry for a sender, creating it if necessary, and mark it most recently
+// used.  Evicts the least recently used entries if there are too many, except those
+// with requests in progress (which their requesters are using).  Called with mutex held.
+Key_cache::Entry*	Key_cache::get_entry (const std::string& sender_address)
+{
+	Entry_map::iterator	it(entries.find(sender_address));
+	if (it != entries.end()) {
+		lru.splice(lru.begin(), lru, it->second->lru_pos);
+		return it->second;
+	}
+
+	Entry*			entry = new Entry;
+	entry->map_pos = entries.insert(std::make_pair(sender_address, entry)).first;
+	lru.push_front(entry);
+	entry->lru_pos = lru.begin();
+	entry->is_valid = false;
+	entry->is_fetching = false;
+	entry->refresh_time = 0;
+	entry->expire_time = 0;
+
+	Entry_list::iterator	pos(lru.end());
+	while (entries.size() > max_entries && pos != lru.begin()) {
+		Entry*		evicted = *--pos;
+		if (evicted->is_fetching || evicted == entry) {
+			continue;
+		}
+		entries.erase(evicted->map_pos);
+		pos = lru.erase(pos);
+		delete evicted;
+	}
+	return entry;
+}
+
+// Can the entry's answer be used at time t?  Expired answers can be, until they're too stale.
+bool	Key_cache::is_usable (const Entry* entry, double t) const
+{
+	return entry->is_valid && t < entry->expire_time + max_stale;
+}
+
+// Request an entry's keys from the provider, with the mutex released meanwhile.  The
+// entry must be marked is_fetching.  Returns false if the request failed.
+bool	Key_cache::fetch (Entry* entry)
+{
+	const std::string	sender_address(entry->map_pos->first);
+	pthread_mutex_unlock(&mutex);
+	Key_entry		keys;
+	unsigned int		ttl = 0;
+	Key_provider::Result	result = provider.fetch(sender_address, keys, ttl);
+	pthread_mutex_lock(&mutex);
+
+	const double		t = now();
+	if (result == Key_provider::FAILED) {
+		entry->refresh_time = t + retry_interval;
+		if (!is_failing) {
+			std::clog << "Key provider request failed; using cached keys until it recovers" << std::endl;
+			is_failing = true;
+		}
+	} else {
+		entry->keys = result == Key_provider::FOUND ? Key_ref(&keys).pin() : Key_ref();
+		entry->is_valid = true;
+		entry->expire_time = t + ttl;
+		entry->refresh_time = t + ttl * 0.75;
+		if (is_failing) {
+			std::clog << "Key provider recovered" << std::endl;
+			is_failing = false;
+		}
+	}
+	entry->is_fetching = false;
+	pthread_cond_broadcast(&fetch_done);
+	return result != Key_provider::FAILED;
+}
+
+bool	Key_cache::get_key (const std::string& sender_address, Key_ref& keys)
+{
+	pthread_mutex_lock(&mutex);
+	Entry*			entry = get_entry(sender_address);
+	double			t = now();
+
+	// If another lookup is requesting this sender's keys and there's nothing to use meanwhile, wait for its answer
+	if (entry->is_fetching && !is_usable(entry, t)) {
+		do {
+			pthread_cond_wait(&fetch_done, &mutex);
+			entry = get_entry(sender_address);
+			t = now();
+		} while (entry->is_fetching && !is_usable(entry, t));
+	}
+
+	if (t >= entry->refresh_time && !entry->is_fetching) {
+		entry->is_fetching = true;
+		if (is_usable(entry, t) && is_prefetching) {
+			// Due for a refresh, or expired: keep using the answer we have, and refresh it in the background
+			prefetch_queue.push_back(entry);
+			pthread_cond_signal(&prefetch_wanted);
+		} else {
+			// Nothing to use (unless a request just failed): request the keys ourselves
+			fetch(entry);
+			t = now();
+		}
+	}
+
+	// Use the answer, even if expired (the provider failed or is slow to refresh it), as long as it isn't too stale
+	bool			ok = is_usable(entry, t);
+	if (ok) {
+		keys = entry->keys;
+	}
+	pthread_mutex_unlock(&mutex);
+	return ok;
+}
+
+void	Key_cache::start ()
+{
+	start_background_thread(thread_main, this);
+
+	pthread_mutex_lock(&mutex);
+	is_prefetching = true;
+	pthread_mutex_unlock(&mutex);
+}
+
+void*	Key_cache::thread_main (void* arg)
+{
+	static_cast<Key_cache*>(arg)->run();
+	return NULL;
+}
+
+void	Key_cache::run ()
+{
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (prefetch_queue.empty()) {
+			pthread_cond_wait(&prefetch_wanted, &mutex);
+		}
+		Entry*		entry = prefetch_queue.front();
+		prefetch_queue.pop_front();
+		fetch(entry);
+	}
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include "key.hpp"
+#include <pthread.h>
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <string>
+
+namespace batv {
+	// A source of senders' keys other than the key map, such as a secrets service
+	class Key_provider {
+	public:
+		enum Result {
+			FOUND,			// keys holds the sender's keys
+			NOT_FOUND,		// the sender doesn't use BATV
+			FAILED			// the provider couldn't be reached, or couldn't answer
+		};
+
+		virtual ~Key_provider () { }
+
+		// Fetch a sender's keys, and for how many seconds the answer may be cached
+		virtual Result		fetch (const std::string& sender_address, Key_entry& keys, unsigned int& ttl) = 0;
+	};
+
+	// Fetches keys from a key provider listening on a UNIX domain socket.  Each request
+	// is one line containing the sender's address, and each response is one line:
+	//   OK SP TTL SP KEY [SP KEY...]		the sender's keys
+	//   NONE SP TTL				the sender doesn't use BATV
+	//   ERROR [SP MESSAGE]				the provider is unable to answer
+	// where TTL is in seconds, and each KEY is [GENERATION:]hex:HEX or [GENERATION:]base64:BASE64
+	// (the last KEY being the current generation).  Connections are kept open for reuse.
+	class Socket_key_provider : public Key_provider {
+		std::string		socket_path;
+		unsigned int		timeout_ms;	// for connecting, and for each response
+		pthread_mutex_t		mutex;		// protects idle_fds
+		std::vector<int>	idle_fds;	// connections not in use
+
+		int			connect ();
+		bool			request (int fd, const std::string& sender_address, std::string& response);
+
+		Socket_key_provider (const Socket_key_provider&);
+		Socket_key_provider& operator= (const Socket_key_provider&);
+	public:
+		Socket_key_provider (const std::string& socket_path, unsigned int timeout_ms);
+		~Socket_key_provider ();
+
+		virtual Result		fetch (const std::string& sender_address, Key_entry& keys, unsigned int& ttl);
+	};
+
+	// Caches the answers of a Key_provider for their TTLs:
+	//  - Answers are refreshed in the background when 3/4 of their TTL has passed,
+	//    so that senders in steady use never wait for the provider.
+	//  - Concurrent lookups of a sender who isn't cached share one request.
+	//  - If the provider fails or is slow to refresh an answer, the expired answer
+	//    is used (for at most max_stale seconds) instead of failing the lookup.
+	class Key_cache {
+		struct Entry;
+		typedef std::map<std::string, Entry*>	Entry_map;
+		typedef std::list<Entry*>		Entry_list;
+
+		struct Entry {
+			Entry_map::iterator	map_pos;
+			Entry_list::iterator	lru_pos;
+			Key_ref			keys;		// NULL if the sender doesn't use BATV
+			bool			is_valid;	// false until an answer is received
+			bool			is_fetching;	// a request for this sender is in progress
+			double			refresh_time;	// when to refresh (or, after a failed request, retry)
+			double			expire_time;
+		};
+
+		Key_provider&		provider;
+		size_t			max_entries;
+		double			max_stale;
+		pthread_mutex_t		mutex;
+		pthread_cond_t		fetch_done;		// broadcast when a request finishes
+		pthread_cond_t		prefetch_wanted;	// signalled when prefetch_queue is added to
+		Entry_map		entries;
+		Entry_list		lru;			// most recently used first
+		std::deque<Entry*>	prefetch_queue;		// entries marked is_fetching
+		bool			is_prefetching;		// has the prefetching thread been started?
+		bool			is_failing;		// did the last request fail?  (for logging)
+
+		Entry*			get_entry (const std::string& sender_address);
+		bool			is_usable (const Entry*, double t) const;
+		bool			fetch (Entry*);
+		static void*		thread_main (void*);
+		void			run ();
+
+		Key_cache (const Key_cache&);
+		Key_cache& operator= (const Key_cache&);
+	public:
+		Key_cache (Key_provider& provider, size_t max_entries, unsigned int max_stale);
+
+		// Start refreshing answers in the background, in a new thread which runs
+		// until the process exits.  Throws Config_error if unable to.
+		void			start ();
+
+		// Get the keys for the given sender (NULL if the sender doesn't use BATV).
+		// Returns false if the provider failed and there was no answer to fall back on.
+		bool			get_key (const std::string& sender_address, Key_ref& keys);
+	};
+}
@@ -30,22 +30,275 @@
 
 #include "key.hpp"
 #include "common.hpp"
+#include "sha1.hpp"
+#include "parallel.hpp"
+#include "hash.hpp"
 #include <fstream>
+#include <iterator>
 #include <limits>
+#include <algorithm>
+#include <list>
+#include <cstring>
+#include <map>
+#include <cctype>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
 
 using namespace batv;
 
+namespace {
+	typedef std::pair<unsigned long, std::string>	Derived_key_id;		// master keys' serial, domain or address
+	typedef std::map<Derived_key_id, Derived_key*>	Derived_key_map;
+	typedef std::list<Derived_key*>			Derived_key_list;
+
+	// Cache of derived keys, with the most recently used at the front of the list
+	pthread_mutex_t			derived_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+	Derived_key_map			derived_keys;
+	Derived_key_list		derived_keys_lru;
+	size_t				max_derived_keys = 10000;
+
+	unsigned long			next_serial = 0;
+
+	const size_t			derived_key_len = 32;
+}
+
+struct batv::Derived_key {
+	Key_entry			entry;
+	int				refs;		// including the cache's reference, if cached
+	Derived_key_map::iterator	map_pos;
+	Derived_key_list::iterator	lru_pos;
+
+	void				ref () { __sync_add_and_fetch(&refs, 1); }
+	void				unref () { if (__sync_sub_and_fetch(&refs, 1) == 0) delete this; }
+};
+
+batv::Key_ref::Key_ref (Derived_key* d) : entry(&d->entry), derived(d)
+{
+}
+
+batv::Key_ref::Key_ref (const Key_ref& other) : entry(other.entry), derived(other.derived)
+{
+	if (derived) {
+		derived->ref();
+	}
+}
+
+batv::Key_ref& batv::Key_ref::operator= (const Key_ref& other)
+{
+	if (other.derived) {
+		other.derived->ref();
+	}
+	release();
+	entry = other.entry;
+	derived = other.derived;
+	return *this;
+}
+
+void	batv::Key_ref::release ()
+{
+	if (derived) {
+		derived->unref();
+	}
+	entry = NULL;
+	derived = NULL;
+}
+
+batv::Key_ref	batv::Key_ref::pin () const
+{
+	if (derived || !entry) {
+		return *this;
+	}
+	Derived_key*	copy = new Derived_key;
+	copy->entry = *entry;
+	copy->refs = 1;
+	return Key_ref(copy);
+}
+
+batv::Shared_key::Shared_key (const Key& key) : rep(new Rep)
+{
+	rep->key = key;
+	rep->refs = 1;
+}
+
+batv::Shared_key::Shared_key (const Shared_key& other) : rep(other.rep)
+{
+	if (rep) {
+		__sync_add_and_fetch(&rep->refs, 1);
+	}
+}
+
+batv::Shared_key& batv::Shared_key::operator= (const Shared_key& other)
+{
+	if (other.rep) {
+		__sync_add_and_fetch(&other.rep->refs, 1);
+	}
+	release();
+	rep = other.rep;
+	return *this;
+}
+
+void	batv::Shared_key::release ()
+{
+	if (rep && __sync_sub_and_fetch(&rep->refs, 1) == 0) {
+		delete rep;
+	}
+	rep = NULL;
+}
+
+bool	batv::Key_entry::empty () const
+{
+	for (unsigned int i = 0; i < MAX_GENERATIONS; ++i) {
+		if (!generations[i].empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const batv::Key&	batv::Shared_key::get () const
+{
+	static const Key	empty_key;
+	return rep ? rep->key : empty_key;
+}
+
 void	batv::load_key (Key& key, std::istream& key_file_in)
 {
-	key.clear();
-	while (key_file_in.good() && key_file_in.peek() != -1) {
-		char	ch;
-		key_file_in.get(ch);
-		key.push_back(ch);
+	key.assign(std::istreambuf_iterator<char>(key_file_in), std::istreambuf_iterator<char>());
+}
+
+void	batv::load_key (Key_entry& key, std::istream& key_file_in)
+{
+	Key_entry	new_key;
+	Key		key_bytes;
+	load_key(key_bytes, key_file_in);
+	new_key.generations[0] = Shared_key(key_bytes);
+	key.swap(new_key);
+}
+
+void	batv::Key_entry::swap (Key_entry& other)
+{
+	for (unsigned int i = 0; i < MAX_GENERATIONS; ++i) {
+		generations[i].swap(other.generations[i]);
+	}
+	std::swap(current, other.current);
+	std::swap(derivation, other.derivation);
+	std::swap(serial, other.serial);
+}
+
+bool	batv::Key_map_line::operator== (const Key_map_line& other) const
+{
+	return address == other.address && generation == other.generation &&
+		derivation == other.derivation && key_spec == other.key_spec;
+}
+
+namespace {
+	struct Key_file_reads {
+		std::vector<std::string>	paths;
+		std::vector<Key>		keys;
+		std::vector<int>		errors;		// errno, or 0 on success
+	};
+
+	// Read an entire key file with as few reads as possible
+	void read_key_file (size_t index, void* arg)
+	{
+		Key_file_reads&		reads = *static_cast<Key_file_reads*>(arg);
+		Key&			key = reads.keys[index];
+		int			fd = open(reads.paths[index].c_str(), O_RDONLY);
+		if (fd == -1) {
+			reads.errors[index] = errno;
+			return;
+		}
+		struct stat		st;
+		size_t			len = 0;
+		key.resize(fstat(fd, &st) == 0 && st.st_size > 0 ? st.st_size + 1 : 4096);
+		while (true) {
+			if (len == key.size()) {
+				key.resize(key.size() * 2);
+			}
+			ssize_t		bytes_read = read(fd, &key[len], key.size() - len);
+			if (bytes_read == -1 && errno == EINTR) {
+				continue;
+			}
+			if (bytes_read == -1) {
+				reads.errors[index] = errno;
+				break;
+			}
+			if (bytes_read == 0) {
+				break;
+			}
+			len += bytes_read;
+		}
+		key.resize(len);
+		close(fd);
+	}
+
+	int hex_digit_value (char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	bool decode_hex (const std::string& hex, Key& key)
+	{
+		if (hex.size() % 2) {
+			return false;
+		}
+		key.resize(hex.size() / 2);
+		for (size_t i = 0; i < key.size(); ++i) {
+			int		high = hex_digit_value(hex[i * 2]);
+			int		low = hex_digit_value(hex[i * 2 + 1]);
+			if (high == -1 || low == -1) {
+				return false;
+			}
+			key[i] = high * 16 + low;
+		}
+		return true;
+	}
+
+	bool decode_base64 (const std::string& base64, Key& key)
+	{
+		static const char	alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		unsigned long		bits = 0;
+		unsigned int		num_bits = 0;
+		size_t			len = base64.size();
+		while (len > 0 && base64[len - 1] == '=') {
+			--len;
+		}
+		key.clear();
+		for (size_t i = 0; i < len; ++i) {
+			const char*	p = std::strchr(alphabet, base64[i]);
+			if (!p || !*p) {
+				return false;
+			}
+			bits = (bits << 6) | (p - alphabet);
+			num_bits += 6;
+			if (num_bits >= 8) {
+				num_bits -= 8;
+				key.push_back((bits >> num_bits) & 0xFF);
+			}
+		}
+		return true;
 	}
 }
 
-void	batv::load_key_map (Key_map& key_map, std::istream& in)
+bool	batv::decode_inline_key (const std::string& key_spec, Key& key)
+{
+	if (key_spec.compare(0, 4, "hex:") == 0) {
+		return decode_hex(key_spec.substr(4), key);
+	} else if (key_spec.compare(0, 7, "base64:") == 0) {
+		return decode_base64(key_spec.substr(7), key);
+	}
+	return false;
+}
+
+void	batv::parse_key_map (std::vector<Key_map_line>& lines, std::istream& in)
 {
 	while (in.good() && in.peek() != -1) {
 		// Skip comments (lines starting with #) and blank lines
@@ -54,45 +307,625 @@ void	batv::load_key_map (Key_map& key_map, std::istream& in)
 			continue;
 		}
 
+		Key_map_line		line;
+
 		// read address/domain
-		std::string		address;
-		in >> address;
+		in >> line.address;
 
 		// skip whitespace
 		in >> std::ws;
 
-		// read key file path
-		std::string		key_file_path;
-		std::getline(in, key_file_path);
+		// read key spec, optionally preceded by "N:" giving the key's generation,
+		// then by "hkdf-domain:" or "hkdf-address:" if it's a master key
+		std::getline(in, line.key_spec);
+		line.generation = 0;
+		if (line.key_spec.size() >= 2 && line.key_spec[0] >= '0' && line.key_spec[0] <= '9' && line.key_spec[1] == ':') {
+			line.generation = line.key_spec[0] - '0';
+			line.key_spec.erase(0, 2);
+		}
+		line.derivation = Key_entry::DERIVE_NONE;
+		if (line.key_spec.compare(0, 12, "hkdf-domain:") == 0) {
+			line.derivation = Key_entry::DERIVE_DOMAIN;
+			line.key_spec.erase(0, 12);
+		} else if (line.key_spec.compare(0, 13, "hkdf-address:") == 0) {
+			line.derivation = Key_entry::DERIVE_ADDRESS;
+			line.key_spec.erase(0, 13);
+		}
+		lines.push_back(line);
+	}
+}
+
+void	batv::load_key_map (Key_map& key_map, std::istream& in, Key_map_stats* stats)
+{
+	const double			start_time = now();
+	std::vector<Key_map_line>	lines;
+	parse_key_map(lines, in);
+	load_key_map(key_map, lines, stats);
+	if (stats) {
+		stats->seconds = now() - start_time;
+	}
+}
+
+void	batv::load_key_map (Key_map& key_map, const std::vector<Key_map_line>& lines, Key_map_stats* stats)
+{
+	const double			start_time = now();
+	Key_file_reads			reads;
+	std::vector<size_t>		key_files(lines.size());	// [line] -> index into reads.paths, if a file
+	std::map<std::string, size_t>	key_file_indices;
+	Key_map_stats			new_stats;
 
-		// Load the keyfile 
-		std::ifstream		key_file_in(key_file_path.c_str());
-		if (!key_file_in) {
-			throw Config_error("Unable to open key file " + key_file_path);
+	// Note the distinct key files
+	for (size_t i = 0; i < lines.size(); ++i) {
+		const Key_map_line&	line = lines[i];
+		if (line.key_spec.compare(0, 4, "hex:") == 0 || line.key_spec.compare(0, 7, "base64:") == 0) {
+			++new_stats.num_inline_keys;
+		} else {
+			std::map<std::string, size_t>::iterator	it(key_file_indices.find(line.key_spec));
+			if (it == key_file_indices.end()) {
+				it = key_file_indices.insert(std::make_pair(line.key_spec, reads.paths.size())).first;
+				reads.paths.push_back(line.key_spec);
+			}
+			key_files[i] = it->second;
 		}
-		load_key(key_map[address], key_file_in);
+	}
+
+	// Read the key files in parallel, since they may be on slow storage
+	reads.keys.resize(reads.paths.size());
+	reads.errors.resize(reads.paths.size());
+	parallel_for(reads.paths.size(), std::min<size_t>(reads.paths.size(), 16), read_key_file, &reads);
+	new_stats.num_key_files = reads.paths.size();
+
+	// Then add the entries, sharing identical keys.  The last generation listed for an address is the current one.
+	std::map<Key, Shared_key>	interned_keys;
+	for (size_t i = 0; i < lines.size(); ++i) {
+		const Key_map_line&	line = lines[i];
+		Key			key;
+		if (line.key_spec.compare(0, 4, "hex:") == 0) {
+			if (!decode_hex(line.key_spec.substr(4), key)) {
+				throw Config_error("Invalid hex key for key map entry " + line.address);
+			}
+		} else if (line.key_spec.compare(0, 7, "base64:") == 0) {
+			if (!decode_base64(line.key_spec.substr(7), key)) {
+				throw Config_error("Invalid base64 key for key map entry " + line.address);
+			}
+		} else if (reads.errors[key_files[i]]) {
+			throw Config_error("Unable to open key file " + line.key_spec + ": " + strerror(reads.errors[key_files[i]]));
+		} else {
+			key = reads.keys[key_files[i]];
+		}
+
+		const bool		is_new_entry = key_map.find(line.address) == NULL;
+		Key_entry&		entry = key_map[line.address];
+		if (!is_new_entry && entry.derivation != line.derivation) {
+			throw Config_error("Key map entry " + line.address + " mixes derived and non-derived keys");
+		}
+		entry.derivation = line.derivation;
+		entry.current = line.generation;
+
+		if (line.derivation != Key_entry::DERIVE_NONE) {
+			// Only the HKDF pseudorandom key is needed to derive keys, so store it instead of the master key
+			if (!key.empty()) {
+				unsigned char	prk[20];
+				hkdf_sha1_extract(prk, NULL, 0, &key[0], key.size());
+				key.assign(prk, prk + sizeof(prk));
+			}
+			entry.serial = __sync_add_and_fetch(&next_serial, 1);
+		}
+
+		std::map<Key, Shared_key>::iterator	it(interned_keys.find(key));
+		if (it == interned_keys.end()) {
+			it = interned_keys.insert(std::make_pair(key, Shared_key(key))).first;
+			new_stats.key_bytes += key.size();
+		} else {
+			new_stats.key_bytes_saved += key.size();
+		}
+		entry.generations[line.generation] = it->second;
+	}
+	key_map.compile();
+
+	new_stats.num_entries = lines.size();
+	new_stats.filter_bytes = key_map.filter().size_bytes();
+	new_stats.filter_fp_rate = key_map.filter().false_positive_rate();
+	new_stats.seconds = now() - start_time;
+	if (stats) {
+		*stats = new_stats;
 	}
 }
 
-const Key* batv::get_key (const Key_map& keys, const std::string& sender_address, const Key* default_key)
+std::ostream&	batv::operator<< (std::ostream& out, const Key_map_stats& stats)
 {
-	Key_map::const_iterator		it;
+	return out << stats.num_entries << " entries, " << stats.num_key_files << " key files, "
+		<< stats.num_inline_keys << " inline keys, " << stats.key_bytes << " key bytes ("
+		<< stats.key_bytes_saved << " saved by sharing), loaded in " << stats.seconds << "s, "
+		<< stats.filter_bytes << " byte domain filter (" << stats.filter_fp_rate * 100 << "% false positives)";
+}
 
-	// Look up the address itself
-	it = keys.find(sender_address);
-	if (it != keys.end()) {
-		return !it->second.empty() ? &it->second : NULL;
+namespace {
+	// A string which a Key_map doesn't own: a query, or a string owned by a node
+	struct Label {
+		const char*	data;
+		size_t		len;
+
+		Label (const char* d, size_t l) : data(d), len(l) { }
+	};
+
+	inline unsigned char fold_case (char c)
+	{
+		return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
 	}
 
-	// Try looking up only the domain
-	std::string::size_type	at_sign_pos = sender_address.find('@');
-	if (at_sign_pos != std::string::npos) {
-		it = keys.find(sender_address.substr(at_sign_pos));
-		if (it != keys.end()) {
-			return !it->second.empty() ? &it->second : NULL;
+	// Domain labels compare case-insensitively
+	struct Label_iless {
+		bool operator() (const Label& a, const Label& b) const
+		{
+			size_t		len = std::min(a.len, b.len);
+			for (size_t i = 0; i < len; ++i) {
+				unsigned char	ca = fold_case(a.data[i]);
+				unsigned char	cb = fold_case(b.data[i]);
+				if (ca != cb) {
+					return ca < cb;
+				}
+			}
+			return a.len < b.len;
+		}
+	};
+
+	// Local parts compare exactly
+	struct Label_less {
+		bool operator() (const Label& a, const Label& b) const
+		{
+			int		cmp = std::memcmp(a.data, b.data, std::min(a.len, b.len));
+			return cmp != 0 ? cmp < 0 : a.len < b.len;
+		}
+	};
+
+	struct Address_entry {
+		std::string		local_part;
+		Key_entry		keys;
+	};
+}
+
+struct batv::Key_map::Node {
+	typedef std::map<Label, Node*, Label_iless>		Child_map;
+	typedef std::map<Label, Address_entry*, Label_less>	Address_map;
+
+	std::string		label;		// lower-cased (empty for the root)
+	Domain_table::Id	id;		// of the domain ending in this label (0 for the root)
+	Key_entry*		domain_keys;	// keys for "@domain" ("*" for the root), or NULL
+	Child_map		children;	// subdomains, by label
+	Address_map		addresses;	// addresses in this domain, by local part
+
+	Node () : id(0), domain_keys(NULL) { }
+	~Node ()
+	{
+		delete domain_keys;
+		for (Child_map::iterator it(children.begin()); it != children.end(); ++it) {
+			delete it->second;
+		}
+		for (Address_map::iterator it(addresses.begin()); it != addresses.end(); ++it) {
+			delete it->second;
 		}
 	}
+};
 
-	return default_key;
+namespace {
+	// Split an address, "@domain", or "*" into its local part and domain.
+	// Returns false for "*", which has neither.
+	bool split_address (const std::string& address, Label& local_part, Label& domain)
+	{
+		if (address == "*") {
+			return false;
+		}
+		std::string::size_type	at_sign_pos = address.rfind('@');
+		if (at_sign_pos == std::string::npos) {
+			local_part = Label(address.data(), address.size());
+			domain = Label(address.data() + address.size(), 0);
+		} else {
+			local_part = Label(address.data(), at_sign_pos);
+			domain = Label(address.data() + at_sign_pos + 1, address.size() - at_sign_pos - 1);
+		}
+		return true;
+	}
+
+	// Get the label of domain ending at end (exclusive), i.e. the one following the
+	// last dot before end, and move end to that dot (or the start of the domain)
+	Label previous_label (const Label& domain, size_t& end)
+	{
+		size_t		start = end;
+		while (start > 0 && domain.data[start - 1] != '.') {
+			--start;
+		}
+		Label		label(domain.data + start, end - start);
+		end = start > 0 ? start - 1 : 0;
+		return label;
+	}
+}
+
+batv::Key_map::Key_map () : root(new Node), num_entries(0), filter_fp_rate(0.01)
+{
+}
+
+batv::Key_map::~Key_map ()
+{
+	delete root;
+	for (size_t i = 0; i < pattern_keys.size(); ++i) {
+		delete pattern_keys[i];
+	}
+}
+
+batv::Key_entry&	batv::Key_map::operator[] (const std::string& address_or_domain)
+{
+	if (address_or_domain != "*" && Pattern_set::is_pattern(address_or_domain)) {
+		size_t		index = patterns.add(address_or_domain);
+		if (index == pattern_keys.size()) {
+			pattern_keys.push_back(new Key_entry);
+			++num_entries;
+		}
+		return *pattern_keys[index];
+	}
+
+	Label		local_part(NULL, 0);
+	Label		domain(NULL, 0);
+	Node*		node = root;
+	bool		is_address = split_address(address_or_domain, local_part, domain);
+
+	// Walk (creating as necessary) from the top-level domain down
+	for (size_t end = domain.len; is_address && domain.len > 0; ) {
+		Label			label(previous_label(domain, end));
+		Node::Child_map::iterator it(node->children.find(label));
+		if (it == node->children.end()) {
+			Node*		child = new Node;
+			child->label.assign(label.data, label.len);
+			for (size_t i = 0; i < child->label.size(); ++i) {
+				child->label[i] = fold_case(child->label[i]);
+			}
+			child->id = domains.intern(label.data, domain.data + domain.len - label.data);
+			if (child->id >= nodes_by_id.size()) {
+				nodes_by_id.resize(child->id + 1);
+			}
+			nodes_by_id[child->id] = child;
+			it = node->children.insert(std::make_pair(Label(child->label.data(), child->label.size()), child)).first;
+		}
+		node = it->second;
+		if (label.data == domain.data) {
+			break;
+		}
+	}
+
+	if (is_address && local_part.len > 0) {
+		Node::Address_map::iterator it(node->addresses.find(local_part));
+		if (it == node->addresses.end()) {
+			Address_entry*	entry = new Address_entry;
+			entry->local_part.assign(local_part.data, local_part.len);
+			it = node->addresses.insert(std::make_pair(Label(entry->local_part.data(), entry->local_part.size()), entry)).first;
+			++num_entries;
+			domain_filter.add(domain.data, domain.len);	// if sized, so it stays correct until rebuilt
+		}
+		return it->second->keys;
+	}
+
+	if (!node->domain_keys) {
+		node->domain_keys = new Key_entry;
+		++num_entries;
+		domain_filter.add(domain.data, domain.len);
+	}
+	return *node->domain_keys;
+}
+
+const batv::Key_entry*	batv::Key_map::find (const std::string& address_or_domain) const
+{
+	if (address_or_domain != "*" && Pattern_set::is_pattern(address_or_domain)) {
+		int		index = patterns.find(address_or_domain);
+		return index >= 0 ? pattern_keys[index] : NULL;
+	}
+
+	Label		local_part(NULL, 0);
+	Label		domain(NULL, 0);
+	const Node*	node = root;
+	bool		is_address = split_address(address_or_domain, local_part, domain);
+
+	for (size_t end = domain.len; is_address && domain.len > 0; ) {
+		Label			label(previous_label(domain, end));
+		Node::Child_map::const_iterator it(node->children.find(label));
+		if (it == node->children.end()) {
+			return NULL;
+		}
+		node = it->second;
+		if (label.data == domain.data) {
+			break;
+		}
+	}
+
+	if (is_address && local_part.len > 0) {
+		Node::Address_map::const_iterator it(node->addresses.find(local_part));
+		return it != node->addresses.end() ? &it->second->keys : NULL;
+	}
+	return node->domain_keys;
 }
 
+const batv::Key_entry*	batv::Key_map::lookup (const std::string& sender_address) const
+{
+	Label		local_part(NULL, 0);
+	Label		domain(NULL, 0);
+	const Node*	node = root;
+	const Key_entry* most_specific = root->domain_keys;
+	split_address(sender_address, local_part, domain);
+
+	// Find the top-level domain, then each subdomain down to the full domain, by hashing
+	// the domain from its end, remembering the most specific domain with keys
+	bool		is_full_domain = domain.len == 0;
+	uint64_t	hash = hash_start;
+	for (size_t end = domain.len; domain.len > 0; ) {
+		size_t			start = end;
+		while (start > 0 && domain.data[start - 1] != '.') {
+			--start;
+			hash = hash_byte(hash, domain.data[start]);
+		}
+		Domain_table::Id	id = domains.find(domain.data + start, domain.len - start, finish_hash(hash));
+		if (id == 0 || id >= nodes_by_id.size() || !nodes_by_id[id]) {
+			break;
+		}
+		node = nodes_by_id[id];
+		if (node->domain_keys) {
+			most_specific = node->domain_keys;
+		}
+		if (start == 0) {
+			is_full_domain = true;
+			break;
+		}
+		hash = hash_byte(hash, '.');
+		end = start - 1;
+	}
+
+	// An entry for the address itself beats any pattern, which beats any domain
+	if (is_full_domain && local_part.len > 0) {
+		Node::Address_map::const_iterator it(node->addresses.find(local_part));
+		if (it != node->addresses.end()) {
+			return &it->second->keys;
+		}
+	}
+	int		pattern = patterns.match(sender_address.data(), sender_address.size());
+	if (pattern >= 0) {
+		return pattern_keys[pattern];
+	}
+	return most_specific;
+}
+
+bool	batv::Key_map::erase (const std::string& address_or_domain)
+{
+	Label			local_part(NULL, 0);
+	Label			domain(NULL, 0);
+	std::vector<Node*>	path(1, root);	// from the root down to the entry's domain
+	bool			is_address = split_address(address_or_domain, local_part, domain);
+	for (size_t end = domain.len; is_address && domain.len > 0; ) {
+		Label			label(previous_label(domain, end));
+		Node::Child_map::iterator it(path.back()->children.find(label));
+		if (it == path.back()->children.end()) {
+			return false;
+		}
+		path.push_back(it->second);
+		if (label.data == domain.data) {
+			break;
+		}
+	}
+
+	Node*			node = path.back();
+	if (is_address && local_part.len > 0) {
+		Node::Address_map::iterator it(node->addresses.find(local_part));
+		if (it == node->addresses.end()) {
+			return false;
+		}
+		delete it->second;
+		node->addresses.erase(it);
+	} else if (node->domain_keys) {
+		delete node->domain_keys;
+		node->domain_keys = NULL;
+	} else {
+		return false;
+	}
+	--num_entries;
+
+	// Remove domains which no longer have any entries
+	while (path.size() > 1 && !node->domain_keys && node->children.empty() && node->addresses.empty()) {
+		path.pop_back();
+		path.back()->children.erase(Label(node->label.data(), node->label.size()));
+		nodes_by_id[node->id] = NULL;
+		delete node;
+		node = path.back();
+	}
+	return true;
+}
+
+void	batv::Key_map::compile ()
+{
+	patterns.compile();
+	build_filter();
+}
+
+namespace {
+	// Call fn(domain) for each domain under node (whose name is domain) with entries
+	template<class Fn> void for_each_domain (const Key_map::Node* node, std::string& domain, Fn& fn)
+	{
+		if (node->domain_keys || !node->addresses.empty()) {
+			fn(domain);
+		}
+		for (Key_map::Node::Child_map::const_iterator it(node->children.begin()); it != node->children.end(); ++it) {
+			const std::string&	label = it->second->label;
+			if (domain.empty()) {
+				domain = label;
+			} else {
+				domain.insert(0, label + ".");
+			}
+			for_each_domain(it->second, domain, fn);
+			domain.erase(0, domain.size() == label.size() ? label.size() : label.size() + 1);
+		}
+	}
+
+	struct Count_domains {
+		size_t		count;
+		Count_domains () : count(0) { }
+		void operator() (const std::string&) { ++count; }
+	};
+
+	struct Add_domain {
+		Bloom_filter&	filter;
+		explicit Add_domain (Bloom_filter& f) : filter(f) { }
+		void operator() (const std::string& domain) { filter.add(domain.data(), domain.size()); }
+	};
+}
+
+void	batv::Key_map::build_filter ()
+{
+	if (filter_fp_rate <= 0) {
+		domain_filter.clear();
+		return;
+	}
+	std::string		domain;
+	Count_domains		count;
+	for_each_domain(root, domain, count);
+
+	Bloom_filter		new_filter;
+	Add_domain		add(new_filter);
+	new_filter.reset(count.count, filter_fp_rate);
+	for_each_domain(root, domain, add);
+	domain_filter.swap(new_filter);
+}
+
+void	batv::Key_map::set_filter_false_positive_rate (double rate)
+{
+	filter_fp_rate = rate;
+	build_filter();
+}
+
+bool	batv::Key_map::may_have_key (const std::string& domain) const
+{
+	if (!domain_filter.is_sized() || root->domain_keys || !patterns.empty() || domain.empty()) {
+		return true;
+	}
+	// Check the domain and each of its parents
+	return domain_filter.may_contain_suffix(domain.data(), domain.size(), '.');
+}
+
+void	batv::Key_map::swap_patterns (Key_map& other)
+{
+	num_entries = num_entries - pattern_keys.size() + other.pattern_keys.size();
+	other.num_entries = other.num_entries - other.pattern_keys.size() + pattern_keys.size();
+	patterns.swap(other.patterns);
+	pattern_keys.swap(other.pattern_keys);
+}
+
+void	batv::Key_map::swap (Key_map& other)
+{
+	std::swap(root, other.root);
+	domains.swap(other.domains);
+	nodes_by_id.swap(other.nodes_by_id);
+	patterns.swap(other.patterns);
+	pattern_keys.swap(other.pattern_keys);
+	std::swap(num_entries, other.num_entries);
+	domain_filter.swap(other.domain_filter);
+	std::swap(filter_fp_rate, other.filter_fp_rate);
+}
+
+void	batv::Key_map::clear ()
+{
+	Key_map		empty_map;
+	swap(empty_map);
+}
+
+namespace {
+	// Evict the least recently used derived keys until the cache is within bounds.
+	// Keys which are still referenced stay alive until their last Key_ref goes away.
+	// Must be called with derived_keys_mutex held.
+	void evict_derived_keys ()
+	{
+		while (derived_keys.size() > max_derived_keys) {
+			Derived_key*	evicted = derived_keys_lru.back();
+			derived_keys_lru.pop_back();
+			derived_keys.erase(evicted->map_pos);
+			evicted->unref();
+		}
+	}
+
+	// Get the keys derived from master for the given domain or address, from the cache if possible
+	Key_ref derive_keys (const Key_entry& master, const std::string& name)
+	{
+		Derived_key_id		id(master.serial, name);
+
+		pthread_mutex_lock(&derived_keys_mutex);
+		Derived_key_map::iterator	it(derived_keys.find(id));
+		if (it != derived_keys.end()) {
+			Derived_key*	cached = it->second;
+			derived_keys_lru.splice(derived_keys_lru.begin(), derived_keys_lru, cached->lru_pos);
+			cached->ref();
+			pthread_mutex_unlock(&derived_keys_mutex);
+			return Key_ref(cached);
+		}
+		pthread_mutex_unlock(&derived_keys_mutex);
+
+		// Derive the keys without holding the lock
+		// OKM = HKDF-Expand(PRK, "batv-prvs:" | name, 32)
+		Derived_key*		derived = new Derived_key;
+		derived->refs = 1;
+		derived->entry.current = master.current;
+		const std::string	info("batv-prvs:" + name);
+		for (unsigned int i = 0; i < Key_entry::MAX_GENERATIONS; ++i) {
+			if (const Key* prk = master.get_generation(i)) {
+				Key		key(derived_key_len);
+				hkdf_sha1_expand(&key[0], key.size(), &(*prk)[0], prk->size(),
+						reinterpret_cast<const unsigned char*>(info.data()), info.size());
+				derived->entry.generations[i] = Shared_key(key);
+			}
+		}
+
+		pthread_mutex_lock(&derived_keys_mutex);
+		it = derived_keys.find(id);
+		if (it != derived_keys.end()) {
+			// Another thread got here first
+			delete derived;
+			derived = it->second;
+			derived->ref();
+		} else if (max_derived_keys > 0) {
+			derived->ref();
+			derived->map_pos = derived_keys.insert(std::make_pair(id, derived)).first;
+			derived->lru_pos = derived_keys_lru.insert(derived_keys_lru.begin(), derived);
+			evict_derived_keys();
+		}
+		pthread_mutex_unlock(&derived_keys_mutex);
+		return Key_ref(derived);
+	}
+
+	Key_ref entry_keys (const Key_entry& entry, const std::string& sender_address)
+	{
+		if (entry.empty()) {
+			return Key_ref();
+		}
+		if (entry.derivation == Key_entry::DERIVE_NONE) {
+			return Key_ref(&entry);
+		}
+
+		// Domains are case-insensitive, so derive from the lower-cased domain
+		std::string::size_type	at_sign_pos = sender_address.find('@');
+		std::string		name(entry.derivation == Key_entry::DERIVE_ADDRESS || at_sign_pos == std::string::npos ?
+						sender_address : sender_address.substr(at_sign_pos + 1));
+		for (std::string::size_type i = name.rfind('@') + 1; i < name.size(); ++i) {	// (npos + 1 == 0)
+			name[i] = std::tolower(static_cast<unsigned char>(name[i]));
+		}
+		return derive_keys(entry, name);
+	}
+}
+
+Key_ref batv::get_key (const Key_map& keys, const std::string& sender_address, const Key_entry* default_key)
+{
+	if (const Key_entry* entry = keys.lookup(sender_address)) {
+		return entry_keys(*entry, sender_address);
+	}
+	return Key_ref(default_key);
+}
+
+void	batv::set_derived_key_cache_size (size_t size)
+{
+	pthread_mutex_lock(&derived_keys_mutex);
+	max_derived_keys = size;
+	evict_derived_keys();
+	pthread_mutex_unlock(&derived_keys_mutex);
+}
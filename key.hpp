@@ -30,21 +30,218 @@
 
 #pragma once
 
-#include <map>
+#include "pattern.hpp"
+#include "bloom.hpp"
+#include "domain-table.hpp"
 #include <vector>
 #include <string>
 #include <iosfwd>
+#include <algorithm>
 
 namespace batv {
 	typedef std::vector<unsigned char> Key;
-	typedef std::map<std::string, Key> Key_map;
+
+	// Key bytes, shared (read-only) by every holder of the same key, so that
+	// key map entries with identical keys store them only once
+	class Shared_key {
+		struct Rep {
+			Key		key;
+			int		refs;
+		};
+		Rep*			rep;
+
+		void			release ();
+	public:
+		Shared_key () : rep(NULL) { }
+		explicit Shared_key (const Key&);
+		Shared_key (const Shared_key&);
+		~Shared_key () { release(); }
+		Shared_key&		operator= (const Shared_key&);
+
+		bool			empty () const { return !rep || rep->key.empty(); }
+		const Key&		get () const;
+		void			swap (Shared_key& other) { std::swap(rep, other.rep); }
+	};
+
+	// The keys of a sender, indexed by generation (the key-num digit of a prvs tag).
+	// New addresses are signed with the current generation, and addresses are validated
+	// with the generation named in their tag, so keys can be rolled over without
+	// invalidating addresses signed with the previous key.
+	//
+	// A key map entry can instead hold master keys, from which each sender's keys are
+	// derived with HKDF (from the master key and the sender's domain or address), so
+	// that one entry can serve any number of domains.
+	struct Key_entry {
+		enum { MAX_GENERATIONS = 10 };
+
+		enum Derivation {
+			DERIVE_NONE,		// generations are the keys themselves
+			DERIVE_DOMAIN,		// generations are HKDF pseudorandom keys; derive per domain
+			DERIVE_ADDRESS		// ... derive per address
+		};
+
+		Shared_key	generations[MAX_GENERATIONS];	// empty if the generation has no key
+		unsigned int	current;			// generation to sign new addresses with
+		Derivation	derivation;
+		unsigned long	serial;				// identifies the master keys (for caching derived keys)
+
+		Key_entry () : current(0), derivation(DERIVE_NONE), serial(0) { }
+
+		bool		empty () const;		// true if no generation has a key
+		bool		can_sign () const { return !generations[current].empty(); }
+		const Key&	current_key () const { return generations[current].get(); }
+		const Key*	get_generation (unsigned int generation) const
+		{
+			return generation < MAX_GENERATIONS && !generations[generation].empty() ? &generations[generation].get() : NULL;
+		}
+		void		swap (Key_entry&);
+	};
+
+	// Map from sender address, domain ("@example.com"), address pattern (containing
+	// '*' or '?'), or "*" (any sender) to keys.  Domains are kept in a tree of their
+	// reversed, lower-cased labels, each node of which is also found by its interned
+	// domain, and patterns are compiled into one DFA, so that looking up a sender
+	// finds the most specific entry with one hash probe per label, without allocating memory.
+	// In order of precedence:
+	//  1. the address itself
+	//  2. the first matching pattern in the order added
+	//  3. the domain, then each parent domain
+	//  4. "*"
+	class Key_map {
+	public:
+		struct Node;
+	private:
+		Node*			root;		// the empty domain, whose keys are those of "*"
+		Domain_table		domains;	// the domains of the nodes (besides the root)
+		std::vector<Node*>	nodes_by_id;	// [domain id] -> node, or NULL if removed
+		Pattern_set		patterns;
+		std::vector<Key_entry*>	pattern_keys;	// [pattern index] -> keys
+		size_t			num_entries;
+		Bloom_filter		domain_filter;	// domains with entries (including their addresses' entries)
+		double			filter_fp_rate;	// or 0 to not use a filter
+
+		void			build_filter ();
+
+		Key_map (const Key_map&);
+		Key_map& operator= (const Key_map&);
+	public:
+		Key_map ();
+		~Key_map ();
+
+		// Get the entry for the given address, "@domain", or "*", creating it if necessary
+		Key_entry&		operator[] (const std::string& address_or_domain);
+		// Get the entry for the given address, "@domain", or "*", or NULL if there isn't one
+		const Key_entry*	find (const std::string& address_or_domain) const;
+		// Remove the entry for the given address, "@domain", or "*" (not a pattern).
+		// Returns false if there wasn't one.
+		bool			erase (const std::string& address_or_domain);
+		// Compile the patterns and build the domain filter.  Must be called after adding
+		// pattern entries and before lookup.
+		void			compile ();
+		// Exchange pattern entries (and their compiled patterns) with another map
+		void			swap_patterns (Key_map&);
+		// Get the most specific entry which applies to the given sender, or NULL if none does
+		const Key_entry*	lookup (const std::string& sender_address) const;
+		// Quickly check whether any sender in the given domain might have an entry.  If
+		// false, none does.  Uses the domain filter unless there are patterns or a "*" entry.
+		bool			may_have_key (const std::string& domain) const;
+
+		// Set the domain filter's false positive rate (default 0.01), or 0 to not use one
+		void			set_filter_false_positive_rate (double);
+		const Bloom_filter&	filter () const { return domain_filter; }
+
+		bool			empty () const { return num_entries == 0; }
+		size_t			size () const { return num_entries; }
+		void			swap (Key_map&);
+		void			clear ();
+	};
+
+	struct Derived_key;
+
+	// A reference to a sender's keys.  Derived keys live in a bounded cache, and are
+	// reference-counted so that eviction doesn't invalidate keys which are in use.
+	class Key_ref {
+		const Key_entry*	entry;
+		Derived_key*		derived;	// owner of *entry, if derived or pinned
+
+		void			release ();
+	public:
+		Key_ref () : entry(NULL), derived(NULL) { }
+		explicit Key_ref (const Key_entry* e) : entry(e), derived(NULL) { }
+		explicit Key_ref (Derived_key*);	// takes over the caller's reference
+		Key_ref (const Key_ref&);
+		~Key_ref () { release(); }
+		Key_ref&		operator= (const Key_ref&);
+
+		const Key_entry*	get () const { return entry; }
+		const Key_entry&	operator* () const { return *entry; }
+		const Key_entry*	operator-> () const { return entry; }
+		bool			operator! () const { return entry == NULL; }
+
+		// Get a reference which owns a copy of the keys (sharing the key bytes),
+		// so it remains valid when the key map is changed or destroyed
+		Key_ref			pin () const;
+	};
 
 	void		load_key (Key& key, std::istream& key_file_in);
-	void		load_key_map (Key_map& key_map, std::istream& key_map_file_in);
+	void		load_key (Key_entry& key, std::istream& key_file_in);	// as generation 0
+
+	// Decode an inline key ("hex:HEX" or "base64:BASE64").  Returns false if it's malformed.
+	bool		decode_inline_key (const std::string& key_spec, Key& key);
+
+	struct Key_map_stats {
+		size_t		num_entries;		// lines loaded
+		size_t		num_key_files;		// distinct key files read
+		size_t		num_inline_keys;
+		size_t		key_bytes;		// bytes of distinct keys stored
+		size_t		key_bytes_saved;	// bytes not stored thanks to sharing identical keys
+		double		seconds;		// time spent loading
+		size_t		filter_bytes;		// size of the key map's domain filter
+		double		filter_fp_rate;		// its expected false positive rate
 
-	// Get HMAC key for given sender from the key map:
+		Key_map_stats () : num_entries(0), num_key_files(0), num_inline_keys(0), key_bytes(0), key_bytes_saved(0), seconds(0), filter_bytes(0), filter_fp_rate(0) { }
+
+		Key_map_stats&	operator+= (const Key_map_stats& other)
+		{
+			num_entries += other.num_entries;
+			num_key_files += other.num_key_files;
+			num_inline_keys += other.num_inline_keys;
+			key_bytes += other.key_bytes;
+			key_bytes_saved += other.key_bytes_saved;
+			seconds += other.seconds;
+			filter_bytes = other.filter_bytes;	// of the map as other left it
+			filter_fp_rate = other.filter_fp_rate;
+			return *this;
+		}
+	};
+
+	// A line of a key map: an address, domain, pattern, or "*" followed by
+	// [N:][hkdf-domain:|hkdf-address:] and a key file path, "hex:HEX", or "base64:BASE64"
+	struct Key_map_line {
+		std::string		address;
+		unsigned int		generation;
+		Key_entry::Derivation	derivation;
+		std::string		key_spec;	// key file path, "hex:HEX", or "base64:BASE64"
+
+		bool			operator== (const Key_map_line&) const;
+		bool			operator!= (const Key_map_line& other) const { return !(*this == other); }
+	};
+
+	// Parse a key map file, appending its lines to lines
+	void		parse_key_map (std::vector<Key_map_line>& lines, std::istream& key_map_file_in);
+
+	// Load a key map.  Key files are read in parallel, and identical keys are shared.
+	void		load_key_map (Key_map& key_map, const std::vector<Key_map_line>& lines, Key_map_stats* stats =NULL);
+	void		load_key_map (Key_map& key_map, std::istream& key_map_file_in, Key_map_stats* stats =NULL);
+	std::ostream&	operator<< (std::ostream&, const Key_map_stats&);	// one-line summary
+
+	// Get HMAC keys for given sender from the key map:
 	//  returns default_key (which is NULL by default) if sender is not in map.
 	//  returns NULL if sender is in map with an empty key
-	const Key*	get_key (const Key_map&, const std::string& sender_address, const Key* default_key =NULL);
+	// The most specific entry for the sender is used (see Key_map).
+	Key_ref		get_key (const Key_map&, const std::string& sender_address, const Key_entry* default_key =NULL);
+
+	// Set the maximum number of derived keys to cache (default 10000)
+	void		set_derived_key_cache_size (size_t);
 }
 
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "batv.h"
+#include "prvs.hpp"
+#include "key.hpp"
+#include "common.hpp"
+#include "address.hpp"
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <new>
+
+using namespace batv;
+
+struct batv_keyring {
+	Key_map			key_map;
+	Key_entry		default_key;
+	std::string		error;
+
+	Key_ref			get_key (const std::string& address) const
+	{
+		return batv::get_key(key_map, address, !default_key.empty() ? &default_key : NULL);
+	}
+	bool			may_have_key (const std::string& domain) const
+	{
+		return !default_key.empty() || key_map.may_have_key(domain);
+	}
+};
+
+namespace {
+	int copy_result (const std::string& result, char* out, size_t out_size)
+	{
+		if (result.size() >= out_size) {
+			if (out_size > 0) {
+				out[0] = '\0';
+			}
+			return BATV_BUFFER_TOO_SMALL;
+		}
+		std::memcpy(out, result.c_str(), result.size() + 1);
+		return BATV_OK;
+	}
+
+	int sign (const batv_keyring* keyring, const char* address, unsigned int lifetime, char sub_address_delimiter, char* out, size_t out_size)
+	{
+		if (out_size > 0) {
+			out[0] = '\0';
+		}
+		if (lifetime < 1 || lifetime > 999) {
+			return BATV_ERROR;
+		}
+		Key_ref			key = keyring->get_key(address);
+		if (!key || !key->can_sign()) {
+			return BATV_NO_KEY;
+		}
+		Email_address		from_address;
+		from_address.parse(address);
+		if (from_address.domain.empty()) {
+			return BATV_NO_DOMAIN;
+		}
+		return copy_result(prvs_generate(from_address, lifetime, *key).make_string(sub_address_delimiter), out, out_size);
+	}
+
+	int validate (const batv_keyring* keyring, const char* address, unsigned int lifetime, char sub_address_delimiter, char* out, size_t out_size)
+	{
+		if (out_size > 0) {
+			out[0] = '\0';
+		}
+		if (lifetime < 1 || lifetime > 999) {
+			return BATV_ERROR;
+		}
+		Email_address		rcpt_to;
+		Batv_address		batv_rcpt;
+		rcpt_to.parse(address);
+		if (!batv_rcpt.parse(rcpt_to, sub_address_delimiter) || batv_rcpt.tag_type != "prvs") {
+			return BATV_NOT_BATV;
+		}
+		std::string		orig_address(batv_rcpt.orig_mailfrom.make_string());
+		if (copy_result(orig_address, out, out_size) != BATV_OK) {
+			return BATV_BUFFER_TOO_SMALL;
+		}
+		if (!keyring->may_have_key(batv_rcpt.orig_mailfrom.domain)) {
+			return BATV_NO_KEY;
+		}
+		Key_ref			key = keyring->get_key(orig_address);
+		if (!key) {
+			return BATV_NO_KEY;
+		}
+		return prvs_validate(batv_rcpt, lifetime, *key) ? BATV_OK : BATV_INVALID;
+	}
+}
+
+// No exception may escape into C code, so every entry point catches everything.
+
+batv_keyring*	batv_keyring_new (void)
+{
+	return new (std::nothrow) batv_keyring;
+}
+
+void		batv_keyring_free (batv_keyring* keyring)
+{
+	delete keyring;
+}
+
+int		batv_keyring_load_key (batv_keyring* keyring, const char* key_file)
+try {
+	std::ifstream		key_in(key_file);
+	if (!key_in) {
+		keyring->error = std::string("Unable to open key file ") + key_file;
+		return BATV_ERROR;
+	}
+	load_key(keyring->default_key, key_in);
+	keyring->error.clear();
+	return BATV_OK;
+} catch (...) {
+	return BATV_ERROR;
+}
+
+int		batv_keyring_load_key_map (batv_keyring* keyring, const char* key_map_file)
+try {
+	std::ifstream		key_map_in(key_map_file);
+	if (!key_map_in) {
+		keyring->error = std::string("Unable to open key map file ") + key_map_file;
+		return BATV_ERROR;
+	}
+	load_key_map(keyring->key_map, key_map_in);
+	keyring->error.clear();
+	return BATV_OK;
+} catch (const Config_error& e) {
+	keyring->error = e.message;
+	return BATV_ERROR;
+} catch (...) {
+	return BATV_ERROR;
+}
+
+const char*	batv_keyring_error (const batv_keyring* keyring)
+{
+	return keyring->error.c_str();
+}
+
+int		batv_sign (const batv_keyring* keyring, const char* address, unsigned int lifetime, char sub_address_delimiter, char* out, size_t out_size)
+try {
+	return sign(keyring, address, lifetime, sub_address_delimiter, out, out_size);
+} catch (...) {
+	return BATV_ERROR;
+}
+
+int		batv_validate (const batv_keyring* keyring, const char* address, unsigned int lifetime, char sub_address_delimiter, char* out, size_t out_size)
+try {
+	return validate(keyring, address, lifetime, sub_address_delimiter, out, out_size);
+} catch (...) {
+	return BATV_ERROR;
+}
+
+size_t		batv_sign_batch (const batv_keyring* keyring, size_t count, const char* const* addresses,
+				unsigned int lifetime, char sub_address_delimiter,
+				char* const* outs, size_t out_size, int* statuses)
+{
+	size_t			num_failed = 0;
+	for (size_t i = 0; i < count; ++i) {
+		statuses[i] = batv_sign(keyring, addresses[i], lifetime, sub_address_delimiter, outs[i], out_size);
+		num_failed += statuses[i] != BATV_OK;
+	}
+	return num_failed;
+}
+
+size_t		batv_validate_batch (const batv_keyring* keyring, size_t count, const char* const* addresses,
+				unsigned int lifetime, char sub_address_delimiter,
+				char* const* outs, size_t out_size, int* statuses)
+{
+	size_t			num_failed = 0;
+	for (size_t i = 0; i < count; ++i) {
+		statuses[i] = batv_validate(keyring, addresses[i], lifetime, sub_address_delimiter, outs[i], out_size);
+		num_failed += statuses[i] != BATV_OK;
+	}
+	return num_failed;
+}
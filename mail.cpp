@@ -0,0 +1,190 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "mail.hpp"
+#include <ostream>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+using namespace batv;
+
+bool Header::name_is (const std::string& other) const
+{
+	return name_len == other.size() && strncasecmp(name, other.data(), name_len) == 0;
+}
+
+Mail_reader::Mail_reader (int arg_fd, size_t buffer_size)
+: fd(arg_fd), buffer(buffer_size), eof(false)
+{
+	pos = end = &buffer[0];
+}
+
+Mail_reader::Mail_reader (const char* data, size_t len)
+: fd(-1), pos(data), end(data + len), eof(true)
+{
+}
+
+bool Mail_reader::fill (size_t min_avail)
+{
+	while (avail() < min_avail && !eof) {
+		char*		buffer_start = &buffer[0];
+		if (pos != buffer_start) {
+			// Move the unconsumed input to the front of the buffer
+			std::memmove(buffer_start, pos, avail());
+			end = buffer_start + avail();
+			pos = buffer_start;
+		}
+		if (static_cast<size_t>(end - pos) == buffer.size()) {
+			// The buffer is full of unconsumed input (i.e. a really long header), so grow it
+			size_t	used = avail();
+			buffer.resize(buffer.size() * 2);
+			pos = &buffer[0];
+			end = pos + used;
+		}
+
+		ssize_t		bytes_read = read(fd, const_cast<char*>(end), buffer.size() - avail());
+		if (bytes_read == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw Input_error(std::string("Error reading input: ") + strerror(errno));
+		}
+		if (bytes_read == 0) {
+			eof = true;
+		}
+		end += bytes_read;
+	}
+	return avail() >= min_avail;
+}
+
+size_t Mail_reader::find_line_end (size_t offset)
+{
+	while (true) {
+		if (const void* newline = std::memchr(pos + offset, '\n', avail() - offset)) {
+			return static_cast<const char*>(newline) - pos;
+		}
+		offset = avail();
+		if (!fill(offset + 1)) {
+			return avail();	// last line of input lacks a newline
+		}
+	}
+}
+
+bool Mail_reader::read_from_line (std::string* line)
+{
+	if (!fill(5) || std::memcmp(pos, "From ", 5) != 0) {
+		return false;
+	}
+
+	size_t		line_end = find_line_end(5);
+	if (line) {
+		line->assign(pos, line_end);
+	}
+	pos += std::min(line_end + 1, avail());
+	return true;
+}
+
+bool Mail_reader::next_header (Header& header)
+{
+	if (!fill(1) || *pos == '\n') {
+		return false;
+	}
+
+	if (*pos == ' ' || *pos == '\t') {
+		throw Input_error("Malformed message headers: unexpected continuation header");
+	}
+
+	// Parse first line of header
+	size_t		header_end = find_line_end(0);
+	const char*	colon = static_cast<const char*>(std::memchr(pos, ':', header_end));
+	if (!colon) {
+		throw Input_error("No colon in message header line");
+	}
+	size_t		colon_offset = colon - pos;
+
+	// Take in continuation lines, if any
+	while (header_end < avail() && fill(header_end + 2) && (pos[header_end + 1] == ' ' || pos[header_end + 1] == '\t')) {
+		header_end = find_line_end(header_end + 1);
+	}
+
+	header.name = pos;
+	header.name_len = colon_offset;
+	header.value = pos + colon_offset + 1;
+	header.value_len = header_end - colon_offset - 1;
+
+	pos += std::min(header_end + 1, avail());
+	return true;
+}
+
+void Mail_reader::copy_rest (std::ostream& out)
+{
+	out.write(pos, avail());
+	pos = end;
+	while (fill(1)) {
+		out.write(pos, avail());
+		pos = end;
+	}
+}
+
+bool Mail_reader::copy_message_body (std::ostream* out)
+{
+	static const char	separator[] = "\nFrom ";
+	static const size_t	separator_len = sizeof(separator) - 1;
+
+	while (true) {
+		// memmem is vectorized by the C library
+		if (const void* separator_p = memmem(pos, avail(), separator, separator_len)) {
+			const char*	next_message = static_cast<const char*>(separator_p) + 1;
+			if (out) {
+				out->write(pos, next_message - pos);
+			}
+			pos = next_message;
+			return true;
+		}
+
+		// Flush everything except a tail that could be the start of a separator, then read more
+		size_t		keep = std::min(avail(), separator_len - 1);
+		if (out) {
+			out->write(pos, avail() - keep);
+		}
+		pos = end - keep;
+		if (!fill(keep + 1)) {
+			if (out) {
+				out->write(pos, avail());
+			}
+			pos = end;
+			return false;
+		}
+	}
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+#include <stddef.h>
+
+namespace batv {
+	struct Input_error {
+		std::string		message;
+		explicit Input_error (const std::string& m) : message(m) { }
+	};
+
+	// A message header, pointing directly into a Mail_reader's buffer.
+	// Only valid until the next call to the Mail_reader.
+	struct Header {
+		const char*		name;
+		size_t			name_len;
+		const char*		value;		// everything after the colon, including continuation lines,
+		size_t			value_len;	// but excluding the final newline
+
+		bool			name_is (const std::string&) const;	// case-insensitive comparison
+		std::string		value_string () const { return std::string(value, value_len); }
+		const char*		raw () const { return name; }		// the entire header, sans final newline
+		size_t			raw_len () const { return value + value_len - name; }
+	};
+
+	// Reads the headers of a message, either from a file descriptor or from memory.
+	// Reads are done in large blocks, and line ends and colons are located with memchr
+	// (which the C library vectorizes), so no per-line allocations or copies are made.
+	// Nothing past the end of the header block is read unless asked for.
+	class Mail_reader {
+		int			fd;		// -1 if reading from memory
+		std::vector<char>	buffer;		// unused if reading from memory
+		const char*		pos;		// start of unconsumed input
+		const char*		end;		// end of available input
+		bool			eof;
+
+		bool			fill (size_t min_avail);	// returns false if less than min_avail bytes remain
+		size_t			find_line_end (size_t offset);	// offset of '\n' (or end of input) at or after pos+offset
+		size_t			avail () const { return end - pos; }
+
+		Mail_reader (const Mail_reader&);
+		Mail_reader& operator= (const Mail_reader&);
+	public:
+		explicit Mail_reader (int fd, size_t buffer_size =128*1024);
+		Mail_reader (const char* data, size_t len);
+
+		// Is there no more input?
+		bool			at_end () { return !fill(1); }
+
+		// If the input is positioned at an mbox "From " line, consume it and
+		// (if line is non-NULL) store it in line, sans newline.
+		bool			read_from_line (std::string* line);
+
+		// Parse the next header into header.  Returns false at the end of the header block,
+		// leaving the input positioned at the blank line that separates the headers from the body.
+		bool			next_header (Header& header);
+
+		// Copy all remaining input (e.g. the message body) to out.
+		void			copy_rest (std::ostream& out);
+
+		// For mbox input: copy the remainder of the current message to out (or discard it if
+		// out is NULL), stopping at the next "From " line.  Returns false if there are no more
+		// messages.  Only a buffer's worth of the message is held in memory at a time.
+		bool			copy_message_body (std::ostream* out);
+	};
+}
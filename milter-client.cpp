@@ -0,0 +1,385 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "milter-client.hpp"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+
+using namespace batv;
+
+namespace {
+	// Protocol options (SMFIP_* in libmilter)
+	const uint32_t		PROTOCOL_NOCONNECT	= 0x000001;
+	const uint32_t		PROTOCOL_NOHELO		= 0x000002;
+	const uint32_t		PROTOCOL_NOMAIL		= 0x000004;
+	const uint32_t		PROTOCOL_NORCPT		= 0x000008;
+	const uint32_t		PROTOCOL_NOBODY		= 0x000010;
+	const uint32_t		PROTOCOL_NOHDRS		= 0x000020;
+	const uint32_t		PROTOCOL_NOEOH		= 0x000040;
+	const uint32_t		PROTOCOL_NR_HDR		= 0x000080;
+	const uint32_t		PROTOCOL_NODATA		= 0x000200;
+	const uint32_t		PROTOCOL_NR_CONN	= 0x001000;
+	const uint32_t		PROTOCOL_NR_HELO	= 0x002000;
+	const uint32_t		PROTOCOL_NR_MAIL	= 0x004000;
+	const uint32_t		PROTOCOL_NR_RCPT	= 0x008000;
+	const uint32_t		PROTOCOL_NR_DATA	= 0x010000;
+	const uint32_t		PROTOCOL_NR_EOH		= 0x040000;
+	const uint32_t		PROTOCOL_NR_BODY	= 0x080000;
+
+	// The largest packet we accept from a milter
+	const uint32_t		max_packet_len = 1024 * 1024;
+
+	void append_uint32 (std::string& out, uint32_t n)
+	{
+		out.push_back(n >> 24);
+		out.push_back(n >> 16);
+		out.push_back(n >> 8);
+		out.push_back(n);
+	}
+
+	uint32_t get_uint32 (const std::string& data, size_t offset)
+	{
+		if (data.size() < offset + 4) {
+			throw Milter_error("Truncated packet from milter");
+		}
+		const unsigned char*	p = reinterpret_cast<const unsigned char*>(data.data()) + offset;
+		return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+			(static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+	}
+}
+
+std::vector<std::string>	Milter_packet::strings (size_t offset) const
+{
+	std::vector<std::string>	strings;
+	while (offset < data.size()) {
+		std::string::size_type	nul_pos = data.find('\0', offset);
+		if (nul_pos == std::string::npos) {
+			nul_pos = data.size();
+		}
+		strings.push_back(data.substr(offset, nul_pos - offset));
+		offset = nul_pos + 1;
+	}
+	return strings;
+}
+
+void	Milter_modification::parse (const Milter_packet& packet)
+{
+	type = packet.command;
+	if (type == MILTER_REPLY_CHGHEADER || type == MILTER_REPLY_INSHEADER) {
+		index = get_uint32(packet.data, 0);
+		args = packet.strings(4);
+	} else {
+		index = 0;
+		args = packet.strings();
+	}
+}
+
+bool	batv::milter_is_modification (char response)
+{
+	return std::strchr("+-2behimq", response) != NULL;
+}
+
+bool	batv::milter_is_final_response (char response)
+{
+	return std::strchr("acdrty", response) != NULL;
+}
+
+void	batv::milter_append_packet (std::string& out, char command, const std::string& data)
+{
+	append_uint32(out, data.size() + 1);
+	out.push_back(command);
+	out.append(data);
+}
+
+bool	batv::milter_parse_packet (std::string& in, Milter_packet& packet)
+{
+	if (in.size() < 4) {
+		return false;
+	}
+	uint32_t		len = get_uint32(in, 0);
+	if (len == 0 || len > max_packet_len) {
+		throw Milter_error("Bad packet length from milter");
+	}
+	if (in.size() - 4 < len) {
+		return false;
+	}
+	packet.command = in[4];
+	packet.data.assign(in, 5, len - 1);
+	in.erase(0, 4 + len);
+	return true;
+}
+
+std::string	batv::milter_optneg_data (uint32_t version, uint32_t actions, uint32_t protocol)
+{
+	std::string		data;
+	append_uint32(data, version);
+	append_uint32(data, actions);
+	append_uint32(data, protocol);
+	return data;
+}
+
+std::string	batv::milter_connect_data (const std::string& hostname, const std::string& address, unsigned int port)
+{
+	std::string		data(hostname);
+	data.push_back('\0');
+	if (address.empty()) {
+		data.push_back('U');	// unknown
+		return data;
+	}
+	data.push_back(address.find(':') != std::string::npos ? '6' : '4');
+	data.push_back(port >> 8);
+	data.push_back(port);
+	data.append(address);
+	data.push_back('\0');
+	return data;
+}
+
+std::string	batv::milter_strings_data (const std::vector<std::string>& strings)
+{
+	std::string		data;
+	for (size_t i = 0; i < strings.size(); ++i) {
+		data.append(strings[i]).push_back('\0');
+	}
+	return data;
+}
+
+std::string	batv::milter_strings_data (const std::string& string1)
+{
+	return std::string(string1).append(1, '\0');
+}
+
+std::string	batv::milter_strings_data (const std::string& string1, const std::string& string2)
+{
+	return std::string(string1).append(1, '\0').append(string2).append(1, '\0');
+}
+
+bool	batv::milter_skips_command (uint32_t protocol, char command)
+{
+	switch (command) {
+	case MILTER_CMD_CONNECT:	return protocol & PROTOCOL_NOCONNECT;
+	case MILTER_CMD_HELO:		return protocol & PROTOCOL_NOHELO;
+	case MILTER_CMD_MAIL:		return protocol & PROTOCOL_NOMAIL;
+	case MILTER_CMD_RCPT:		return protocol & PROTOCOL_NORCPT;
+	case MILTER_CMD_DATA:		return protocol & PROTOCOL_NODATA;
+	case MILTER_CMD_HEADER:		return protocol & PROTOCOL_NOHDRS;
+	case MILTER_CMD_EOH:		return protocol & PROTOCOL_NOEOH;
+	case MILTER_CMD_BODY:		return protocol & PROTOCOL_NOBODY;
+	}
+	return false;
+}
+
+bool	batv::milter_skips_reply (uint32_t protocol, char command)
+{
+	switch (command) {
+	case MILTER_CMD_CONNECT:	return protocol & PROTOCOL_NR_CONN;
+	case MILTER_CMD_HELO:		return protocol & PROTOCOL_NR_HELO;
+	case MILTER_CMD_MAIL:		return protocol & PROTOCOL_NR_MAIL;
+	case MILTER_CMD_RCPT:		return protocol & PROTOCOL_NR_RCPT;
+	case MILTER_CMD_DATA:		return protocol & PROTOCOL_NR_DATA;
+	case MILTER_CMD_HEADER:		return protocol & PROTOCOL_NR_HDR;
+	case MILTER_CMD_EOH:		return protocol & PROTOCOL_NR_EOH;
+	case MILTER_CMD_BODY:		return protocol & PROTOCOL_NR_BODY;
+	case MILTER_CMD_MACRO:		return true;
+	case MILTER_CMD_ABORT:		return true;
+	case MILTER_CMD_QUIT:		return true;
+	}
+	return false;
+}
+
+int	batv::milter_connect (const std::string& socket_spec, bool non_blocking)
+{
+	int			fd = -1;
+	int			connect_result = -1;
+
+	if (socket_spec[0] == '/' || socket_spec.compare(0, 5, "unix:") == 0 || socket_spec.compare(0, 6, "local:") == 0) {
+		std::string		path(socket_spec[0] == '/' ? socket_spec : socket_spec.substr(socket_spec.find(':') + 1));
+		struct sockaddr_un	addr;
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw Milter_error("Socket path too long: " + path);
+		}
+		std::memset(&addr, '\0', sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strcpy(addr.sun_path, path.c_str());
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			throw Milter_error(std::string("socket: ") + std::strerror(errno));
+		}
+		if (non_blocking) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+		connect_result = connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+
+	} else if (socket_spec.compare(0, 5, "inet:") == 0 || socket_spec.compare(0, 6, "inet6:") == 0) {
+		std::string::size_type	colon_pos = socket_spec.find(':');
+		std::string::size_type	at_pos = socket_spec.find('@');
+		if (at_pos == std::string::npos) {
+			throw Milter_error("Socket spec must be of the form inet:PORT@HOST: " + socket_spec);
+		}
+		std::string		port(socket_spec, colon_pos + 1, at_pos - colon_pos - 1);
+		std::string		host(socket_spec, at_pos + 1);
+
+		struct addrinfo		hints;
+		struct addrinfo*	addrs;
+		std::memset(&hints, '\0', sizeof(hints));
+		hints.ai_family = socket_spec[4] == '6' ? AF_INET6 : AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs)) {
+			throw Milter_error(host + ": " + gai_strerror(error));
+		}
+		if ((fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol)) == -1) {
+			freeaddrinfo(addrs);
+			throw Milter_error(std::string("socket: ") + std::strerror(errno));
+		}
+		if (non_blocking) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
+		connect_result = connect(fd, addrs->ai_addr, addrs->ai_addrlen);
+		freeaddrinfo(addrs);
+
+	} else {
+		throw Milter_error("Unsupported socket spec: " + socket_spec);
+	}
+
+	if (connect_result == -1 && !(non_blocking && errno == EINPROGRESS)) {
+		int		connect_errno = errno;
+		::close(fd);
+		throw Milter_error(socket_spec + ": " + std::strerror(connect_errno));
+	}
+	return fd;
+}
+
+void	Milter_connection::open (const std::string& socket_spec)
+{
+	close();
+	fd = milter_connect(socket_spec, false);
+
+	send(MILTER_CMD_OPTNEG, milter_optneg_data(6, MILTER_ACTIONS_ALL, MILTER_PROTOCOL_ALL));
+	Milter_packet		reply(receive());
+	if (reply.command != MILTER_REPLY_OPTNEG) {
+		throw Milter_error("Milter did not negotiate options");
+	}
+	version = get_uint32(reply.data, 0);
+	actions = get_uint32(reply.data, 4);
+	protocol = get_uint32(reply.data, 8);
+}
+
+void	Milter_connection::close ()
+{
+	if (fd != -1) {
+		::close(fd);
+		fd = -1;
+	}
+	in_buffer.clear();
+}
+
+char	Milter_connection::command (char command, const std::string& data, std::vector<Milter_modification>* mods)
+{
+	if (milter_skips_command(protocol, command)) {
+		return MILTER_REPLY_CONTINUE;
+	}
+	send(command, data);
+	if (milter_skips_reply(protocol, command)) {
+		return MILTER_REPLY_CONTINUE;
+	}
+
+	for (;;) {
+		Milter_packet	reply(receive());
+		if (milter_is_final_response(reply.command)) {
+			return reply.command;
+		} else if (milter_is_modification(reply.command)) {
+			if (command != MILTER_CMD_BODYEOB) {
+				throw Milter_error("Milter sent modification outside end of message");
+			}
+			if (mods) {
+				mods->push_back(Milter_modification());
+				mods->back().parse(reply);
+			}
+		} else if (reply.command != MILTER_REPLY_PROGRESS) {
+			throw Milter_error(std::string("Unexpected response from milter: ") + reply.command);
+		}
+	}
+}
+
+void	Milter_connection::macros (char command, const std::vector<std::string>& names_and_values)
+{
+	send(MILTER_CMD_MACRO, std::string(1, command) + milter_strings_data(names_and_values));
+}
+
+void	Milter_connection::send (char command, const std::string& data)
+{
+	if (fd == -1) {
+		throw Milter_error("Not connected to milter");
+	}
+	std::string		packet;
+	milter_append_packet(packet, command, data);
+
+	const char*		p = packet.data();
+	size_t			len = packet.size();
+	while (len > 0) {
+		ssize_t		bytes_written = ::send(fd, p, len, MSG_NOSIGNAL);
+		if (bytes_written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw Milter_error(std::string("Error writing to milter: ") + std::strerror(errno));
+		}
+		p += bytes_written;
+		len -= bytes_written;
+	}
+}
+
+Milter_packet	Milter_connection::receive ()
+{
+	Milter_packet		packet;
+	while (!milter_parse_packet(in_buffer, packet)) {
+		char		buffer[4096];
+		ssize_t		bytes_read = read(fd, buffer, sizeof(buffer));
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read == -1) {
+			throw Milter_error(std::string("Error reading from milter: ") + std::strerror(errno));
+		}
+		if (bytes_read == 0) {
+			throw Milter_error("Milter closed the connection");
+		}
+		in_buffer.append(buffer, bytes_read);
+	}
+	return packet;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+namespace batv {
+	// The MTA side of the milter protocol (version 6), as spoken by Sendmail
+	// and Postfix to a milter.  Every packet is a 4 byte length (in network
+	// byte order, counting the command byte), a command byte, and the data.
+
+	struct Milter_error {
+		std::string	message;
+
+		explicit Milter_error (const std::string& m) : message(m) { }
+	};
+
+	// Commands (MTA to milter)
+	enum Milter_command {
+		MILTER_CMD_ABORT	= 'A',
+		MILTER_CMD_BODY		= 'B',
+		MILTER_CMD_CONNECT	= 'C',	// hostname, family, port, address
+		MILTER_CMD_MACRO	= 'D',	// command, then name/value pairs
+		MILTER_CMD_BODYEOB	= 'E',
+		MILTER_CMD_HELO		= 'H',
+		MILTER_CMD_HEADER	= 'L',	// name, value
+		MILTER_CMD_MAIL		= 'M',	// sender, ESMTP args
+		MILTER_CMD_EOH		= 'N',
+		MILTER_CMD_OPTNEG	= 'O',
+		MILTER_CMD_QUIT		= 'Q',
+		MILTER_CMD_RCPT		= 'R',	// recipient, ESMTP args
+		MILTER_CMD_DATA		= 'T'
+	};
+
+	// Responses (milter to MTA).  The modification responses may only be sent
+	// in response to MILTER_CMD_BODYEOB, and precede the final response.
+	enum Milter_response {
+		MILTER_REPLY_ADDRCPT	= '+',	// recipient
+		MILTER_REPLY_DELRCPT	= '-',	// recipient
+		MILTER_REPLY_ADDRCPT_PAR= '2',	// recipient, ESMTP args
+		MILTER_REPLY_ACCEPT	= 'a',
+		MILTER_REPLY_REPLBODY	= 'b',
+		MILTER_REPLY_CONTINUE	= 'c',
+		MILTER_REPLY_DISCARD	= 'd',
+		MILTER_REPLY_CHGFROM	= 'e',	// sender, ESMTP args
+		MILTER_REPLY_ADDHEADER	= 'h',	// name, value
+		MILTER_REPLY_INSHEADER	= 'i',	// index, name, value
+		MILTER_REPLY_CHGHEADER	= 'm',	// index, name, value (empty to delete)
+		MILTER_REPLY_OPTNEG	= 'O',
+		MILTER_REPLY_PROGRESS	= 'p',
+		MILTER_REPLY_QUARANTINE	= 'q',	// reason
+		MILTER_REPLY_REJECT	= 'r',
+		MILTER_REPLY_TEMPFAIL	= 't',
+		MILTER_REPLY_REPLYCODE	= 'y'	// SMTP reply
+	};
+
+	// Actions the MTA allows the milter to take (negotiated by MILTER_CMD_OPTNEG)
+	const uint32_t		MILTER_ACTIONS_ALL = 0x1FF;
+
+	// Protocol steps the MTA can skip, or not wait for a reply to
+	const uint32_t		MILTER_PROTOCOL_ALL = 0x1FFFFF;
+
+	struct Milter_packet {
+		char				command;
+		std::string			data;
+
+		// The NUL-terminated strings in data, for commands and responses consisting of them
+		std::vector<std::string>	strings (size_t offset =0) const;
+	};
+
+	// A modification requested by the milter, as one of the MILTER_REPLY_* modification
+	// responses.  For MILTER_REPLY_CHGHEADER and MILTER_REPLY_INSHEADER, index is the
+	// header index, and args holds the name and value.
+	struct Milter_modification {
+		char				type;
+		uint32_t			index;
+		std::vector<std::string>	args;
+
+		void		parse (const Milter_packet&);
+	};
+
+	bool		milter_is_modification (char response);
+	bool		milter_is_final_response (char response);
+
+	// Encode a packet onto out
+	void		milter_append_packet (std::string& out, char command, const std::string& data);
+	// Remove a complete packet from the front of in, if there is one
+	bool		milter_parse_packet (std::string& in, Milter_packet& packet);
+
+	// Data for the various commands
+	std::string	milter_optneg_data (uint32_t version, uint32_t actions, uint32_t protocol);
+	std::string	milter_connect_data (const std::string& hostname, const std::string& address, unsigned int port);	// address is IPv4 or IPv6, or empty for unknown
+	std::string	milter_strings_data (const std::vector<std::string>& strings);
+	std::string	milter_strings_data (const std::string& string1);
+	std::string	milter_strings_data (const std::string& string1, const std::string& string2);
+
+	// Does the negotiated protocol skip the given command, or skip the reply to it?
+	bool		milter_skips_command (uint32_t protocol, char command);
+	bool		milter_skips_reply (uint32_t protocol, char command);
+
+	// Open a connection to a milter, given a socket spec as for batv-milter:
+	// /PATH, unix:PATH, local:PATH, inet:PORT@HOST, or inet6:PORT@HOST.
+	// Returns the file descriptor, which is non-blocking if non_blocking is true
+	// (in which case the connection may still be in progress).
+	int		milter_connect (const std::string& socket_spec, bool non_blocking);
+
+	// A blocking connection to a milter, for simple clients
+	class Milter_connection {
+		int			fd;
+		std::string		in_buffer;
+		uint32_t		version;
+		uint32_t		actions;
+		uint32_t		protocol;
+
+		Milter_connection (const Milter_connection&);
+		Milter_connection& operator= (const Milter_connection&);
+	public:
+		Milter_connection () : fd(-1), version(0), actions(0), protocol(0) { }
+		~Milter_connection () { close(); }
+
+		// Connect and negotiate options (offering every action and protocol option)
+		void			open (const std::string& socket_spec);
+		void			close ();
+
+		uint32_t		get_protocol () const { return protocol; }
+
+		// Send a command.  Unless the milter doesn't reply to it, wait for the final
+		// response, appending any modifications to mods (if non-NULL), and return the
+		// response command.  Returns MILTER_REPLY_CONTINUE for skipped commands and
+		// commands without replies.
+		char			command (char command, const std::string& data, std::vector<Milter_modification>* mods =NULL);
+
+		// Send macros for the given command (which must precede it)
+		void			macros (char command, const std::vector<std::string>& names_and_values);
+
+		void			send (char command, const std::string& data);
+		Milter_packet		receive ();
+	};
+}
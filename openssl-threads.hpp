@@ -1,4 +0,0 @@
-#pragma once
-
-void openssl_init_threads ();
-void openssl_cleanup_threads ();
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "overload.hpp"
+#include "common.hpp"
+#include <unistd.h>
+#include <string.h>
+#include <cmath>
+#include <iostream>
+
+using namespace batv;
+
+namespace {
+	const double		latency_weight = 0.2;	// weight of each new sample in the latency average
+	const double		decay_time = 2.0;	// seconds for an idle latency average to decay by a factor of e
+	const useconds_t	watchdog_interval = 250000;
+	const double		report_interval = 10.0;	// seconds between reports of shed connections
+}
+
+Overload_guard::Overload_guard (unsigned int latency_threshold_ms, unsigned int arg_max_connections, unsigned int deadline_ms)
+: latency_threshold(latency_threshold_ms / 1000.0), max_connections(arg_max_connections), deadline(deadline_ms / 1000.0)
+{
+	pthread_mutex_init(&mutex, NULL);
+	connections.prev = connections.next = &connections;
+	latency = 0;
+	last_sample_time = now();
+	num_stuck = 0;
+	num_connections = 0;
+	num_admitted = 0;
+	num_shed = 0;
+	is_overloaded = false;
+}
+
+double	Overload_guard::current_latency (double t) const
+{
+	return latency * std::exp(-(t - last_sample_time) / decay_time);
+}
+
+// Enter or leave the overloaded state.  Called with mutex held.
+void	Overload_guard::update_overload (double t)
+{
+	const double		l = current_latency(t);
+	const bool		was_overloaded = is_overloaded;
+	if (num_stuck > 0) {
+		is_overloaded = true;
+	} else if (latency_threshold == 0) {
+		is_overloaded = false;
+	} else {
+		is_overloaded = l > (was_overloaded ? latency_threshold / 2 : latency_threshold);
+	}
+
+	if (is_overloaded && !was_overloaded) {
+		std::clog << "Overloaded (average callback latency " << l * 1000 << "ms, " << num_stuck << " stuck callbacks): admitting at most "
+			<< max_connections << " connections (" << num_connections << " open)" << std::endl;
+	} else if (!is_overloaded && was_overloaded) {
+		std::clog << "No longer overloaded (average callback latency " << l * 1000 << "ms)" << std::endl;
+	}
+}
+
+bool	Overload_guard::admit (Connection* connection)
+{
+	pthread_mutex_lock(&mutex);
+	update_overload(now());
+	bool			is_admitted = !is_overloaded || num_connections < max_connections;
+	if (is_admitted) {
+		connection->callback = NULL;
+		connection->start_time = 0;
+		connection->is_reported = false;
+		connection->prev = &connections;
+		connection->next = connections.next;
+		connections.next->prev = connection;
+		connections.next = connection;
+		++num_connections;
+		++num_admitted;
+	} else {
+		++num_shed;
+	}
+	pthread_mutex_unlock(&mutex);
+	return is_admitted;
+}
+
+void	Overload_guard::release (Connection* connection)
+{
+	pthread_mutex_lock(&mutex);
+	if (connection->callback && connection->is_reported) {
+		--num_stuck;
+	}
+	connection->prev->next = connection->next;
+	connection->next->prev = connection->prev;
+	--num_connections;
+	pthread_mutex_unlock(&mutex);
+}
+
+void	Overload_guard::begin (Connection* connection, const char* callback)
+{
+	pthread_mutex_lock(&mutex);
+	connection->callback = callback;
+	connection->start_time = now();
+	connection->is_reported = false;
+	pthread_mutex_unlock(&mutex);
+}
+
+void	Overload_guard::end (Connection* connection)
+{
+	pthread_mutex_lock(&mutex);
+	const double		t = now();
+	const double		elapsed = t - connection->start_time;
+	latency = current_latency(t) * (1 - latency_weight) + elapsed * latency_weight;
+	last_sample_time = t;
+	if (connection->is_reported) {
+		std::clog << "Milter callback " << connection->callback << " finished after " << elapsed << "s" << std::endl;
+		--num_stuck;
+	}
+	connection->callback = NULL;
+	pthread_mutex_unlock(&mutex);
+}
+
+void	Overload_guard::start ()
+{
+	start_background_thread(thread_main, this);
+}
+
+void*	Overload_guard::thread_main (void* arg)
+{
+	static_cast<Overload_guard*>(arg)->run();
+	return NULL;
+}
+
+void	Overload_guard::run ()
+{
+	double			last_report_time = now();
+	unsigned long		last_report_shed = 0;
+	for (;;) {
+		usleep(watchdog_interval);
+
+		pthread_mutex_lock(&mutex);
+		const double	t = now();
+		for (Connection* c = connections.next; c != &connections; c = c->next) {
+			if (deadline > 0 && c->callback && !c->is_reported && t - c->start_time > deadline) {
+				std::clog << "Milter callback " << c->callback << " has been running for " << t - c->start_time << "s" << std::endl;
+				c->is_reported = true;
+				++num_stuck;
+			}
+		}
+		update_overload(t);
+		if (num_shed == last_report_shed) {
+			last_report_time = t;
+		} else if (t - last_report_time >= report_interval) {
+			std::clog << "Shed " << num_shed - last_report_shed << " connections in the last " << static_cast<int>(t - last_report_time)
+				<< "s (" << num_shed << " in total, " << num_admitted << " admitted)" << std::endl;
+			last_report_shed = num_shed;
+			last_report_time = t;
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+namespace batv {
+	// Protects the MTA from a milter which has fallen behind.  The time spent in each
+	// milter callback is tracked as a moving average which decays while idle.  While
+	// it's above a threshold (or a callback has been running past the deadline), the
+	// milter is overloaded, and new connections are only admitted while fewer than
+	// max_connections are open; the rest should be shed immediately.  The overload ends
+	// when the average falls below half the threshold.  A watchdog thread logs
+	// callbacks which run past the deadline, overload transitions, and shedding counts.
+	class Overload_guard {
+	public:
+		// The state of an admitted connection's callbacks, owned by the connection
+		struct Connection {
+			const char*	callback;	// the running callback's name, or NULL if none is running
+			double		start_time;	// when it started
+			bool		is_reported;	// has the watchdog reported it as stuck?
+			Connection*	prev;
+			Connection*	next;
+		};
+
+		// Times a callback for as long as it's in scope (does nothing if guard is NULL)
+		class Timer {
+			Overload_guard*	guard;
+			Connection*	connection;
+			Timer (const Timer&);
+			Timer& operator= (const Timer&);
+		public:
+			Timer (Overload_guard* g, Connection* c, const char* callback) : guard(g), connection(c)
+			{
+				if (guard) guard->begin(connection, callback);
+			}
+			~Timer () { if (guard) guard->end(connection); }
+		};
+
+	private:
+		const double		latency_threshold;	// seconds, or 0 to never be overloaded by latency
+		const unsigned int	max_connections;
+		const double		deadline;		// seconds, or 0 for no deadline
+		pthread_mutex_t		mutex;
+		Connection		connections;		// sentinel of the list of admitted connections
+		double			latency;		// moving average, as of last_sample_time
+		double			last_sample_time;
+		unsigned int		num_stuck;		// callbacks currently past the deadline
+		unsigned int		num_connections;	// connections open
+		unsigned long		num_admitted;
+		unsigned long		num_shed;
+		bool			is_overloaded;
+
+		double			current_latency (double now) const;
+		void			update_overload (double now);
+		static void*		thread_main (void*);
+		void			run ();
+
+		Overload_guard (const Overload_guard&);
+		Overload_guard& operator= (const Overload_guard&);
+	public:
+		Overload_guard (unsigned int latency_threshold_ms, unsigned int max_connections, unsigned int deadline_ms);
+
+		// Decide whether to admit a new connection.  If it's admitted, it must be
+		// released when it closes.
+		bool			admit (Connection*);
+		void			release (Connection*);
+
+		void			begin (Connection*, const char* callback);
+		void			end (Connection*);
+
+		// Start the watchdog, in a new thread which runs until the process exits.
+		// Throws Config_error if unable to.
+		void			start ();
+	};
+}
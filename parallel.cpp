@@ -0,0 +1,173 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "parallel.hpp"
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace batv;
+
+namespace {
+	struct Work_range {
+		pthread_mutex_t		mutex;
+		size_t			begin;
+		size_t			end;
+	};
+
+	struct Work_pool {
+		std::vector<Work_range>	ranges;		// one per thread
+		void			(*fn)(size_t, void*);
+		void*			arg;
+	};
+
+	struct Worker {
+		Work_pool*		pool;
+		size_t			self;
+	};
+
+	bool take (Work_range& range, size_t& index)
+	{
+		bool	ok = false;
+		pthread_mutex_lock(&range.mutex);
+		if (range.begin < range.end) {
+			index = range.begin++;
+			ok = true;
+		}
+		pthread_mutex_unlock(&range.mutex);
+		return ok;
+	}
+
+	// Steal the back half of some other thread's range, putting it in our own range
+	bool steal (Work_pool& pool, size_t self)
+	{
+		for (size_t i = 1; i < pool.ranges.size(); ++i) {
+			Work_range&	victim = pool.ranges[(self + i) % pool.ranges.size()];
+			size_t		stolen_begin;
+			size_t		stolen_end;
+
+			pthread_mutex_lock(&victim.mutex);
+			stolen_end = victim.end;
+			stolen_begin = victim.begin + (victim.end - victim.begin) / 2;
+			victim.end = stolen_begin;
+			pthread_mutex_unlock(&victim.mutex);
+
+			if (stolen_begin < stolen_end) {
+				Work_range&	own = pool.ranges[self];
+				pthread_mutex_lock(&own.mutex);
+				own.begin = stolen_begin;
+				own.end = stolen_end;
+				pthread_mutex_unlock(&own.mutex);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void* run_worker (void* arg)
+	{
+		Worker*		worker = static_cast<Worker*>(arg);
+		Work_pool&	pool = *worker->pool;
+		size_t		index;
+		do {
+			while (take(pool.ranges[worker->self], index)) {
+				pool.fn(index, pool.arg);
+			}
+		} while (steal(pool, worker->self));
+		return NULL;
+	}
+}
+
+void batv::parallel_for (size_t count, unsigned int num_threads, void (*fn)(size_t, void*), void* arg)
+{
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	if (num_threads > count) {
+		num_threads = count ? count : 1;
+	}
+
+	Work_pool		pool;
+	pool.ranges.resize(num_threads);
+	pool.fn = fn;
+	pool.arg = arg;
+	for (size_t i = 0; i < num_threads; ++i) {
+		pthread_mutex_init(&pool.ranges[i].mutex, NULL);
+		pool.ranges[i].begin = count * i / num_threads;
+		pool.ranges[i].end = count * (i + 1) / num_threads;
+	}
+
+	std::vector<Worker>	workers(num_threads);
+	std::vector<pthread_t>	threads(num_threads);
+	for (size_t i = 0; i < num_threads; ++i) {
+		workers[i].pool = &pool;
+		workers[i].self = i;
+	}
+	for (size_t i = 1; i < num_threads; ++i) {
+		if (int err = pthread_create(&threads[i], NULL, run_worker, &workers[i])) {
+			// The other threads will steal this thread's range
+			std::fprintf(stderr, "parallel_for: pthread_create failed (%d)\n", err);
+			threads[i] = pthread_self();
+		}
+	}
+	run_worker(&workers[0]);
+	for (size_t i = 1; i < num_threads; ++i) {
+		if (!pthread_equal(threads[i], pthread_self())) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	for (size_t i = 0; i < num_threads; ++i) {
+		pthread_mutex_destroy(&pool.ranges[i].mutex);
+	}
+}
+
+unsigned int batv::num_processors ()
+{
+	long	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+bool batv::parse_num_threads (const char* str, unsigned int& num_threads)
+{
+	// strtoul would accept (and negate) a leading minus sign, so insist on a digit
+	if (*str < '0' || *str > '9') {
+		return false;
+	}
+	char*		end;
+	unsigned long	n = std::strtoul(str, &end, 10);
+	if (*end != '\0' || n < 1 || n > MAX_THREADS) {
+		return false;
+	}
+	num_threads = n;
+	return true;
+}
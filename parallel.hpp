@@ -0,0 +1,51 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace batv {
+	// Call fn(i, arg) for every i in [0, count), spread across num_threads threads
+	// (including the calling thread).  Each thread starts with an equal share of the
+	// index range; a thread that runs out steals half of the remaining range of another
+	// thread, so uneven per-item costs don't leave threads idle.  fn must not throw.
+	void		parallel_for (size_t count, unsigned int num_threads, void (*fn)(size_t, void*), void* arg);
+
+	// The number of online processors, for use as a default thread count
+	unsigned int	num_processors ();
+
+	// The largest thread count accepted by parse_num_threads
+	enum { MAX_THREADS = 1024 };
+
+	// Parse a thread count given on the command line.  Returns false unless str
+	// is a decimal number between 1 and MAX_THREADS, inclusive.
+	bool		parse_num_threads (const char* str, unsigned int& num_threads);
+}
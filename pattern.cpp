@@ -0,0 +1,241 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "pattern.hpp"
+#include "common.hpp"
+#include <algorithm>
+#include <cstring>
+
+using namespace batv;
+
+namespace {
+	// Patterns needing a bigger transition table than this (64MB) are rejected, as are
+	// ones whose DFA states stand for more NFA positions than this in total (64MB of
+	// position sets while compiling, which subset construction can blow up well past
+	// the size of the table)
+	const size_t		max_transitions = 16 * 1024 * 1024;
+	const size_t		max_state_positions = 16 * 1024 * 1024;
+
+	inline unsigned char fold_case (unsigned char c)
+	{
+		return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+	}
+
+	// An NFA state is a position in a pattern: the number of pattern characters matched
+	struct Nfa {
+		const std::vector<std::string>&	patterns;
+		std::vector<uint32_t>		offsets;	// [pattern] -> id of its position 0
+		std::vector<uint32_t>		pattern_of;	// [position id] -> pattern
+		uint32_t			num_positions;
+
+		explicit Nfa (const std::vector<std::string>& p) : patterns(p), num_positions(0)
+		{
+			for (size_t k = 0; k < patterns.size(); ++k) {
+				offsets.push_back(num_positions);
+				num_positions += patterns[k].size() + 1;
+				pattern_of.resize(num_positions, k);
+			}
+		}
+
+		char		at (uint32_t position) const	// pattern char at position, or NUL at the end
+		{
+			const std::string&	pattern = patterns[pattern_of[position]];
+			size_t			i = position - offsets[pattern_of[position]];
+			return i < pattern.size() ? pattern[i] : '\0';
+		}
+
+		// Add the positions reachable by letting '*'s match the empty string, then sort
+		void		close (std::vector<uint32_t>& set) const
+		{
+			for (size_t j = 0; j < set.size(); ++j) {
+				if (at(set[j]) == '*') {
+					set.push_back(set[j] + 1);
+				}
+			}
+			std::sort(set.begin(), set.end());
+			set.erase(std::unique(set.begin(), set.end()), set.end());
+		}
+
+		// Move every position in set over the character c (or, if c is NUL, over any
+		// character which appears in no pattern)
+		void		step (const std::vector<uint32_t>& set, char c, std::vector<uint32_t>& next) const
+		{
+			next.clear();
+			for (size_t j = 0; j < set.size(); ++j) {
+				const char	p = at(set[j]);
+				if (p == '*') {
+					next.push_back(set[j]);
+				} else if (p == '?' || (p != '\0' && p == c)) {
+					next.push_back(set[j] + 1);
+				}
+			}
+			close(next);
+		}
+
+		// The first pattern which set has reached the end of, or -1
+		int		first_match (const std::vector<uint32_t>& set) const
+		{
+			for (size_t j = 0; j < set.size(); ++j) {		// sorted, so in pattern order
+				if (at(set[j]) == '\0') {
+					return pattern_of[set[j]];
+				}
+			}
+			return -1;
+		}
+	};
+}
+
+batv::Pattern_set::Pattern_set ()
+{
+	std::memset(byte_class, 0, sizeof(byte_class));
+	num_classes = 1;
+	is_compiled = false;
+}
+
+bool	batv::Pattern_set::is_pattern (const std::string& str)
+{
+	return str.find_first_of("*?") != std::string::npos;
+}
+
+size_t	batv::Pattern_set::add (const std::string& pattern)
+{
+	std::string		folded(pattern);
+	for (size_t i = 0; i < folded.size(); ++i) {
+		folded[i] = fold_case(folded[i]);
+	}
+	std::map<std::string, size_t>::iterator	it(pattern_index.find(folded));
+	if (it != pattern_index.end()) {
+		return it->second;
+	}
+	patterns.push_back(folded);
+	pattern_index[folded] = patterns.size() - 1;
+	is_compiled = false;
+	return patterns.size() - 1;
+}
+
+int	batv::Pattern_set::find (const std::string& pattern) const
+{
+	std::string		folded(pattern);
+	for (size_t i = 0; i < folded.size(); ++i) {
+		folded[i] = fold_case(folded[i]);
+	}
+	std::map<std::string, size_t>::const_iterator	it(pattern_index.find(folded));
+	return it != pattern_index.end() ? static_cast<int>(it->second) : -1;
+}
+
+void	batv::Pattern_set::compile ()
+{
+	// Every character appearing literally in a pattern gets a class of its own (along
+	// with its upper-case form); every other byte is in class 0
+	std::vector<char>	class_chars(1, '\0');	// [class] -> representative pattern char
+	std::memset(byte_class, 0, sizeof(byte_class));
+	for (size_t k = 0; k < patterns.size(); ++k) {
+		for (size_t i = 0; i < patterns[k].size(); ++i) {
+			const unsigned char	c = patterns[k][i];
+			if (c != '*' && c != '?' && c != '\0' && byte_class[c] == 0) {
+				byte_class[c] = class_chars.size();
+				class_chars.push_back(c);
+			}
+		}
+	}
+	if (class_chars.size() > 256) {
+		throw Config_error("Too many distinct characters in key map patterns");
+	}
+	for (unsigned int b = 'A'; b <= 'Z'; ++b) {
+		byte_class[b] = byte_class[fold_case(b)];
+	}
+	num_classes = class_chars.size();
+
+	// Subset construction.  Each state's set of positions is stored once, as its key in state_ids.
+	typedef std::map<std::vector<uint32_t>, uint32_t> State_ids;
+	Nfa					nfa(patterns);
+	State_ids				state_ids;
+	std::vector<const std::vector<uint32_t>*> states;	// [state] -> its positions
+
+	states.push_back(&state_ids.insert(std::make_pair(std::vector<uint32_t>(), 0)).first->first);	// dead state
+	std::vector<uint32_t>			start(nfa.offsets);
+	nfa.close(start);
+	size_t					num_state_positions = start.size();
+	if (!start.empty()) {
+		states.push_back(&state_ids.insert(std::make_pair(start, 1)).first->first);
+	}
+
+	transitions.assign(states.size() * num_classes, 0);
+	accepting.assign(states.size(), -1);
+	std::vector<uint32_t>			next;
+	for (size_t s = 1; s < states.size(); ++s) {
+		accepting[s] = nfa.first_match(*states[s]);
+		for (size_t c = 0; c < num_classes; ++c) {
+			nfa.step(*states[s], class_chars[c], next);
+			State_ids::iterator		it(state_ids.find(next));
+			if (it == state_ids.end()) {
+				num_state_positions += next.size();
+				if ((states.size() + 1) * num_classes > max_transitions || num_state_positions > max_state_positions) {
+					throw Config_error("Key map patterns are too complex");
+				}
+				it = state_ids.insert(std::make_pair(next, states.size())).first;
+				states.push_back(&it->first);
+				transitions.resize(states.size() * num_classes, 0);
+				accepting.resize(states.size(), -1);
+			}
+			transitions[s * num_classes + c] = it->second;
+		}
+	}
+	is_compiled = true;
+}
+
+int	batv::Pattern_set::match (const char* str, size_t len) const
+{
+	if (!is_compiled || accepting.size() < 2) {
+		return -1;
+	}
+	uint32_t		state = 1;
+	for (size_t i = 0; i < len; ++i) {
+		state = transitions[state * num_classes + byte_class[static_cast<unsigned char>(str[i])]];
+		if (state == 0) {
+			return -1;
+		}
+	}
+	return accepting[state];
+}
+
+void	batv::Pattern_set::swap (Pattern_set& other)
+{
+	patterns.swap(other.patterns);
+	pattern_index.swap(other.pattern_index);
+	unsigned char		tmp[256];
+	std::memcpy(tmp, byte_class, sizeof(tmp));
+	std::memcpy(byte_class, other.byte_class, sizeof(tmp));
+	std::memcpy(other.byte_class, tmp, sizeof(tmp));
+	std::swap(num_classes, other.num_classes);
+	transitions.swap(other.transitions);
+	accepting.swap(other.accepting);
+	std::swap(is_compiled, other.is_compiled);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <map>
+
+namespace batv {
+	// A set of glob patterns ('*' matches any string, '?' any one character),
+	// compiled into one DFA, so that finding the first pattern (in the order added)
+	// which matches a string takes time linear in the length of the string,
+	// however many patterns there are.  Matching is case-insensitive.
+	class Pattern_set {
+		std::vector<std::string>	patterns;	// lower-cased
+		std::map<std::string, size_t>	pattern_index;
+
+		// The DFA.  State 0 is the dead state and state 1 the start state.  Bytes are
+		// mapped to classes of bytes which every pattern treats alike.
+		unsigned char			byte_class[256];
+		size_t				num_classes;
+		std::vector<uint32_t>		transitions;	// [state * num_classes + class] -> state
+		std::vector<int>		accepting;	// [state] -> first matching pattern, or -1
+		bool				is_compiled;
+
+	public:
+		Pattern_set ();
+
+		// Add a pattern, returning its index (the existing index if already added)
+		size_t		add (const std::string& pattern);
+		// Get the index of a pattern, or -1 if it hasn't been added
+		int		find (const std::string& pattern) const;
+
+		// Build the DFA.  Must be called after adding patterns and before matching.
+		// Throws Config_error if the patterns would need an unreasonably large DFA.
+		void		compile ();
+
+		// Get the index of the first pattern matching str, or -1 if none does
+		int		match (const char* str, size_t len) const;
+
+		bool		empty () const { return patterns.empty(); }
+		size_t		size () const { return patterns.size(); }
+		size_t		num_states () const { return accepting.size(); }
+		void		swap (Pattern_set&);
+
+		static bool	is_pattern (const std::string&);	// does the string contain '*' or '?'
+	};
+}
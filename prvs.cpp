@@ -29,22 +29,64 @@
  */
 
 #include "prvs.hpp"
+#include "sha1.hpp"
 #include <vector>
 #include <algorithm>
 #include <stdint.h>
 #include <cstdio>
 #include <stdio.h>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
 #include <ctime>
-#include <openssl/sha.h>
-#include <openssl/hmac.h>
-#include <openssl/evp.h>
 
 using namespace batv;
 
-static unsigned int today ()
+static std::time_t system_clock ()
 {
-	return (std::time(NULL) / 86400) % 1000;
+	return std::time(NULL);
+}
+
+static std::time_t (*prvs_clock)() = system_clock;
+
+static unsigned int today (std::time_t now)
+{
+	return (now / 86400) % 1000;
+}
+
+namespace {
+	// Each thread keeps the HMAC midstates of the keys it used most recently, so
+	// that computing a hash usually costs only the compression of the hash source
+	// and the outer block.  Being per-thread, the cache needs no locking.
+	// Entries are matched by key contents, so replaced keys are never confused.
+	struct Key_cache_entry {
+		size_t		key_len;	// 0 if unused
+		unsigned char	key[64];	// longer keys aren't cached
+		Hmac_sha1_key	hmac_key;
+	};
+
+	const size_t				key_cache_size = 8;
+	__thread Key_cache_entry		key_cache[key_cache_size];
+	__thread size_t				key_cache_next;
+
+	const Hmac_sha1_key& get_hmac_key (const std::vector<unsigned char>& key, Hmac_sha1_key& uncached)
+	{
+		if (key.empty() || key.size() > sizeof(key_cache[0].key)) {
+			uncached.init(key.empty() ? NULL : &key[0], key.size());
+			return uncached;
+		}
+		for (size_t i = 0; i < key_cache_size; ++i) {
+			if (key_cache[i].key_len == key.size() && std::memcmp(key_cache[i].key, &key[0], key.size()) == 0) {
+				return key_cache[i].hmac_key;
+			}
+		}
+		Key_cache_entry&	entry = key_cache[key_cache_next];
+		key_cache_next = (key_cache_next + 1) % key_cache_size;
+		entry.key_len = key.size();
+		std::memcpy(entry.key, &key[0], key.size());
+		entry.hmac_key.init(entry.key, entry.key_len);
+		return entry.hmac_key;
+	}
 }
 
 static void make_prvs_hash (unsigned char* hash_out, const char* tag_val, const Email_address& orig_mailfrom, const std::vector<unsigned char>& key)
@@ -56,18 +98,13 @@ static void make_prvs_hash (unsigned char* hash_out, const char* tag_val, const
 	hash_source[4 + orig_mailfrom.local_part.size()] = '@';
 	std::copy(orig_mailfrom.domain.begin(), orig_mailfrom.domain.end(), hash_source.begin() + 4 + orig_mailfrom.local_part.size() + 1);
 
-	HMAC(EVP_sha1(),
-			&key[0], key.size(),
-			&hash_source[0], hash_source.size(),
-			hash_out, NULL);
+	Hmac_sha1_key			uncached_key;
+	hmac_sha1(hash_out, get_hmac_key(key, uncached_key), &hash_source[0], hash_source.size());
 }
 
-bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, const std::vector<unsigned char>& key)
+// Validate the expiration and HMAC of a prvs tag, whose key-num has already been checked
+static bool check_prvs_tag (const Batv_address& address, unsigned int lifetime, const std::vector<unsigned char>& key, std::time_t now)
 {
-	if (address.tag_val.size() != 10) {
-		return false;
-	}
-
 	// tag-val        =  K DDD SSSSSS
 
 	unsigned int			key_num;
@@ -76,13 +113,8 @@ bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, co
 
 	std::sscanf(address.tag_val.c_str(), "%1u%3u%2x%2x%2x", &key_num, &expiration_day, &claimed_hmac[0], &claimed_hmac[1], &claimed_hmac[2]);
 
-	// check the key-num
-	if (key_num != 0) {
-		return false;
-	}
-
 	// check the expiration
-	if (static_cast<unsigned int>((static_cast<int>(expiration_day) - static_cast<int>(today())) + 1000) % 1000 > lifetime) {
+	if (static_cast<unsigned int>((static_cast<int>(expiration_day) - static_cast<int>(today(now))) + 1000) % 1000 > lifetime) {
 		return false;
 	}
 
@@ -95,16 +127,16 @@ bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, co
 		(claimed_hmac[2] ^ correct_hmac[2])) == 0;
 }
 
-Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const std::vector<unsigned char>& key)
+static Batv_address make_prvs_address (const Email_address& orig_mailfrom, unsigned int lifetime, unsigned int key_num, const std::vector<unsigned char>& key, std::time_t now)
 {
 	// tag-val        =  K DDD SSSSSS
 	char				val[11];
 	
 	// key-num
-	val[0] = '0';
+	val[0] = '0' + key_num;
 
 	// expiration
-	snprintf(val + 1, 4, "%03u", (today() + lifetime) % 1000);
+	snprintf(val + 1, 4, "%03u", (today(now) + lifetime) % 1000);
 
 	// HMAC
 	unsigned char			hmac[20];
@@ -121,3 +153,64 @@ Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned i
 	return address;
 }
 
+bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, const std::vector<unsigned char>& key)
+{
+	return prvs_validate(address, lifetime, key, prvs_clock());
+}
+
+bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, const std::vector<unsigned char>& key, std::time_t now)
+{
+	// A lone key is generation 0
+	return address.tag_val.size() == 10 && address.tag_val[0] == '0' && check_prvs_tag(address, lifetime, key, now);
+}
+
+bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, const Key_entry& keys)
+{
+	return prvs_validate(address, lifetime, keys, prvs_clock());
+}
+
+bool	batv::prvs_validate (const Batv_address& address, unsigned int lifetime, const Key_entry& keys, std::time_t now)
+{
+	if (address.tag_val.size() != 10 || address.tag_val[0] < '0' || address.tag_val[0] > '9') {
+		return false;
+	}
+
+	// check the key-num, which selects the key generation
+	const std::vector<unsigned char>* key = keys.get_generation(address.tag_val[0] - '0');
+	return key && check_prvs_tag(address, lifetime, *key, now);
+}
+
+bool	batv::prvs_expiration_day (const Batv_address& address, unsigned int& expiration_day)
+{
+	const std::string&	tag_val = address.tag_val;
+	if (tag_val.size() != 10 || !std::isdigit(tag_val[0]) || !std::isdigit(tag_val[1]) || !std::isdigit(tag_val[2]) || !std::isdigit(tag_val[3])) {
+		return false;
+	}
+	expiration_day = (tag_val[1] - '0') * 100 + (tag_val[2] - '0') * 10 + (tag_val[3] - '0');
+	return true;
+}
+
+Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const std::vector<unsigned char>& key)
+{
+	return make_prvs_address(orig_mailfrom, lifetime, 0, key, prvs_clock());
+}
+
+Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const std::vector<unsigned char>& key, std::time_t now)
+{
+	return make_prvs_address(orig_mailfrom, lifetime, 0, key, now);
+}
+
+Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const Key_entry& keys)
+{
+	return make_prvs_address(orig_mailfrom, lifetime, keys.current, keys.current_key(), prvs_clock());
+}
+
+Batv_address	batv::prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const Key_entry& keys, std::time_t now)
+{
+	return make_prvs_address(orig_mailfrom, lifetime, keys.current, keys.current_key(), now);
+}
+
+void	batv::set_prvs_clock (std::time_t (*clock)())
+{
+	prvs_clock = clock;
+}
@@ -31,10 +31,31 @@
 #pragma once
 
 #include "address.hpp"
+#include "key.hpp"
 #include <vector>
 #include <string>
+#include <ctime>
 
 namespace batv {
 	bool		prvs_validate (const Batv_address&, unsigned int lifetime, const std::vector<unsigned char>& key);
 	Batv_address	prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const std::vector<unsigned char>& key);
+
+	// As above, but as of the given time instead of the prvs clock
+	bool		prvs_validate (const Batv_address&, unsigned int lifetime, const std::vector<unsigned char>& key, std::time_t now);
+	Batv_address	prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const std::vector<unsigned char>& key, std::time_t now);
+
+	// Sign with the current generation of keys, and validate with the generation
+	// named by the tag's key-num (the above use key-num 0)
+	bool		prvs_validate (const Batv_address&, unsigned int lifetime, const Key_entry& keys);
+	Batv_address	prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const Key_entry& keys);
+	bool		prvs_validate (const Batv_address&, unsigned int lifetime, const Key_entry& keys, std::time_t now);
+	Batv_address	prvs_generate (const Email_address& orig_mailfrom, unsigned int lifetime, const Key_entry& keys, std::time_t now);
+
+	// Get the expiration day (DDD) of a prvs tag.  Returns false if the tag-val
+	// isn't well-formed (K DDD SSSSSS), in which case it can't be valid.
+	bool		prvs_expiration_day (const Batv_address&, unsigned int& expiration_day);
+
+	// Replace the clock used to compute expiration days (std::time by default),
+	// e.g. to make benchmarks independent of the date.  Not thread-safe.
+	void		set_prvs_clock (std::time_t (*clock)());
 }
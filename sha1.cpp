@@ -0,0 +1,418 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#include "sha1.hpp"
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATV_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+using namespace batv;
+
+namespace {
+	typedef void (*Compress_fn)(uint32_t* state, const unsigned char* blocks, size_t num_blocks);
+
+	inline uint32_t rol (uint32_t x, int n)
+	{
+		return (x << n) | (x >> (32 - n));
+	}
+
+	inline uint32_t load_be32 (const unsigned char* p)
+	{
+		return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+			(static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+	}
+
+	inline void store_be32 (unsigned char* p, uint32_t x)
+	{
+		p[0] = x >> 24;
+		p[1] = x >> 16;
+		p[2] = x >> 8;
+		p[3] = x;
+	}
+
+	const uint32_t		initial_state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+	// The 80 rounds, given the message schedule with the round constants already added in
+	inline void compress_rounds (uint32_t* state, const uint32_t* wk)
+	{
+		uint32_t		a = state[0];
+		uint32_t		b = state[1];
+		uint32_t		c = state[2];
+		uint32_t		d = state[3];
+		uint32_t		e = state[4];
+		uint32_t		t;
+
+		for (int i = 0; i < 20; ++i) {
+			t = rol(a, 5) + (d ^ (b & (c ^ d))) + e + wk[i];
+			e = d; d = c; c = rol(b, 30); b = a; a = t;
+		}
+		for (int i = 20; i < 40; ++i) {
+			t = rol(a, 5) + (b ^ c ^ d) + e + wk[i];
+			e = d; d = c; c = rol(b, 30); b = a; a = t;
+		}
+		for (int i = 40; i < 60; ++i) {
+			t = rol(a, 5) + ((b & c) | (d & (b | c))) + e + wk[i];
+			e = d; d = c; c = rol(b, 30); b = a; a = t;
+		}
+		for (int i = 60; i < 80; ++i) {
+			t = rol(a, 5) + (b ^ c ^ d) + e + wk[i];
+			e = d; d = c; c = rol(b, 30); b = a; a = t;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+
+	void compress_scalar (uint32_t* state, const unsigned char* blocks, size_t num_blocks)
+	{
+		uint32_t		w[80];
+		for (; num_blocks > 0; --num_blocks, blocks += 64) {
+			for (int i = 0; i < 16; ++i) {
+				w[i] = load_be32(blocks + i * 4);
+			}
+			for (int i = 16; i < 80; ++i) {
+				w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+			}
+			for (int i = 0; i < 80; ++i) {
+				w[i] += i < 20 ? 0x5A827999 : i < 40 ? 0x6ED9EBA1 : i < 60 ? 0x8F1BBCDC : 0xCA62C1D6;
+			}
+			compress_rounds(state, w);
+		}
+	}
+
+#ifdef BATV_SHA1_X86
+	inline __attribute__((target("ssse3"))) __m128i rol1_epi32 (__m128i x)
+	{
+		return _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+	}
+
+	// Computes the message schedule four words at a time.  w[i+3] depends on w[i],
+	// which is computed in the same vector, so that lane is fixed up afterwards.
+	__attribute__((target("ssse3"))) void compress_ssse3 (uint32_t* state, const unsigned char* blocks, size_t num_blocks)
+	{
+		const __m128i		bswap_mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+		uint32_t		wk[80] __attribute__((aligned(16)));
+
+		for (; num_blocks > 0; --num_blocks, blocks += 64) {
+			__m128i		w[20];
+			__m128i		k = _mm_set1_epi32(0x5A827999);
+			for (int i = 0; i < 4; ++i) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + i * 16)), bswap_mask);
+				_mm_store_si128(reinterpret_cast<__m128i*>(wk + i * 4), _mm_add_epi32(w[i], k));
+			}
+			for (int i = 4; i < 20; ++i) {
+				// w[t-3..t], with the not-yet-known w[t] as 0
+				__m128i	x = _mm_srli_si128(w[i - 1], 4);
+				// w[t-14..t-11]
+				__m128i	w14 = _mm_alignr_epi8(w[i - 3], w[i - 4], 8);
+				x = _mm_xor_si128(_mm_xor_si128(x, w[i - 2]), _mm_xor_si128(w14, w[i - 4]));
+				x = rol1_epi32(x);
+				// fix up lane 3: w[t+3] ^= rol(w[t], 1)
+				x = _mm_xor_si128(x, rol1_epi32(_mm_slli_si128(x, 12)));
+				w[i] = x;
+
+				if (i == 5) {
+					k = _mm_set1_epi32(0x6ED9EBA1);
+				} else if (i == 10) {
+					k = _mm_set1_epi32(0x8F1BBCDC);
+				} else if (i == 15) {
+					k = _mm_set1_epi32(0xCA62C1D6);
+				}
+				_mm_store_si128(reinterpret_cast<__m128i*>(wk + i * 4), _mm_add_epi32(x, k));
+			}
+			compress_rounds(state, wk);
+		}
+	}
+
+#define SHA1NI_ROUNDS4(e_in, e_out, msg, func) \
+		e_in = _mm_sha1nexte_epu32(e_in, msg); \
+		e_out = abcd; \
+		abcd = _mm_sha1rnds4_epu32(abcd, e_in, func)
+
+	__attribute__((target("sha,sse4.1"))) void compress_sha_ni (uint32_t* state, const unsigned char* blocks, size_t num_blocks)
+	{
+		const __m128i		bswap_mask = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		__m128i			abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+		__m128i			e0 = _mm_set_epi32(state[4], 0, 0, 0);
+		__m128i			e1;
+		__m128i			msg0, msg1, msg2, msg3;
+
+		for (; num_blocks > 0; --num_blocks, blocks += 64) {
+			const __m128i	abcd_save = abcd;
+			const __m128i	e0_save = e0;
+
+			msg0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks)), bswap_mask);
+			msg1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16)), bswap_mask);
+			msg2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 32)), bswap_mask);
+			msg3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 48)), bswap_mask);
+
+			// Rounds 0-3
+			e0 = _mm_add_epi32(e0, msg0);
+			e1 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+			// Rounds 4-15
+			SHA1NI_ROUNDS4(e1, e0, msg1, 0);
+			msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+			SHA1NI_ROUNDS4(e0, e1, msg2, 0);
+			msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+			msg0 = _mm_xor_si128(msg0, msg2);
+			SHA1NI_ROUNDS4(e1, e0, msg3, 0);
+			msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+			msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+			msg1 = _mm_xor_si128(msg1, msg3);
+
+			// Rounds 16-67: each group of four rounds also advances the message schedule
+#define SHA1NI_SCHEDULE4(e_in, e_out, m0, m1, m2, m3, func) \
+			SHA1NI_ROUNDS4(e_in, e_out, m0, func); \
+			m1 = _mm_sha1msg2_epu32(m1, m0); \
+			m3 = _mm_sha1msg1_epu32(m3, m0); \
+			m2 = _mm_xor_si128(m2, m0)
+
+			SHA1NI_SCHEDULE4(e0, e1, msg0, msg1, msg2, msg3, 0);
+			SHA1NI_SCHEDULE4(e1, e0, msg1, msg2, msg3, msg0, 1);
+			SHA1NI_SCHEDULE4(e0, e1, msg2, msg3, msg0, msg1, 1);
+			SHA1NI_SCHEDULE4(e1, e0, msg3, msg0, msg1, msg2, 1);
+			SHA1NI_SCHEDULE4(e0, e1, msg0, msg1, msg2, msg3, 1);
+			SHA1NI_SCHEDULE4(e1, e0, msg1, msg2, msg3, msg0, 1);
+			SHA1NI_SCHEDULE4(e0, e1, msg2, msg3, msg0, msg1, 2);
+			SHA1NI_SCHEDULE4(e1, e0, msg3, msg0, msg1, msg2, 2);
+			SHA1NI_SCHEDULE4(e0, e1, msg0, msg1, msg2, msg3, 2);
+			SHA1NI_SCHEDULE4(e1, e0, msg1, msg2, msg3, msg0, 2);
+			SHA1NI_SCHEDULE4(e0, e1, msg2, msg3, msg0, msg1, 2);
+			SHA1NI_SCHEDULE4(e1, e0, msg3, msg0, msg1, msg2, 3);
+			SHA1NI_SCHEDULE4(e0, e1, msg0, msg1, msg2, msg3, 3);
+#undef SHA1NI_SCHEDULE4
+
+			// Rounds 68-79
+			SHA1NI_ROUNDS4(e1, e0, msg1, 3);
+			msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+			msg3 = _mm_xor_si128(msg3, msg1);
+			SHA1NI_ROUNDS4(e0, e1, msg2, 3);
+			msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+			SHA1NI_ROUNDS4(e1, e0, msg3, 3);
+
+			e0 = _mm_sha1nexte_epu32(e0, e0_save);
+			abcd = _mm_add_epi32(abcd, abcd_save);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+		state[4] = _mm_extract_epi32(e0, 3);
+	}
+
+#undef SHA1NI_ROUNDS4
+
+	bool cpu_has_ssse3 ()
+	{
+		unsigned int	eax, ebx, ecx, edx;
+		return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+	}
+
+	bool cpu_has_sha_ni ()
+	{
+		unsigned int	eax, ebx, ecx, edx;
+		if (!cpu_has_ssse3() || !__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+			return false;
+		}
+		if (__get_cpuid_max(0, NULL) < 7) {
+			return false;
+		}
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		return ebx & (1U << 29);
+	}
+#endif
+
+	struct Implementation {
+		const char*	name;
+		Compress_fn	compress;
+		bool		(*is_supported)();
+	};
+
+	bool always_supported ()
+	{
+		return true;
+	}
+
+	// In order of preference
+	const Implementation	implementations[] = {
+#ifdef BATV_SHA1_X86
+		{ "sha-ni", compress_sha_ni, cpu_has_sha_ni },
+		{ "ssse3", compress_ssse3, cpu_has_ssse3 },
+#endif
+		{ "scalar", compress_scalar, always_supported }
+	};
+	const size_t		num_implementations = sizeof(implementations) / sizeof(implementations[0]);
+
+	const Implementation* choose_implementation ()
+	{
+		for (size_t i = 0; i < num_implementations; ++i) {
+			if (implementations[i].is_supported()) {
+				return &implementations[i];
+			}
+		}
+		return &implementations[num_implementations - 1];
+	}
+
+	const Implementation*	implementation = choose_implementation();
+
+	inline void compress (uint32_t* state, const unsigned char* blocks, size_t num_blocks)
+	{
+		implementation->compress(state, blocks, num_blocks);
+	}
+
+	// Hash data_len more bytes, starting from state which has already absorbed prefix_len
+	// bytes (a multiple of 64), and write the digest to out.
+	void finish (unsigned char* out, uint32_t* state, size_t prefix_len, const unsigned char* data, size_t data_len)
+	{
+		const size_t		num_blocks = data_len / 64;
+		compress(state, data, num_blocks);
+		data += num_blocks * 64;
+
+		// Final one or two blocks: rest of data, 0x80, zeros, 64-bit bit length
+		const size_t		rest_len = data_len % 64;
+		unsigned char		tail[128];
+		const size_t		tail_len = rest_len < 56 ? 64 : 128;
+		std::memcpy(tail, data, rest_len);
+		tail[rest_len] = 0x80;
+		std::memset(tail + rest_len + 1, 0, tail_len - rest_len - 1 - 8);
+		const uint64_t		bit_len = static_cast<uint64_t>(prefix_len + data_len) * 8;
+		store_be32(tail + tail_len - 8, bit_len >> 32);
+		store_be32(tail + tail_len - 4, bit_len);
+		compress(state, tail, tail_len / 64);
+
+		for (int i = 0; i < 5; ++i) {
+			store_be32(out + i * 4, state[i]);
+		}
+	}
+}
+
+void	batv::Hmac_sha1_key::init (const unsigned char* key, size_t key_len)
+{
+	unsigned char		block[64];
+	std::memset(block, 0, sizeof(block));
+	if (key_len > 64) {
+		sha1(block, key, key_len);
+	} else if (key_len > 0) {
+		std::memcpy(block, key, key_len);
+	}
+
+	for (int i = 0; i < 64; ++i) {
+		block[i] ^= 0x36;
+	}
+	std::memcpy(inner, initial_state, sizeof(inner));
+	compress(inner, block, 1);
+
+	for (int i = 0; i < 64; ++i) {
+		block[i] ^= 0x36 ^ 0x5C;
+	}
+	std::memcpy(outer, initial_state, sizeof(outer));
+	compress(outer, block, 1);
+}
+
+void	batv::hmac_sha1 (unsigned char* out, const Hmac_sha1_key& key, const unsigned char* data, size_t data_len)
+{
+	uint32_t		state[5];
+	unsigned char		inner_hash[20];
+
+	std::memcpy(state, key.inner, sizeof(state));
+	finish(inner_hash, state, 64, data, data_len);
+
+	std::memcpy(state, key.outer, sizeof(state));
+	finish(out, state, 64, inner_hash, sizeof(inner_hash));
+}
+
+void	batv::hmac_sha1 (unsigned char* out, const unsigned char* key, size_t key_len, const unsigned char* data, size_t data_len)
+{
+	Hmac_sha1_key		hmac_key;
+	hmac_key.init(key, key_len);
+	hmac_sha1(out, hmac_key, data, data_len);
+}
+
+void	batv::sha1 (unsigned char* out, const unsigned char* data, size_t data_len)
+{
+	uint32_t		state[5];
+	std::memcpy(state, initial_state, sizeof(state));
+	finish(out, state, 0, data, data_len);
+}
+
+void	batv::hkdf_sha1_extract (unsigned char* prk_out, const unsigned char* salt, size_t salt_len, const unsigned char* ikm, size_t ikm_len)
+{
+	// A missing salt is HashLen zeros, which HMAC pads to the same key as no salt at all
+	hmac_sha1(prk_out, salt, salt_len, ikm, ikm_len);
+}
+
+void	batv::hkdf_sha1_expand (unsigned char* out, size_t out_len, const unsigned char* prk, size_t prk_len, const unsigned char* info, size_t info_len)
+{
+	// T(i) = HMAC-Hash(PRK, T(i-1) | info | i)
+	Hmac_sha1_key		hmac_key;
+	hmac_key.init(prk, prk_len);
+
+	std::vector<unsigned char>	input(20 + info_len + 1);
+	unsigned char		t[20];
+	size_t			t_len = 0;
+	for (unsigned int i = 1; out_len > 0; ++i) {
+		std::memcpy(&input[0], t, t_len);
+		if (info_len) {
+			std::memcpy(&input[t_len], info, info_len);
+		}
+		input[t_len + info_len] = i;
+		hmac_sha1(t, hmac_key, &input[0], t_len + info_len + 1);
+		t_len = 20;
+
+		const size_t	n = out_len < 20 ? out_len : 20;
+		std::memcpy(out, t, n);
+		out += n;
+		out_len -= n;
+	}
+}
+
+const char*	batv::sha1_implementation ()
+{
+	return implementation->name;
+}
+
+bool		batv::set_sha1_implementation (const char* name)
+{
+	for (size_t i = 0; i < num_implementations; ++i) {
+		if (std::strcmp(implementations[i].name, name) == 0 && implementations[i].is_supported()) {
+			implementation = &implementations[i];
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace batv {
+	// HMAC-SHA1, specialized for the short messages hashed by prvs.
+	// The SHA-1 compression function is selected at startup based on the CPU:
+	// SHA-NI if available, otherwise SSSE3 (for the message schedule), otherwise scalar.
+
+	// An HMAC key, reduced to the SHA-1 states after the inner and outer padded key blocks,
+	// so that computing a MAC costs only the compression of the message and one outer block.
+	struct Hmac_sha1_key {
+		uint32_t	inner[5];	// state after compressing (key XOR ipad)
+		uint32_t	outer[5];	// state after compressing (key XOR opad)
+
+		void		init (const unsigned char* key, size_t key_len);
+	};
+
+	void		hmac_sha1 (unsigned char* out, const Hmac_sha1_key& key, const unsigned char* data, size_t data_len);
+	void		hmac_sha1 (unsigned char* out, const unsigned char* key, size_t key_len, const unsigned char* data, size_t data_len);
+	void		sha1 (unsigned char* out, const unsigned char* data, size_t data_len);
+
+	// HKDF (RFC 5869) with SHA-1: extract a 20 byte pseudorandom key from input keying
+	// material, and expand it into out_len (at most 255*20) bytes of output keying material
+	void		hkdf_sha1_extract (unsigned char* prk_out, const unsigned char* salt, size_t salt_len, const unsigned char* ikm, size_t ikm_len);
+	void		hkdf_sha1_expand (unsigned char* out, size_t out_len, const unsigned char* prk, size_t prk_len, const unsigned char* info, size_t info_len);
+
+	// The name of the SHA-1 implementation in use ("sha-ni", "ssse3", or "scalar")
+	const char*	sha1_implementation ();
+
+	// Use the named implementation instead (for benchmarking).  Returns false if
+	// the implementation is unknown or not supported by this CPU.  Not thread-safe.
+	bool		set_sha1_implementation (const char* name);
+}
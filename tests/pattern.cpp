@@ -0,0 +1,163 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+// Tests for address patterns, and for which key map entry applies to a sender.
+//
+//	make check
+
+#include "../pattern.hpp"
+#include "../key.hpp"
+#include "../common.hpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace batv;
+
+namespace {
+	unsigned int	num_failed;
+
+	void check (bool ok, const std::string& str, const char* what)
+	{
+		if (!ok) {
+			std::cout << "FAIL: " << str << ": " << what << std::endl;
+			++num_failed;
+		}
+	}
+
+	// Compile the given patterns (separated by spaces), and check which one str matches first
+	void check_match (const char* patterns, const std::string& str, int expected)
+	{
+		Pattern_set		set;
+		std::istringstream	patterns_in(patterns);
+		std::string		pattern;
+		while (patterns_in >> pattern) {
+			set.add(pattern);
+		}
+		set.compile();
+		std::ostringstream	what;
+		what << "should match pattern " << expected << " of \"" << patterns << "\"";
+		check(set.match(str.data(), str.size()) == expected, str, what.str().c_str());
+	}
+
+	void check_patterns ()
+	{
+		// Case folding, of both patterns and strings
+		check_match("*@Example.COM", "bob@example.com", 0);
+		check_match("*@example.com", "BOB@EXAMPLE.COM", 0);
+		check_match("bob@example.com", "bob@example.org", -1);
+
+		// '?' matches exactly one character, '*' any number
+		check_match("a?c", "abc", 0);
+		check_match("a?c", "ac", -1);
+		check_match("a?c", "abbc", -1);
+		check_match("a?c", "a\xff" "c", 0);
+		check_match("a*c", "ac", 0);
+		check_match("a*c", "abbc", 0);
+		check_match("a*c", "abcd", -1);
+		check_match("*", "", 0);
+		check_match("?", "", -1);
+
+		// The first matching pattern in the order added wins
+		check_match("* a*", "abc", 0);
+		check_match("a* *", "abc", 0);
+		check_match("a* *", "bc", 1);
+
+		// Overlapping patterns
+		check_match("a*b*c *bc", "abc", 0);
+		check_match("a*b*c *bc", "xbc", 1);
+		check_match("a*b*c *bc", "abxc", 0);
+		check_match("a*b*c *bc", "xbxc", -1);
+		check_match("*-*@example.com *@*.example.com", "a-b@mail.example.com", 1);
+
+		// Adding a pattern twice (in any case) gives the index it already has
+		Pattern_set		set;
+		check(set.add("A*") == 0 && set.add("b*") == 1 && set.add("a*") == 0 && set.size() == 2, "a*", "should be added once");
+		check(set.find("B*") == 1 && set.find("c*") == -1, "b*", "should be found case-insensitively");
+
+		// Patterns whose DFA would be huge (any string with an 'a' 24 characters from
+		// the end, which needs a state for every combination of the last 24 characters)
+		// are rejected
+		Pattern_set		complex;
+		complex.add("*a????????????????????????");
+		bool			threw = false;
+		try {
+			complex.compile();
+		} catch (const Config_error&) {
+			threw = true;
+		}
+		check(threw, "*a????????????????????????", "should be too complex");
+	}
+
+	// Check which entry (identified by its one-byte key) of the key map applies to a sender,
+	// where 0 means none does
+	void check_entry (const Key_map& key_map, const std::string& sender, unsigned int expected)
+	{
+		Key_ref			key(get_key(key_map, sender));
+		std::ostringstream	what;
+		what << "should get key " << expected;
+		check(expected ? key.get() && key->current_key().size() == 1 && key->current_key()[0] == expected : !key, sender, what.str().c_str());
+	}
+
+	void check_key_map ()
+	{
+		std::istringstream	key_map_in(
+			"alice@example.com	hex:01\n"
+			"a*@example.com		hex:02\n"
+			"al*@example.com		hex:03\n"
+			"@example.com		hex:04\n"
+			"@sub.example.com	hex:05\n"
+			"*			hex:06\n"
+			"noreply-*@example.com	/dev/null\n"
+			"@optout.example.com	/dev/null\n");
+		Key_map			key_map;
+		load_key_map(key_map, key_map_in);
+
+		check_entry(key_map, "alice@example.com", 1);			// the address, over patterns
+		check_entry(key_map, "alice@Example.Com", 1);
+		check_entry(key_map, "albert@example.com", 2);			// the first matching pattern
+		check_entry(key_map, "bob@example.com", 4);			// the domain
+		check_entry(key_map, "bob@sub.example.com", 5);		// the most specific domain
+		check_entry(key_map, "bob@mail.sub.example.com", 5);
+		check_entry(key_map, "bob@mail.example.com", 4);
+		check_entry(key_map, "bob@example.org", 6);			// "*"
+		check_entry(key_map, "noreply-list@example.com", 0);		// an empty key opts out...
+		check_entry(key_map, "bob@optout.example.com", 0);
+		check_entry(key_map, "bob@mail.optout.example.com", 0);	// ... of parent domains' keys too
+		check_entry(key_map, "albert@optout.example.com", 0);
+	}
+}
+
+int main ()
+{
+	check_patterns();
+	check_key_map();
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2013 Andrew Ayer
+ *
+ * This file is part of batv-tools.
+ *
+ * batv-tools is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * batv-tools is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with batv-tools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Additional permission under GNU GPL version 3 section 7:
+ *
+ * If you modify the Program, or any covered work, by linking or
+ * combining it with the OpenSSL project's OpenSSL library (or a
+ * modified version of that library), containing parts covered by the
+ * terms of the OpenSSL or SSLeay licenses, the licensors of the Program
+ * grant you additional permission to convey the resulting work.
+ * Corresponding Source for a non-source form of such a combination
+ * shall include the source code for the parts of OpenSSL used as well
+ * as that of the covered work.
+ */
+
+// Regression tests for handling malformed prvs tags.
+//
+//	make check
+
+#include "../prvs.hpp"
+#include "../address.hpp"
+#include <iostream>
+#include <vector>
+
+using namespace batv;
+
+namespace {
+	unsigned int	num_failed;
+
+	void check (bool ok, const char* address, const char* what)
+	{
+		if (!ok) {
+			std::cout << "FAIL: " << address << ": " << what << std::endl;
+			++num_failed;
+		}
+	}
+
+	// A prvs address which parses but whose tag-val is malformed has no expiration day and never validates
+	void check_malformed (const char* address, char sub_address_delimiter)
+	{
+		Email_address		email_address;
+		Batv_address		batv_address;
+		unsigned int		expiration_day;
+		std::vector<unsigned char> key(16, 'k');
+
+		email_address.parse(address);
+		check(batv_address.parse(email_address, sub_address_delimiter), address, "should parse as a BATV address");
+		check(!prvs_expiration_day(batv_address, expiration_day), address, "should have no expiration day");
+		check(!prvs_validate(batv_address, 999, key), address, "should not validate");
+	}
+}
+
+int main ()
+{
+	check_malformed("prvs==alice@example.com", 0);		// empty tag-val
+	check_malformed("alice+prvs=@example.com", '+');	// empty tag-val
+	check_malformed("prvs=012=alice@example.com", 0);	// short tag-val
+	check_malformed("alice+prvs=01@example.com", '+');	// short tag-val
+	check_malformed("prvs=0x23abcdef=alice@example.com", 0);// non-numeric expiration day
+
+	Email_address		email_address;
+	unsigned int		expiration_day = 0;
+	std::vector<unsigned char> key(16, 'k');
+	email_address.parse("alice@example.com");
+	Batv_address		signed_address(prvs_generate(email_address, 7, key, 1369699200));
+	check(prvs_expiration_day(signed_address, expiration_day) && expiration_day == (1369699200 / 86400 + 7) % 1000,
+			signed_address.make_string(0).c_str(), "should have the expiration day it was signed with");
+
+	return num_failed ? 1 : 0;
+}